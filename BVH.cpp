@@ -0,0 +1,1461 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <mutex>
+
+#include "BVH.h"
+#include "RadixSort.h"
+
+const float BVH::traversalCost = 1.0f;
+const float BVH::intersectionCost = 1.0f;
+
+static inline glm::vec3 meshVertex(const Mesh &mesh, unsigned int i)
+{
+	return glm::vec3(mesh.positions[3 * (size_t)i], mesh.positions[3 * (size_t)i + 1], mesh.positions[3 * (size_t)i + 2]);
+}
+
+// First triangle of worker w's share when a node's range is split between workers
+static inline int sliceStart(const BVHNode &node, size_t w, size_t workers)
+{
+	return node.leftFirst + (int)((size_t)node.count * w / workers);
+}
+
+static inline float nodeArea(const BVHNode &node)
+{
+	glm::vec3 e = node.boundsMax - node.boundsMin;
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+// Building
+// --------
+void BVH::build(const Mesh &mesh)
+{
+	beginBuild(mesh, NULL);
+	if (!buildNodes.empty()) subdivide(0, 1, NULL);
+	endBuild();
+}
+
+// Same build over arbitrary boxes instead of triangles (the top-level BVH over a scene's instances uses this), leaves
+// reference ranges of triIndices, which hold indices into primitiveBounds
+void BVH::build(const std::vector<AABB> &primitiveBounds)
+{
+	if (binCount < 2) binCount = 2;
+	if (binCount > maxBins) binCount = maxBins;
+
+	nodes.clear();
+	buildNodes.clear();
+	triIndices.resize(primitiveBounds.size());
+	if (!primitiveBounds.empty())
+	{
+		triBounds = primitiveBounds;
+		centroids.resize(triBounds.size());
+		for (size_t i = 0; i < triBounds.size(); i++)
+		{
+			centroids[i] = (triBounds[i].min + triBounds[i].max) * 0.5f;
+			triIndices[i] = (unsigned int)i;
+		}
+		createRoot();
+		subdivide(0, 1, NULL);
+	}
+	endBuild();
+}
+
+// The top of the tree (nodes with at least parallelSplitThreshold triangles) is split level by level on this thread, with the
+// binning and partitioning of each node spread over all workers. Everything below becomes subtree tasks, which keep handing
+// their large children to the pool so idle workers can steal them
+void BVH::buildParallel(const Mesh &mesh, ThreadPool &pool)
+{
+	beginBuild(mesh, &pool);
+
+	// (node, descendant block) pairs
+	std::vector<std::pair<int, int> > topLevel, subtrees;
+	if (!buildNodes.empty()) topLevel.push_back(std::make_pair(0, 1));
+
+	if (pool.size() > 1)
+	{
+		binArena.resize((size_t)pool.size() * 3 * binCount);
+		partitionScratch.resize(triIndices.size());
+	}
+
+	while (!topLevel.empty())
+	{
+		std::pair<int, int> item = topLevel.back();
+		topLevel.pop_back();
+
+		const BVHNode &node = buildNodes[item.first];
+		if (node.count < parallelSplitThreshold || pool.size() == 1)
+		{
+			subtrees.push_back(item);
+			continue;
+		}
+
+		Split split;
+		if (!findBestSplitParallel(node, split, pool) || split.cost >= node.count * intersectionCost) continue; // stays a leaf
+
+		int mid = partitionParallel(node, split, pool);
+		makeChildren(item.first, item.second, split, mid);
+
+		int leftChild = item.second;
+		topLevel.push_back(std::make_pair(leftChild, leftChild + 2));
+		topLevel.push_back(std::make_pair(leftChild + 1, leftChild + 2 * buildNodes[leftChild].count));
+	}
+
+	for (size_t i = 0; i < subtrees.size(); i++)
+	{
+		std::pair<int, int> item = subtrees[i];
+		pool.submit([this, item, &pool] { subdivide(item.first, item.second, &pool); });
+	}
+	pool.wait();
+
+	endBuild();
+}
+
+// Computes per triangle bounds and centroids (in parallel if a pool is given) and creates the root node
+void BVH::beginBuild(const Mesh &mesh, ThreadPool *pool)
+{
+	unsigned int triCount = mesh.triangleCount();
+	if (binCount < 2) binCount = 2;
+	if (binCount > maxBins) binCount = maxBins;
+
+	nodes.clear();
+	buildNodes.clear();
+	triIndices.resize(triCount);
+	if (triCount == 0) return;
+
+	triBounds.resize(triCount);
+	centroids.resize(triCount);
+	std::function<void(size_t, size_t)> prepare = [this, &mesh](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			AABB bounds;
+			bounds.grow(meshVertex(mesh, mesh.indices[3 * i]));
+			bounds.grow(meshVertex(mesh, mesh.indices[3 * i + 1]));
+			bounds.grow(meshVertex(mesh, mesh.indices[3 * i + 2]));
+			triBounds[i] = bounds;
+			centroids[i] = (bounds.min + bounds.max) * 0.5f;
+			triIndices[i] = (unsigned int)i;
+		}
+	};
+	if (pool != NULL) pool->parallelFor(triCount, prepare);
+	else prepare(0, triCount);
+
+	createRoot();
+}
+
+// Creates the root node over every entry of triBounds
+void BVH::createRoot()
+{
+	size_t count = triBounds.size();
+	buildNodes.resize(2 * count - 1); // root plus its block of 2 * count - 2 descendants
+	BVHNode &root = buildNodes[0];
+	root.leftFirst = 0;
+	root.count = (int)count;
+
+	AABB bounds;
+	for (size_t i = 0; i < count; i++)
+		bounds.grow(triBounds[i]);
+	root.boundsMin = bounds.min;
+	root.boundsMax = bounds.max;
+}
+
+void BVH::endBuild()
+{
+	compactNodes();
+
+	std::vector<BVHNode>().swap(buildNodes);
+	std::vector<AABB>().swap(triBounds);
+	std::vector<glm::vec3>().swap(centroids);
+	std::vector<Bin>().swap(binArena);
+	std::vector<unsigned int>().swap(partitionScratch);
+
+	markRebuilt();
+}
+
+// Copies the used slots of buildNodes into nodes in depth-first order (sibling pairs stay adjacent)
+void BVH::compactNodes()
+{
+	nodes.clear();
+	if (buildNodes.empty()) return;
+
+	size_t used = 0;
+	std::vector<int> stack(1, 0);
+	while (!stack.empty())
+	{
+		const BVHNode &node = buildNodes[stack.back()];
+		stack.pop_back();
+		used++;
+		if (!node.isLeaf())
+		{
+			stack.push_back(node.leftFirst);
+			stack.push_back(node.leftFirst + 1);
+		}
+	}
+	nodes.reserve(used);
+
+	// (source slot, destination index), right child pushed first so left subtrees are laid out first
+	std::vector<std::pair<int, int> > work(1, std::make_pair(0, 0));
+	nodes.push_back(buildNodes[0]);
+	while (!work.empty())
+	{
+		std::pair<int, int> item = work.back();
+		work.pop_back();
+
+		const BVHNode &node = buildNodes[item.first];
+		if (node.isLeaf()) continue;
+
+		int childIndex = (int)nodes.size();
+		nodes.push_back(buildNodes[node.leftFirst]);
+		nodes.push_back(buildNodes[node.leftFirst + 1]);
+		nodes[item.second].leftFirst = childIndex;
+
+		work.push_back(std::make_pair(node.leftFirst + 1, childIndex + 1));
+		work.push_back(std::make_pair(node.leftFirst, childIndex));
+	}
+}
+
+// Splits the node's triangle range in two if the SAH says that is cheaper than testing them all, then recurses into both halves
+// The children go into the first two slots of the node's block, the rest of the block is shared out between their subtrees
+void BVH::subdivide(int nodeIndex, int blockStart, ThreadPool *pool)
+{
+	Split split;
+	const BVHNode &node = buildNodes[nodeIndex];
+	if (node.count <= 1 || !findBestSplit(node, split)) return;
+	if (split.cost >= node.count * intersectionCost) return; // a leaf is cheaper
+
+	int mid = partition(node, split);
+	makeChildren(nodeIndex, blockStart, split, mid);
+
+	int leftChild = blockStart;
+	int rightCount = buildNodes[leftChild + 1].count;
+	int rightBlock = blockStart + 2 * buildNodes[leftChild].count;
+	if (pool != NULL && rightCount >= taskThreshold)
+		pool->submit([this, leftChild, rightBlock, pool] { subdivide(leftChild + 1, rightBlock, pool); });
+	else subdivide(leftChild + 1, rightBlock, pool);
+	subdivide(leftChild, blockStart + 2, pool);
+}
+
+// Turns the node into an interior node whose children cover [leftFirst, mid) and [mid, end) of its triangle range
+void BVH::makeChildren(int nodeIndex, int blockStart, const Split &split, int mid)
+{
+	BVHNode &node = buildNodes[nodeIndex];
+	BVHNode &left = buildNodes[blockStart];
+	BVHNode &right = buildNodes[blockStart + 1];
+
+	left.leftFirst = node.leftFirst;
+	left.count = mid - node.leftFirst;
+	left.boundsMin = split.leftBounds.min;
+	left.boundsMax = split.leftBounds.max;
+
+	right.leftFirst = mid;
+	right.count = node.count - left.count;
+	right.boundsMin = split.rightBounds.min;
+	right.boundsMax = split.rightBounds.max;
+
+	node.leftFirst = blockStart;
+	node.count = 0;
+}
+
+// Bins the node's triangle centroids along all three axes in one pass and picks the cheapest split
+bool BVH::findBestSplit(const BVHNode &node, Split &split) const
+{
+	AABB centroidBounds;
+	for (int i = node.leftFirst; i < node.leftFirst + node.count; i++)
+		centroidBounds.grow(centroids[triIndices[i]]);
+
+	Bin bins[3 * maxBins];
+	glm::vec3 scale;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+		scale[axis] = extent > 0.0f ? binCount / extent : 0.0f;
+	}
+	for (int i = node.leftFirst; i < node.leftFirst + node.count; i++)
+	{
+		unsigned int tri = triIndices[i];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			int b = (int)((centroids[tri][axis] - centroidBounds.min[axis]) * scale[axis]);
+			Bin &bin = bins[axis * binCount + (b < binCount - 1 ? b : binCount - 1)];
+			bin.count++;
+			bin.bounds.grow(triBounds[tri]);
+		}
+	}
+
+	AABB parent;
+	parent.grow(node.boundsMin);
+	parent.grow(node.boundsMax);
+	return evaluateBins(bins, centroidBounds, parent.area(), split);
+}
+
+// Sweeps the bin boundaries of the three histograms (bins laid out [axis][binCount]) for the lowest SAH cost
+bool BVH::evaluateBins(const Bin *bins, const AABB &centroidBounds, float parentArea, Split &split) const
+{
+	if (parentArea <= 0.0f) return false;
+
+	split.cost = 1e30f;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+		if (extent <= 0.0f) continue; // every centroid on one plane, nothing to split
+		const Bin *axisBins = bins + axis * binCount;
+
+		// Sweep from both ends at once, plane p separates bins [0, p] from [p + 1, binCount)
+		AABB leftBoxes[maxBins - 1], rightBoxes[maxBins - 1];
+		int leftTris[maxBins - 1], rightTris[maxBins - 1];
+		AABB leftBox, rightBox;
+		int leftSum = 0, rightSum = 0;
+		for (int p = 0; p < binCount - 1; p++)
+		{
+			leftSum += axisBins[p].count;
+			leftBox.grow(axisBins[p].bounds);
+			leftTris[p] = leftSum;
+			leftBoxes[p] = leftBox;
+
+			rightSum += axisBins[binCount - 1 - p].count;
+			rightBox.grow(axisBins[binCount - 1 - p].bounds);
+			rightTris[binCount - 2 - p] = rightSum;
+			rightBoxes[binCount - 2 - p] = rightBox;
+		}
+
+		for (int p = 0; p < binCount - 1; p++)
+		{
+			if (leftTris[p] == 0 || rightTris[p] == 0) continue;
+			float cost = traversalCost + intersectionCost * (leftTris[p] * leftBoxes[p].area() + rightTris[p] * rightBoxes[p].area()) / parentArea;
+			if (cost < split.cost)
+			{
+				split.axis = axis;
+				split.bin = p + 1;
+				split.binCount = binCount;
+				split.centroidMin = centroidBounds.min[axis];
+				split.binScale = binCount / extent;
+				split.cost = cost;
+				split.leftBounds = leftBoxes[p];
+				split.rightBounds = rightBoxes[p];
+			}
+		}
+	}
+
+	return split.cost < 1e30f;
+}
+
+// Partitions the node's triangle range in place around the split bin, returns the first index of the right side
+int BVH::partition(const BVHNode &node, const Split &split)
+{
+	int i = node.leftFirst, j = node.leftFirst + node.count - 1;
+	while (i <= j)
+	{
+		if (split.binOf(centroids[triIndices[i]]) < split.bin) i++;
+		else std::swap(triIndices[i], triIndices[j--]);
+	}
+	return i;
+}
+
+// Same as findBestSplit, every worker bins its slice of the node into its own histograms in binArena which are then summed
+bool BVH::findBestSplitParallel(const BVHNode &node, Split &split, ThreadPool &pool)
+{
+	size_t workers = pool.size();
+	std::vector<AABB> partialBounds(workers);
+	pool.parallelFor(workers, [&](size_t begin, size_t end) {
+		for (size_t w = begin; w < end; w++)
+		{
+			AABB bounds;
+			for (int i = sliceStart(node, w, workers); i < sliceStart(node, w + 1, workers); i++)
+				bounds.grow(centroids[triIndices[i]]);
+			partialBounds[w] = bounds;
+		}
+	});
+	AABB centroidBounds;
+	for (size_t w = 0; w < workers; w++)
+		centroidBounds.grow(partialBounds[w]);
+
+	glm::vec3 scale;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+		scale[axis] = extent > 0.0f ? binCount / extent : 0.0f;
+	}
+
+	pool.parallelFor(workers, [&](size_t begin, size_t end) {
+		for (size_t w = begin; w < end; w++)
+		{
+			Bin *bins = &binArena[w * 3 * binCount];
+			for (int b = 0; b < 3 * binCount; b++)
+				bins[b] = Bin();
+
+			for (int i = sliceStart(node, w, workers); i < sliceStart(node, w + 1, workers); i++)
+			{
+				unsigned int tri = triIndices[i];
+				for (int axis = 0; axis < 3; axis++)
+				{
+					int b = (int)((centroids[tri][axis] - centroidBounds.min[axis]) * scale[axis]);
+					Bin &bin = bins[axis * binCount + (b < binCount - 1 ? b : binCount - 1)];
+					bin.count++;
+					bin.bounds.grow(triBounds[tri]);
+				}
+			}
+		}
+	});
+
+	Bin bins[3 * maxBins];
+	for (size_t w = 0; w < workers; w++)
+	{
+		for (int b = 0; b < 3 * binCount; b++)
+		{
+			bins[b].count += binArena[w * 3 * binCount + b].count;
+			bins[b].bounds.grow(binArena[w * 3 * binCount + b].bounds);
+		}
+	}
+
+	AABB parent;
+	parent.grow(node.boundsMin);
+	parent.grow(node.boundsMax);
+	return evaluateBins(bins, centroidBounds, parent.area(), split);
+}
+
+// Stable partition through partitionScratch: every worker counts the left-going triangles of its slice, a prefix sum over
+// those counts gives each worker its write offsets, and the scattered result is copied back
+int BVH::partitionParallel(const BVHNode &node, const Split &split, ThreadPool &pool)
+{
+	size_t workers = pool.size();
+	std::vector<int> leftCounts(workers, 0);
+	pool.parallelFor(workers, [&](size_t begin, size_t end) {
+		for (size_t w = begin; w < end; w++)
+			for (int i = sliceStart(node, w, workers); i < sliceStart(node, w + 1, workers); i++)
+				if (split.binOf(centroids[triIndices[i]]) < split.bin) leftCounts[w]++;
+	});
+
+	std::vector<int> leftOffsets(workers), rightOffsets(workers);
+	int leftTotal = 0;
+	for (size_t w = 0; w < workers; w++)
+	{
+		leftOffsets[w] = node.leftFirst + leftTotal;
+		leftTotal += leftCounts[w];
+	}
+	for (size_t w = 0; w < workers; w++)
+		rightOffsets[w] = leftTotal + sliceStart(node, w, workers) - (leftOffsets[w] - node.leftFirst);
+
+	pool.parallelFor(workers, [&](size_t begin, size_t end) {
+		for (size_t w = begin; w < end; w++)
+		{
+			int left = leftOffsets[w], right = rightOffsets[w];
+			for (int i = sliceStart(node, w, workers); i < sliceStart(node, w + 1, workers); i++)
+			{
+				unsigned int tri = triIndices[i];
+				if (split.binOf(centroids[tri]) < split.bin) partitionScratch[left++] = tri;
+				else partitionScratch[right++] = tri;
+			}
+		}
+	});
+	pool.parallelFor(node.count, [&](size_t begin, size_t end) {
+		std::copy(partitionScratch.begin() + node.leftFirst + begin, partitionScratch.begin() + node.leftFirst + end, triIndices.begin() + node.leftFirst + begin);
+	});
+
+	return node.leftFirst + leftTotal;
+}
+
+// Linear BVH
+// ----------
+// Spreads the low 10 bits of v so there are two zero bits between each of them
+static inline unsigned int expandBits10(unsigned int v)
+{
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+// Spreads the low 21 bits of v so there are two zero bits between each of them
+static inline unsigned long long expandBits21(unsigned long long v)
+{
+	v &= 0x1fffff;
+	v = (v | (v << 32)) & 0x001f00000000ffffull;
+	v = (v | (v << 16)) & 0x001f0000ff0000ffull;
+	v = (v | (v << 8)) & 0x100f00f00f00f00full;
+	v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+	v = (v | (v << 2)) & 0x1249249249249249ull;
+	return v;
+}
+
+static inline int countLeadingZeros(unsigned int v) { return __builtin_clz(v); }
+static inline int countLeadingZeros(unsigned long long v) { return __builtin_clzll(v); }
+
+// Length of the common prefix of the keys at sorted positions i and j (-1 if j is out of range)
+// Equal keys are told apart by their positions, so every key behaves as if it were unique
+template <typename Key>
+static inline int commonPrefix(const Key *keys, int count, int i, int j)
+{
+	if (j < 0 || j >= count) return -1;
+	if (keys[i] == keys[j]) return (int)sizeof(Key) * 8 + countLeadingZeros((unsigned int)(i ^ j));
+	return countLeadingZeros((Key)(keys[i] ^ keys[j]));
+}
+
+void BVH::buildLBVH(const Mesh &mesh, ThreadPool &pool, int mortonBits)
+{
+	beginBuild(mesh, &pool);
+	size_t triCount = triIndices.size();
+	if (triCount == 0)
+	{
+		endBuild();
+		return;
+	}
+
+	// Quantize the centroids into the grid spanned by their bounds
+	std::vector<AABB> partialBounds(pool.size());
+	pool.parallelFor(pool.size(), [&](size_t begin, size_t end) {
+		for (size_t w = begin; w < end; w++)
+			for (size_t i = triCount * w / pool.size(); i < triCount * (w + 1) / pool.size(); i++)
+				partialBounds[w].grow(centroids[i]);
+	});
+	AABB centroidBounds;
+	for (size_t w = 0; w < partialBounds.size(); w++)
+		centroidBounds.grow(partialBounds[w]);
+	glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+
+	if (mortonBits > 30)
+	{
+		const float cells = (float)(1 << 21);
+		glm::vec3 scale(extent.x > 0.0f ? cells / extent.x : 0.0f, extent.y > 0.0f ? cells / extent.y : 0.0f, extent.z > 0.0f ? cells / extent.z : 0.0f);
+
+		std::vector<unsigned long long> keys(triCount);
+		pool.parallelFor(triCount, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+			{
+				glm::vec3 cell = (centroids[i] - centroidBounds.min) * scale;
+				keys[i] = (expandBits21((unsigned long long)glm::min(cell.x, cells - 1.0f)) << 2) |
+						  (expandBits21((unsigned long long)glm::min(cell.y, cells - 1.0f)) << 1) |
+						  expandBits21((unsigned long long)glm::min(cell.z, cells - 1.0f));
+			}
+		});
+		emitLBVH(keys, 63, pool);
+	}
+	else
+	{
+		const float cells = (float)(1 << 10);
+		glm::vec3 scale(extent.x > 0.0f ? cells / extent.x : 0.0f, extent.y > 0.0f ? cells / extent.y : 0.0f, extent.z > 0.0f ? cells / extent.z : 0.0f);
+
+		std::vector<unsigned int> keys(triCount);
+		pool.parallelFor(triCount, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+			{
+				glm::vec3 cell = (centroids[i] - centroidBounds.min) * scale;
+				keys[i] = (expandBits10((unsigned int)glm::min(cell.x, cells - 1.0f)) << 2) |
+						  (expandBits10((unsigned int)glm::min(cell.y, cells - 1.0f)) << 1) |
+						  expandBits10((unsigned int)glm::min(cell.z, cells - 1.0f));
+			}
+		});
+		emitLBVH(keys, 30, pool);
+	}
+
+	endBuild();
+}
+
+// Sorts the triangles by key and builds the hierarchy into buildNodes
+// Karras' internal node k (k in [0, count - 1)) covers a range of sorted triangles that has k at one end, its children sit
+// in slots 1 + 2k and 2 + 2k, and the root (internal node 0) in slot 0. Every internal node is found independently in
+// parallel, then bounds are computed bottom-up: a task per leaf climbs towards the root, and of the two children of a node
+// only the one that arrives second continues upwards (so both child bounds are known)
+template <typename Key>
+void BVH::emitLBVH(std::vector<Key> &keys, int keyBits, ThreadPool &pool)
+{
+	radixSort(keys, triIndices, keyBits, pool);
+
+	int count = (int)keys.size();
+	if (count == 1) return; // the root from beginBuild is already the only leaf
+
+	std::vector<int> internalSlot(count - 1); // slot of each internal node
+	std::vector<int> leafSlot(count);		  // slot of each sorted triangle's leaf
+	std::vector<int> rangeFirst(count - 1), rangeCount(count - 1);
+	internalSlot[0] = 0;
+
+	const Key *sorted = keys.data();
+	pool.parallelFor(count - 1, [&](size_t begin, size_t end) {
+		for (int i = (int)begin; i < (int)end; i++)
+		{
+			// direction of the range: towards the neighbour sharing the longer prefix
+			int d = commonPrefix(sorted, count, i, i + 1) - commonPrefix(sorted, count, i, i - 1) >= 0 ? 1 : -1;
+
+			// the other end j: every key in the range shares more than dMin bits with key i
+			int dMin = commonPrefix(sorted, count, i, i - d);
+			int lMax = 2;
+			while (commonPrefix(sorted, count, i, i + lMax * d) > dMin) lMax *= 2;
+			int l = 0;
+			for (int t = lMax / 2; t >= 1; t /= 2)
+				if (commonPrefix(sorted, count, i, i + (l + t) * d) > dMin) l += t;
+			int j = i + l * d;
+
+			// split: the last position still sharing more than the range's common prefix with key i
+			int dNode = commonPrefix(sorted, count, i, j);
+			int s = 0;
+			for (int t = l;;)
+			{
+				t = (t + 1) / 2;
+				if (commonPrefix(sorted, count, i, i + (s + t) * d) > dNode) s += t;
+				if (t <= 1) break;
+			}
+			int gamma = i + s * d + (d < 0 ? -1 : 0);
+
+			int first = i < j ? i : j;
+			int last = i < j ? j : i;
+			rangeFirst[i] = first;
+			rangeCount[i] = last - first + 1;
+
+			for (int side = 0; side < 2; side++)
+			{
+				int child = gamma + side;
+				int slot = 1 + 2 * i + side;
+				BVHNode &node = buildNodes[slot];
+				bool leaf = side == 0 ? first == gamma : last == gamma + 1;
+				if (leaf)
+				{
+					node.leftFirst = child;
+					node.count = 1;
+					leafSlot[child] = slot;
+				}
+				else
+				{
+					node.leftFirst = 1 + 2 * child;
+					node.count = 0;
+					internalSlot[child] = slot;
+				}
+			}
+		}
+	});
+	buildNodes[0].leftFirst = 1;
+	buildNodes[0].count = 0;
+
+	// Bounds and SAH collapse, bottom-up. cost holds each slot's unnormalized SAH cost (area-weighted)
+	std::vector<float> cost(buildNodes.size());
+	std::vector<std::atomic<int> > arrivals(count - 1);
+	pool.parallelFor(count, [&](size_t begin, size_t end) {
+		for (int leaf = (int)begin; leaf < (int)end; leaf++)
+		{
+			int slot = leafSlot[leaf];
+			const AABB &bounds = triBounds[triIndices[leaf]];
+			buildNodes[slot].boundsMin = bounds.min;
+			buildNodes[slot].boundsMax = bounds.max;
+			cost[slot] = intersectionCost * bounds.area();
+
+			for (int parent = (slot - 1) / 2;; parent = (slot - 1) / 2)
+			{
+				if (arrivals[parent].fetch_add(1, std::memory_order_acq_rel) == 0) break; // sibling still on its way
+
+				slot = internalSlot[parent];
+				BVHNode &node = buildNodes[slot];
+				const BVHNode &left = buildNodes[1 + 2 * parent];
+				const BVHNode &right = buildNodes[2 + 2 * parent];
+				AABB nodeBounds;
+				nodeBounds.grow(left.boundsMin);
+				nodeBounds.grow(left.boundsMax);
+				nodeBounds.grow(right.boundsMin);
+				nodeBounds.grow(right.boundsMax);
+				node.boundsMin = nodeBounds.min;
+				node.boundsMax = nodeBounds.max;
+
+				float area = nodeBounds.area();
+				float splitCost = traversalCost * area + cost[1 + 2 * parent] + cost[2 + 2 * parent];
+				float leafCost = intersectionCost * area * rangeCount[parent];
+				if (leafCost <= splitCost)
+				{
+					// the whole subtree covers a contiguous run of sorted triangles, so it can become one leaf
+					node.leftFirst = rangeFirst[parent];
+					node.count = rangeCount[parent];
+					cost[slot] = leafCost;
+				}
+				else cost[slot] = splitCost;
+
+				if (slot == 0) break;
+			}
+		}
+	});
+}
+
+// Split BVH
+// ---------
+// True if the box is empty along any axis (AABB::empty() only looks at x, which is enough for boxes built with grow())
+static inline bool emptyBox(const AABB &box)
+{
+	return box.min.x > box.max.x || box.min.y > box.max.y || box.min.z > box.max.z;
+}
+
+static inline AABB intersectBoxes(const AABB &a, const AABB &b)
+{
+	AABB box;
+	box.min = glm::max(a.min, b.min);
+	box.max = glm::min(a.max, b.max);
+	return box;
+}
+
+static inline AABB unionBoxes(const AABB &a, const AABB &b)
+{
+	AABB box = a;
+	box.grow(b);
+	return box;
+}
+
+// Bounds of the part of the triangle between the planes lo and hi along axis, limited to clip (the part of the triangle an
+// earlier spatial split left to this reference). Empty if the triangle doesn't reach between the planes
+static AABB clipTriangle(const Mesh &mesh, unsigned int tri, int axis, float lo, float hi, const AABB &clip)
+{
+	glm::vec3 v[3];
+	for (int i = 0; i < 3; i++)
+		v[i] = meshVertex(mesh, mesh.indices[3 * (size_t)tri + i]);
+
+	AABB box;
+	for (int i = 0; i < 3; i++)
+	{
+		const glm::vec3 &a = v[i];
+		const glm::vec3 &b = v[(i + 1) % 3];
+		if (a[axis] >= lo && a[axis] <= hi) box.grow(a);
+
+		// where the edge crosses either plane
+		float planes[2] = {lo, hi};
+		for (int p = 0; p < 2; p++)
+		{
+			if ((a[axis] < planes[p] && b[axis] > planes[p]) || (a[axis] > planes[p] && b[axis] < planes[p]))
+			{
+				glm::vec3 crossing = a + (b - a) * ((planes[p] - a[axis]) / (b[axis] - a[axis]));
+				crossing[axis] = planes[p];
+				box.grow(crossing);
+			}
+		}
+	}
+	box = intersectBoxes(box, clip);
+	box.min[axis] = std::max(box.min[axis], lo);
+	box.max[axis] = std::min(box.max[axis], hi);
+	return box;
+}
+
+// Nodes are written straight into nodes depth-first (children appended as a pair when their parent is split), the reference
+// lists are handed down the recursion and turned into ranges of triIndices at the leaves
+void BVH::buildSBVH(const Mesh &mesh, float duplicationBudget)
+{
+	unsigned int triCount = mesh.triangleCount();
+	if (binCount < 2) binCount = 2;
+	if (binCount > maxBins) binCount = maxBins;
+
+	nodes.clear();
+	triIndices.clear();
+	if (triCount == 0)
+	{
+		markRebuilt();
+		return;
+	}
+
+	std::vector<Reference> refs(triCount);
+	AABB rootBounds;
+	for (unsigned int i = 0; i < triCount; i++)
+	{
+		refs[i].tri = i;
+		refs[i].bounds.grow(meshVertex(mesh, mesh.indices[3 * (size_t)i]));
+		refs[i].bounds.grow(meshVertex(mesh, mesh.indices[3 * (size_t)i + 1]));
+		refs[i].bounds.grow(meshVertex(mesh, mesh.indices[3 * (size_t)i + 2]));
+		rootBounds.grow(refs[i].bounds);
+	}
+
+	size_t budget = (size_t)(std::max(duplicationBudget, 0.0f) * triCount);
+	triIndices.reserve(triCount + budget);
+	nodes.reserve(2 * ((size_t)triCount + budget));
+
+	BVHNode root;
+	root.boundsMin = rootBounds.min;
+	root.boundsMax = rootBounds.max;
+	root.leftFirst = 0;
+	root.count = (int)triCount;
+	nodes.push_back(root);
+
+	subdivideSBVH(0, refs, mesh, rootBounds.area(), 1, budget);
+	markRebuilt();
+
+	// refit() can't keep the clipped leaf bounds, so measure degradation() against what a refit of the unchanged mesh gives
+	// instead of against the clipped tree (otherwise the first refit would already look like a badly degraded tree)
+	// Children are always stored after their parents here, so walking the nodes backwards visits them bottom-up
+	std::vector<AABB> wholeBounds(nodes.size());
+	double weightedArea = 0.0;
+	for (size_t i = nodes.size(); i-- > 0;)
+	{
+		const BVHNode &node = nodes[i];
+		if (node.isLeaf())
+		{
+			for (int t = node.leftFirst; t < node.leftFirst + node.count; t++)
+			{
+				const unsigned int *tri = &mesh.indices[3 * (size_t)triIndices[t]];
+				for (int k = 0; k < 3; k++)
+					wholeBounds[i].grow(meshVertex(mesh, tri[k]));
+			}
+			weightedArea += wholeBounds[i].area() * node.count * intersectionCost;
+		}
+		else
+		{
+			wholeBounds[i] = unionBoxes(wholeBounds[node.leftFirst], wholeBounds[node.leftFirst + 1]);
+			weightedArea += wholeBounds[i].area() * traversalCost;
+		}
+	}
+	if (wholeBounds[0].area() > 0.0f) builtCost = (float)(weightedArea / wholeBounds[0].area());
+	refitCost = builtCost;
+}
+
+// Takes the cheapest of the best object split, the best spatial split and a leaf. Spatial splits are only looked for where
+// the object split's children overlap noticeably (relative to the whole scene), elsewhere they rarely win and binning the
+// clipped triangles is the expensive part of the build
+void BVH::subdivideSBVH(int nodeIndex, std::vector<Reference> &refs, const Mesh &mesh, float rootArea, int depth, size_t &budget)
+{
+	AABB nodeBounds;
+	nodeBounds.grow(nodes[nodeIndex].boundsMin);
+	nodeBounds.grow(nodes[nodeIndex].boundsMax);
+	int count = (int)refs.size();
+
+	Split objectSplit;
+	bool haveObject = count > 1 && findObjectSplit(refs, nodeBounds, objectSplit);
+
+	SpatialSplit spatialSplit;
+	bool haveSpatial = false;
+	if (count > 1 && budget > 0 && depth < maxSpatialDepth && rootArea > 0.0f)
+	{
+		bool overlapping = true;
+		if (haveObject)
+		{
+			glm::vec3 e = glm::max(glm::min(objectSplit.leftBounds.max, objectSplit.rightBounds.max) -
+									   glm::max(objectSplit.leftBounds.min, objectSplit.rightBounds.min),
+								   glm::vec3(0.0f));
+			overlapping = (e.x * e.y + e.y * e.z + e.z * e.x) / rootArea > 1e-5f;
+		}
+		if (overlapping) haveSpatial = findSpatialSplit(refs, mesh, nodeBounds, spatialSplit);
+	}
+	if (haveObject && haveSpatial && objectSplit.cost <= spatialSplit.cost) haveSpatial = false;
+
+	float cost = haveSpatial ? spatialSplit.cost : (haveObject ? objectSplit.cost : 1e30f);
+	std::vector<Reference> left, right;
+	AABB leftBounds, rightBounds;
+	if (cost < count * intersectionCost)
+	{
+		if (haveSpatial)
+		{
+			partitionSpatial(refs, mesh, spatialSplit, left, right, budget);
+			leftBounds = spatialSplit.leftBounds;
+			rightBounds = spatialSplit.rightBounds;
+		}
+		else
+		{
+			for (int i = 0; i < count; i++)
+			{
+				glm::vec3 centroid = (refs[i].bounds.min + refs[i].bounds.max) * 0.5f;
+				if (objectSplit.binOf(centroid) < objectSplit.bin) left.push_back(refs[i]);
+				else right.push_back(refs[i]);
+			}
+			leftBounds = objectSplit.leftBounds;
+			rightBounds = objectSplit.rightBounds;
+		}
+	}
+
+	if (left.empty() || right.empty())
+	{
+		// leaf (also when unsplitting moved every reference to one side)
+		nodes[nodeIndex].leftFirst = (int)triIndices.size();
+		nodes[nodeIndex].count = count;
+		for (int i = 0; i < count; i++)
+			triIndices.push_back(refs[i].tri);
+		return;
+	}
+	std::vector<Reference>().swap(refs); // not needed below here
+
+	int childIndex = (int)nodes.size();
+	BVHNode child;
+	child.boundsMin = leftBounds.min;
+	child.boundsMax = leftBounds.max;
+	child.leftFirst = 0;
+	child.count = (int)left.size();
+	nodes.push_back(child);
+	child.boundsMin = rightBounds.min;
+	child.boundsMax = rightBounds.max;
+	child.count = (int)right.size();
+	nodes.push_back(child);
+	nodes[nodeIndex].leftFirst = childIndex;
+	nodes[nodeIndex].count = 0;
+
+	subdivideSBVH(childIndex, left, mesh, rootArea, depth + 1, budget);
+	subdivideSBVH(childIndex + 1, right, mesh, rootArea, depth + 1, budget);
+}
+
+// Binned SAH over the references' centroids, the same candidates findBestSplit looks at
+bool BVH::findObjectSplit(const std::vector<Reference> &refs, const AABB &nodeBounds, Split &split) const
+{
+	AABB centroidBounds;
+	for (size_t i = 0; i < refs.size(); i++)
+		centroidBounds.grow((refs[i].bounds.min + refs[i].bounds.max) * 0.5f);
+
+	Bin bins[3 * maxBins];
+	glm::vec3 scale;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+		scale[axis] = extent > 0.0f ? binCount / extent : 0.0f;
+	}
+	for (size_t i = 0; i < refs.size(); i++)
+	{
+		glm::vec3 centroid = (refs[i].bounds.min + refs[i].bounds.max) * 0.5f;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			int b = (int)((centroid[axis] - centroidBounds.min[axis]) * scale[axis]);
+			Bin &bin = bins[axis * binCount + (b < binCount - 1 ? b : binCount - 1)];
+			bin.count++;
+			bin.bounds.grow(refs[i].bounds);
+		}
+	}
+
+	return evaluateBins(bins, centroidBounds, nodeBounds.area(), split);
+}
+
+// Cuts the node into binCount slabs per axis and clips every reference to each slab it spans, so the bins hold the exact
+// bounds of the triangle pieces inside them. References are counted where they enter (first bin) and exit (last bin), the
+// sweep then works like evaluateBins with straddling references counted on both sides
+bool BVH::findSpatialSplit(const std::vector<Reference> &refs, const Mesh &mesh, const AABB &nodeBounds, SpatialSplit &split) const
+{
+	float parentArea = nodeBounds.area();
+	if (parentArea <= 0.0f) return false;
+
+	split.cost = 1e30f;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		SpatialSplit candidate;
+		candidate.axis = axis;
+		candidate.binCount = binCount;
+		candidate.boundsMin = nodeBounds.min[axis];
+		candidate.binWidth = (nodeBounds.max[axis] - nodeBounds.min[axis]) / binCount;
+		if (candidate.binWidth <= 0.0f) continue;
+
+		AABB binBounds[maxBins];
+		int entries[maxBins] = {0}, exits[maxBins] = {0};
+		for (size_t i = 0; i < refs.size(); i++)
+		{
+			const Reference &ref = refs[i];
+			int first = candidate.binOf(ref.bounds.min[axis]);
+			int last = candidate.binOf(ref.bounds.max[axis]);
+			entries[first]++;
+			exits[last]++;
+			if (first == last)
+			{
+				binBounds[first].grow(ref.bounds);
+				continue;
+			}
+			for (int b = first; b <= last; b++)
+			{
+				float lo = candidate.boundsMin + b * candidate.binWidth;
+				float hi = b == binCount - 1 ? nodeBounds.max[axis] : lo + candidate.binWidth;
+				AABB piece = clipTriangle(mesh, ref.tri, axis, lo, hi, ref.bounds);
+				if (!emptyBox(piece)) binBounds[b].grow(piece);
+			}
+		}
+
+		// plane p separates bins [0, p] from [p + 1, binCount)
+		AABB leftBoxes[maxBins - 1], rightBoxes[maxBins - 1];
+		int leftRefs[maxBins - 1], rightRefs[maxBins - 1];
+		AABB leftBox, rightBox;
+		int leftSum = 0, rightSum = 0;
+		for (int p = 0; p < binCount - 1; p++)
+		{
+			leftSum += entries[p];
+			leftBox.grow(binBounds[p]);
+			leftRefs[p] = leftSum;
+			leftBoxes[p] = leftBox;
+
+			rightSum += exits[binCount - 1 - p];
+			rightBox.grow(binBounds[binCount - 1 - p]);
+			rightRefs[binCount - 2 - p] = rightSum;
+			rightBoxes[binCount - 2 - p] = rightBox;
+		}
+
+		for (int p = 0; p < binCount - 1; p++)
+		{
+			if (leftRefs[p] == 0 || rightRefs[p] == 0) continue;
+			float cost = traversalCost + intersectionCost * (leftRefs[p] * leftBoxes[p].area() + rightRefs[p] * rightBoxes[p].area()) / parentArea;
+			if (cost < split.cost)
+			{
+				split = candidate;
+				split.bin = p + 1;
+				split.cost = cost;
+				split.leftBounds = leftBoxes[p];
+				split.rightBounds = rightBoxes[p];
+				split.leftCount = leftRefs[p];
+				split.rightCount = rightRefs[p];
+			}
+		}
+	}
+
+	return split.cost < 1e30f;
+}
+
+// References entirely on one side of the plane go there. A straddling reference is chopped in two, unless moving it whole to
+// one side is cheaper under the SAH ("unsplitting", the grown child box costs less than the extra reference) or the
+// duplication budget is used up. The split's bounds and counts are updated to what the children really got
+void BVH::partitionSpatial(const std::vector<Reference> &refs, const Mesh &mesh, SpatialSplit &split, std::vector<Reference> &left,
+						   std::vector<Reference> &right, size_t &budget) const
+{
+	int axis = split.axis;
+	float plane = split.position();
+	AABB leftBounds = split.leftBounds, rightBounds = split.rightBounds;
+	float leftCount = (float)split.leftCount, rightCount = (float)split.rightCount;
+
+	for (size_t i = 0; i < refs.size(); i++)
+	{
+		const Reference &ref = refs[i];
+		int first = split.binOf(ref.bounds.min[axis]);
+		int last = split.binOf(ref.bounds.max[axis]);
+		if (last < split.bin) left.push_back(ref);
+		else if (first >= split.bin) right.push_back(ref);
+		else
+		{
+			Reference leftPart = ref, rightPart = ref;
+			leftPart.bounds = clipTriangle(mesh, ref.tri, axis, ref.bounds.min[axis], plane, ref.bounds);
+			rightPart.bounds = clipTriangle(mesh, ref.tri, axis, plane, ref.bounds.max[axis], ref.bounds);
+			if (emptyBox(leftPart.bounds)) right.push_back(ref);
+			else if (emptyBox(rightPart.bounds)) left.push_back(ref);
+			else
+			{
+				float splitCost = leftBounds.area() * leftCount + rightBounds.area() * rightCount;
+				AABB leftGrown = unionBoxes(leftBounds, ref.bounds), rightGrown = unionBoxes(rightBounds, ref.bounds);
+				float leftOnlyCost = leftGrown.area() * leftCount + rightBounds.area() * (rightCount - 1);
+				float rightOnlyCost = leftBounds.area() * (leftCount - 1) + rightGrown.area() * rightCount;
+
+				if (budget > 0 && splitCost <= leftOnlyCost && splitCost <= rightOnlyCost)
+				{
+					left.push_back(leftPart);
+					right.push_back(rightPart);
+					budget--;
+				}
+				else if (leftOnlyCost <= rightOnlyCost)
+				{
+					left.push_back(ref);
+					leftBounds = leftGrown;
+					rightCount--;
+				}
+				else
+				{
+					right.push_back(ref);
+					rightBounds = rightGrown;
+					leftCount--;
+				}
+			}
+		}
+	}
+
+	split.leftBounds = AABB();
+	split.rightBounds = AABB();
+	for (size_t i = 0; i < left.size(); i++)
+		split.leftBounds.grow(left[i].bounds);
+	for (size_t i = 0; i < right.size(); i++)
+		split.rightBounds.grow(right[i].bounds);
+	split.leftCount = (int)left.size();
+	split.rightCount = (int)right.size();
+}
+
+// Refitting
+// ---------
+void BVH::markRebuilt()
+{
+	builtCost = sahCost();
+	refitCost = builtCost;
+	refitOrder.clear();
+	refitLevels.clear();
+	blocks.clear();
+	leafBlocks.clear();
+	leafBlockCounts.clear();
+}
+
+// Every node's bounds only depend on the level below it, so the tree is refitted one level at a time starting at the deepest,
+// with each level's nodes spread over the pool. The level order doesn't rely on children being stored after their parents,
+// which trees read back from the GPU builder don't guarantee
+void BVH::refit(const Mesh &mesh, ThreadPool &pool, std::vector<unsigned char> &changedNodes)
+{
+	changedNodes.assign(nodes.size(), 0);
+	blocks.clear(); // hold the old vertex positions
+	leafBlocks.clear();
+	leafBlockCounts.clear();
+	if (nodes.empty()) return;
+
+	if (refitOrder.empty())
+	{
+		std::vector<int> level(1, 0), nextLevel;
+		std::vector<std::vector<int> > levels;
+		while (!level.empty())
+		{
+			nextLevel.clear();
+			for (size_t i = 0; i < level.size(); i++)
+			{
+				const BVHNode &node = nodes[level[i]];
+				if (node.isLeaf()) continue;
+				nextLevel.push_back(node.leftFirst);
+				nextLevel.push_back(node.leftFirst + 1);
+			}
+			levels.push_back(level);
+			level.swap(nextLevel);
+		}
+
+		for (size_t l = levels.size(); l-- > 0;)
+		{
+			refitLevels.push_back(refitOrder.size());
+			refitOrder.insert(refitOrder.end(), levels[l].begin(), levels[l].end());
+		}
+		refitLevels.push_back(refitOrder.size());
+	}
+
+	// the SAH cost is summed up on the way (area weighted, divided by the root's area at the end) so degradation() doesn't
+	// need another pass over the tree
+	std::mutex costMutex;
+	double weightedArea = 0.0;
+
+	std::function<void(size_t, size_t)> refitRange = [this, &mesh, &changedNodes, &costMutex, &weightedArea](size_t begin, size_t end) {
+		double rangeArea = 0.0;
+		for (size_t i = begin; i < end; i++)
+		{
+			int nodeIndex = refitOrder[i];
+			BVHNode &node = nodes[nodeIndex];
+
+			AABB bounds;
+			if (node.isLeaf())
+			{
+				for (int t = node.leftFirst; t < node.leftFirst + node.count; t++)
+				{
+					const unsigned int *tri = &mesh.indices[3 * (size_t)triIndices[t]];
+					bounds.grow(meshVertex(mesh, tri[0]));
+					bounds.grow(meshVertex(mesh, tri[1]));
+					bounds.grow(meshVertex(mesh, tri[2]));
+				}
+			}
+			else
+			{
+				const BVHNode &left = nodes[node.leftFirst];
+				const BVHNode &right = nodes[node.leftFirst + 1];
+				bounds.min = glm::min(left.boundsMin, right.boundsMin);
+				bounds.max = glm::max(left.boundsMax, right.boundsMax);
+			}
+
+			if (bounds.min != node.boundsMin || bounds.max != node.boundsMax)
+			{
+				node.boundsMin = bounds.min;
+				node.boundsMax = bounds.max;
+				changedNodes[nodeIndex] = 1;
+			}
+			rangeArea += bounds.area() * (node.isLeaf() ? node.count * intersectionCost : traversalCost);
+		}
+
+		std::lock_guard<std::mutex> lock(costMutex);
+		weightedArea += rangeArea;
+	};
+
+	for (size_t l = 0; l + 1 < refitLevels.size(); l++)
+	{
+		size_t begin = refitLevels[l];
+		size_t end = refitLevels[l + 1];
+		if (end - begin < (size_t)taskThreshold) refitRange(begin, end); // not worth waking the workers
+		else
+		{
+			pool.parallelFor(end - begin, [&refitRange, begin](size_t first, size_t last) {
+				refitRange(begin + first, begin + last);
+			});
+		}
+	}
+
+	float rootArea = nodeArea(nodes[0]);
+	refitCost = rootArea > 0.0f ? (float)(weightedArea / rootArea) : nodes[0].count * intersectionCost;
+}
+
+float BVH::degradation() const
+{
+	return builtCost > 0.0f ? refitCost / builtCost : 1.0f;
+}
+
+// Traversal
+// ---------
+// Moller-Trumbore, same as rayTriDist in comp.glsl
+static inline bool rayTriDist(const glm::vec3 &orig, const glm::vec3 &dir, const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, float &t)
+{
+	glm::vec3 v0v1 = v1 - v0;
+	glm::vec3 v0v2 = v2 - v0;
+	glm::vec3 pvec = glm::cross(dir, v0v2);
+	float det = glm::dot(v0v1, pvec);
+	if (std::abs(det) < 0.000001f) return false;
+
+	glm::vec3 tvec = orig - v0;
+	float u = glm::dot(tvec, pvec) / det;
+	if (u < 0.0f || u > 1.0f) return false;
+
+	glm::vec3 qvec = glm::cross(tvec, v0v1);
+	float v = glm::dot(dir, qvec) / det;
+	if (v < 0.0f || u + v > 1.0f) return false;
+
+	t = glm::dot(v0v2, qvec) / det;
+	return t >= 0.0f;
+}
+
+// Fills in ranges for nodeIndex and everything below it. All builders produce contiguous subtree ranges, but that isn't relied on
+BVH::SubtreeRange BVH::subtreeRange(int nodeIndex, std::vector<SubtreeRange> &ranges) const
+{
+	const BVHNode &node = nodes[nodeIndex];
+	SubtreeRange range;
+	if (node.isLeaf())
+	{
+		range.first = node.leftFirst;
+		range.end = node.leftFirst + node.count;
+		range.count = node.count;
+	}
+	else
+	{
+		SubtreeRange left = subtreeRange(node.leftFirst, ranges);
+		SubtreeRange right = subtreeRange(node.leftFirst + 1, ranges);
+		range.first = std::min(left.first, right.first);
+		range.end = std::max(left.end, right.end);
+		range.count = left.count + right.count;
+	}
+	ranges[nodeIndex] = range;
+	return range;
+}
+
+void BVH::buildBlocks(const Mesh &mesh, int width)
+{
+	blocks.clear();
+	blocks.width = width > 0 ? width : TriangleBlocks::hostWidth();
+	leafBlocks.assign(nodes.size(), -1);
+	leafBlockCounts.assign(nodes.size(), 0);
+	if (nodes.empty()) return;
+
+	std::vector<SubtreeRange> ranges(nodes.size());
+	subtreeRange(0, ranges);
+	packBlocks(mesh, 0, ranges);
+}
+
+// Packs the biggest subtrees that fit into one block, top-down. Leaves are packed whatever their size
+void BVH::packBlocks(const Mesh &mesh, int nodeIndex, const std::vector<SubtreeRange> &ranges)
+{
+	const BVHNode &node = nodes[nodeIndex];
+	const SubtreeRange &range = ranges[nodeIndex];
+	if (node.isLeaf() || (range.count <= blocks.width && range.end - range.first == range.count))
+	{
+		leafBlocks[nodeIndex] = blocks.append(mesh, &triIndices[range.first], range.count);
+		leafBlockCounts[nodeIndex] = blocks.blockCount(range.count);
+		return;
+	}
+	packBlocks(mesh, node.leftFirst, ranges);
+	packBlocks(mesh, node.leftFirst + 1, ranges);
+}
+
+int BVH::intersect(const Mesh &mesh, const glm::vec3 &orig, const glm::vec3 &dir, float &t, TraversalStats *stats) const
+{
+	if (nodes.empty()) return -1;
+
+	TraversalStats work;
+	int closest = intersectSubtree(mesh, 0, orig, dir, t, work);
+
+	if (stats != NULL)
+	{
+		stats->nodeVisits += work.nodeVisits;
+		stats->triangleTests += work.triangleTests;
+	}
+	return closest;
+}
+
+// Tests the triangles of a leaf or packed node, returns the closest one hit before t (lowering t) or -1
+int BVH::intersectTriangles(const Mesh &mesh, int nodeIndex, const glm::vec3 &orig, const glm::vec3 &dir, float &t,
+							TraversalStats &work) const
+{
+	int closest = -1;
+	if (!leafBlocks.empty() && leafBlocks[nodeIndex] >= 0)
+	{
+		BlockHit hit;
+		work.triangleTests += (size_t)leafBlockCounts[nodeIndex] * blocks.width; // every lane is tested
+		if (blocks.intersect(leafBlocks[nodeIndex], leafBlockCounts[nodeIndex], orig, dir, t, hit))
+		{
+			t = hit.t;
+			closest = hit.triangle;
+		}
+		return closest;
+	}
+
+	const BVHNode &node = nodes[nodeIndex];
+	for (int i = node.leftFirst; i < node.leftFirst + node.count; i++)
+	{
+		const unsigned int *tri = &mesh.indices[3 * (size_t)triIndices[i]];
+		float triT;
+		work.triangleTests++;
+		if (rayTriDist(orig, dir, meshVertex(mesh, tri[0]), meshVertex(mesh, tri[1]), meshVertex(mesh, tri[2]), triT) && triT < t)
+		{
+			t = triT;
+			closest = (int)triIndices[i];
+		}
+	}
+	return closest;
+}
+
+// Single ray traversal of the subtree below root, nearer child first
+int BVH::intersectSubtree(const Mesh &mesh, int root, const glm::vec3 &orig, const glm::vec3 &dir, float &t, TraversalStats &work) const
+{
+	glm::vec3 invDir = 1.0f / dir;
+	int closest = -1;
+
+	std::pair<int, float> stack[traversalStackSize]; // (node, entry distance)
+	int sp = 0;
+	if (rayBoxDist(orig, invDir, nodes[root].boundsMin, nodes[root].boundsMax, t) < 1e30f) stack[sp++] = std::make_pair(root, 0.0f);
+	while (sp > 0)
+	{
+		std::pair<int, float> top = stack[--sp];
+		if (top.second > t) continue; // behind a closer hit
+
+		if (testsTriangles(top.first))
+		{
+			work.nodeVisits++;
+			int tri = intersectTriangles(mesh, top.first, orig, dir, t, work);
+			if (tri >= 0) closest = tri;
+			continue;
+		}
+		if (sp > traversalStackSize - 2)
+		{
+			// no room for both children, finish this subtree with a stack of its own
+			int tri = intersectSubtree(mesh, top.first, orig, dir, t, work);
+			if (tri >= 0) closest = tri;
+			continue;
+		}
+
+		work.nodeVisits++;
+
+		// push the farther child first so the nearer one is visited next
+		const BVHNode &node = nodes[top.first];
+		int nearChild = node.leftFirst, farChild = node.leftFirst + 1;
+		float nearDist = rayBoxDist(orig, invDir, nodes[nearChild].boundsMin, nodes[nearChild].boundsMax, t);
+		float farDist = rayBoxDist(orig, invDir, nodes[farChild].boundsMin, nodes[farChild].boundsMax, t);
+		if (farDist < nearDist)
+		{
+			std::swap(nearChild, farChild);
+			std::swap(nearDist, farDist);
+		}
+		if (farDist < 1e30f) stack[sp++] = std::make_pair(farChild, farDist);
+		if (nearDist < 1e30f) stack[sp++] = std::make_pair(nearChild, nearDist);
+	}
+	return closest;
+}
+
+// The children are ordered by the entry distances of the first ray that enters both, for coherent rays that is the order
+// almost all of them would pick on their own
+uint64_t BVH::intersectPacket(const Mesh &mesh, RayPacket &packet, uint64_t active, TraversalStats *stats) const
+{
+	if (nodes.empty()) return 0;
+
+	TraversalStats work;
+	float rootEntry[RayPacket::maxRays];
+	active = packet.boxMask(active, nodes[0].boundsMin, nodes[0].boundsMax, rootEntry);
+	uint64_t hits = active != 0 ? intersectPacketSubtree(mesh, 0, packet, active, work) : 0;
+
+	if (stats != NULL)
+	{
+		stats->nodeVisits += work.nodeVisits;
+		stats->triangleTests += work.triangleTests;
+	}
+	return hits;
+}
+
+// Packet traversal of the subtree below root for the rays that enter its box
+uint64_t BVH::intersectPacketSubtree(const Mesh &mesh, int root, RayPacket &packet, uint64_t rays, TraversalStats &work) const
+{
+	uint64_t hits = 0;
+	int divergentCount = packet.size / 4;
+	float nearEntry[RayPacket::maxRays], farEntry[RayPacket::maxRays];
+
+	std::pair<int, uint64_t> stack[traversalStackSize]; // (node, rays that enter its box)
+	int sp = 0;
+	stack[sp++] = std::make_pair(root, rays);
+	while (sp > 0)
+	{
+		std::pair<int, uint64_t> top = stack[--sp];
+
+		bool divergent = rayCount(top.second) < divergentCount;
+		if (divergent || testsTriangles(top.first))
+		{
+			if (!divergent) work.nodeVisits++;
+			for (int lane = 0; lane < packet.size; lane++)
+			{
+				if (!(top.second >> lane & 1)) continue;
+				float t = packet.t[lane];
+				int tri = divergent ? intersectSubtree(mesh, top.first, packet.origin(lane), packet.direction(lane), t, work)
+									: intersectTriangles(mesh, top.first, packet.origin(lane), packet.direction(lane), t, work);
+				if (tri < 0) continue;
+				packet.t[lane] = t;
+				packet.triangle[lane] = (unsigned int)tri;
+				hits |= (uint64_t)1 << lane;
+			}
+			continue;
+		}
+		if (sp > traversalStackSize - 2)
+		{
+			// no room for both children, finish this subtree with a stack of its own
+			hits |= intersectPacketSubtree(mesh, top.first, packet, top.second, work);
+			continue;
+		}
+
+		work.nodeVisits++;
+		const BVHNode &node = nodes[top.first];
+		int nearChild = node.leftFirst, farChild = node.leftFirst + 1;
+		uint64_t nearRays = packet.boxMask(top.second, nodes[nearChild].boundsMin, nodes[nearChild].boundsMax, nearEntry);
+		uint64_t farRays = packet.boxMask(top.second, nodes[farChild].boundsMin, nodes[farChild].boundsMax, farEntry);
+		uint64_t both = nearRays & farRays;
+		if (both != 0 && farEntry[firstRay(both)] < nearEntry[firstRay(both)])
+		{
+			std::swap(nearChild, farChild);
+			std::swap(nearRays, farRays);
+		}
+		if (farRays != 0) stack[sp++] = std::make_pair(farChild, farRays);
+		if (nearRays != 0) stack[sp++] = std::make_pair(nearChild, nearRays);
+	}
+	return hits;
+}
+
+// Statistics
+// ----------
+float BVH::sahCost() const
+{
+	if (nodes.empty()) return 0.0f;
+
+	float rootArea = nodeArea(nodes[0]);
+	if (rootArea <= 0.0f) return nodes[0].count * intersectionCost;
+
+	// walk from the root, trees built on the GPU leave unused slots between the reachable nodes
+	float cost = 0.0f;
+	std::vector<int> stack(1, 0);
+	while (!stack.empty())
+	{
+		const BVHNode &node = nodes[stack.back()];
+		stack.pop_back();
+
+		float hitProbability = nodeArea(node) / rootArea;
+		if (node.isLeaf()) cost += hitProbability * node.count * intersectionCost;
+		else
+		{
+			cost += hitProbability * traversalCost;
+			stack.push_back(node.leftFirst);
+			stack.push_back(node.leftFirst + 1);
+		}
+	}
+	return cost;
+}
+
+int BVH::depth() const
+{
+	if (nodes.empty()) return 0;
+
+	int maxDepth = 0;
+	std::vector<std::pair<int, int> > stack(1, std::make_pair(0, 1)); // (node, depth)
+	while (!stack.empty())
+	{
+		std::pair<int, int> top = stack.back();
+		stack.pop_back();
+
+		const BVHNode &node = nodes[top.first];
+		if (node.isLeaf()) maxDepth = std::max(maxDepth, top.second);
+		else
+		{
+			stack.push_back(std::make_pair(node.leftFirst, top.second + 1));
+			stack.push_back(std::make_pair(node.leftFirst + 1, top.second + 1));
+		}
+	}
+	return maxDepth;
+}
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <vector>
+
+#include <glm\glm.hpp>
+
+#include "ObjLoader.h"
+#include "ThreadPool.h"
+#include "TriangleBlocks.h"
+#include "RayPacket.h"
+
+// Axis-aligned bounding box, starts out empty (min > max) so the first grow() sets it
+struct AABB
+{
+	glm::vec3 min;
+	glm::vec3 max;
+
+	AABB() : min(1e30f), max(-1e30f) {}
+
+	void grow(const glm::vec3 &p) { min = glm::min(min, p); max = glm::max(max, p); }
+	void grow(const AABB &b) { min = glm::min(min, b.min); max = glm::max(max, b.max); }
+	bool empty() const { return min.x > max.x; }
+
+	// Half the surface area, the constant factor cancels out in every SAH ratio
+	float area() const
+	{
+		if (empty()) return 0.0f;
+		glm::vec3 e = max - min;
+		return e.x * e.y + e.y * e.z + e.z * e.x;
+	}
+};
+
+// One node of the flattened hierarchy, laid out to match the std430 BVHNode struct in comp.glsl (32 bytes)
+// Interior nodes have count == 0 and their two children stored next to each other at leftFirst and leftFirst + 1
+// Leaves have count > 0 and cover triangles [leftFirst, leftFirst + count) of BVH::triIndices
+struct BVHNode
+{
+	glm::vec3 boundsMin;
+	int leftFirst;
+	glm::vec3 boundsMax;
+	int count;
+
+	bool isLeaf() const { return count > 0; }
+};
+
+// Entry distance of the ray into the box if it enters before tMax, 1e30 otherwise (rayBoxDist in comp.glsl)
+inline float rayBoxDist(const glm::vec3 &orig, const glm::vec3 &invDir, const glm::vec3 &boxMin, const glm::vec3 &boxMax, float tMax)
+{
+	glm::vec3 t0 = (boxMin - orig) * invDir;
+	glm::vec3 t1 = (boxMax - orig) * invDir;
+	glm::vec3 tSmall = glm::min(t0, t1);
+	glm::vec3 tBig = glm::max(t0, t1);
+	float tNear = glm::max(glm::max(tSmall.x, tSmall.y), glm::max(tSmall.z, 0.0f));
+	float tFar = glm::min(glm::min(tBig.x, tBig.y), glm::min(tBig.z, tMax));
+	return tNear <= tFar ? tNear : 1e30f;
+}
+
+// Work counters of CPU traversals, summed over however many rays were traced
+struct TraversalStats
+{
+	size_t nodeVisits;
+	size_t triangleTests;
+
+	TraversalStats() : nodeVisits(0), triangleTests(0) {}
+};
+
+// BVH is a bounding volume hierarchy over the triangles of a Mesh, used to skip most triangles per ray
+// Nodes are stored depth-first (a node's children come after it, siblings are adjacent) with the root at index 0
+// See relevant source file for function descriptions
+class BVH
+{
+public:
+	std::vector<BVHNode> nodes;
+	std::vector<unsigned int> triIndices; // mesh triangle (or primitive) indices in leaf order, leaves reference ranges of this
+
+	int binCount; // SAH candidate planes per axis = binCount - 1, at most maxBins
+
+	BVH() : binCount(16), builtCost(0.0f), refitCost(0.0f) {}
+
+	void build(const Mesh &mesh);						// Binned SAH build on the calling thread
+	void build(const std::vector<AABB> &primitiveBounds); // Same, over boxes instead of triangles (triIndices index the boxes)
+	void buildParallel(const Mesh &mesh, ThreadPool &pool); // Same tree as build(), spread over the pool
+
+	// Linear BVH: sorts the triangles along a Morton curve (30 or 63 bit codes) and splits wherever the codes' highest differing
+	// bit changes, then collapses subtrees into leaves where the SAH prefers it. Builds much faster than the SAH builders at
+	// the price of a somewhat worse tree (meant for previews and frequently reloaded meshes)
+	void buildLBVH(const Mesh &mesh, ThreadPool &pool, int mortonBits = 30);
+
+	// Split BVH: the binned SAH build, plus spatial splits that chop triangles at a plane and reference them from both sides
+	// where that lowers the SAH cost more than any object split. Pays off for long, thin or slanted triangles whose boxes
+	// would otherwise overlap. At most duplicationBudget * triangle count extra references are made, a triangle can then
+	// show up in several leaves (and in triIndices more than once). refit() grows the chopped leaves back to whole triangles,
+	// degradation() is measured against that rather than the chopped tree
+	void buildSBVH(const Mesh &mesh, float duplicationBudget = 0.25f);
+
+	// Closest hit along orig + t * dir closer than t, returns the mesh triangle index (t is lowered to its distance) or -1
+	// Same traversal and triangle test as closestTriBVH in comp.glsl, work is added to stats if given
+	// Leaves are tested with the SIMD block kernels once buildBlocks() has been called, triangle by triangle otherwise
+	int intersect(const Mesh &mesh, const glm::vec3 &orig, const glm::vec3 &dir, float &t, TraversalStats *stats = NULL) const;
+
+	// Closest hits of the rays in active, like intersect() per ray: packet.t and packet.triangle are updated for the rays that
+	// hit something closer, those are returned. The rays walk the tree together and test each box with one
+	// RayPacket::boxMask, below nodes that fewer than a quarter of the packet's rays enter the rest are traced one by one
+	uint64_t intersectPacket(const Mesh &mesh, RayPacket &packet, uint64_t active, TraversalStats *stats = NULL) const;
+
+	// Copies the triangles into SIMD blocks of width (0 = TriangleBlocks::hostWidth()) for intersect(). Subtrees of at most
+	// width triangles are packed together and tested as one block instead of being traversed, the builders' leaves are
+	// smaller than a block. The blocks hold vertex positions, so refit() and rebuilds drop them and they have to be built again
+	void buildBlocks(const Mesh &mesh, int width = 0);
+	const TriangleBlocks &triangleBlocks() const { return blocks; }
+
+	// Recomputes every node's bounds bottom-up after the mesh's vertices moved, keeping the topology (and triIndices) as is
+	// Much cheaper than a rebuild, but the tree gets worse the further the geometry drifts from where it was built, see
+	// degradation(). changedNodes[i] is set to 1 for the nodes whose bounds changed, 0 for the rest
+	void refit(const Mesh &mesh, ThreadPool &pool, std::vector<unsigned char> &changedNodes);
+	float degradation() const; // SAH cost after the last refit relative to right after the last build, 1 = as good as new
+
+	void markRebuilt(); // Builders call this when nodes is replaced: resets the degradation() baseline and refit state
+
+	float sahCost() const; // Expected cost of tracing a random ray through the tree (lower is better)
+	int depth() const;	   // Length of the longest root to leaf path (a single leaf has depth 1)
+
+	// Cost model shared by the builders and sahCost(), relative cost of one node visit vs. one triangle test
+	static const float traversalCost;
+	static const float intersectionCost;
+
+	static const int maxBins = 64;
+
+	// Entries of the fixed-size traversal stacks (bvhStackSize in comp.glsl). A node whose children don't fit any more has its
+	// subtree traced by a recursive call with a fresh stack, so deeper trees cost a call instead of a heap allocation per ray
+	static const int traversalStackSize = 64;
+
+	// Nodes with at least this many triangles are split by all workers together (binning and partitioning in parallel),
+	// smaller ones become independent subtree tasks
+	static const int parallelSplitThreshold = 1 << 16;
+	// Within a subtree task, children with at least this many triangles are handed to the pool as new tasks
+	static const int taskThreshold = 1 << 12;
+
+private:
+	// One histogram bin: the triangles whose centroids fall into a slab along one axis
+	struct Bin
+	{
+		AABB bounds;
+		int count;
+
+		Bin() : count(0) {}
+	};
+
+	// A candidate SAH split: triangles whose centroid falls into a bin below bin go left
+	struct Split
+	{
+		int axis;
+		int bin;
+		int binCount;
+		float centroidMin; // centroid bounds min along axis
+		float binScale;	   // binCount / centroid extent along axis
+		float cost;		   // relative to a leaf of the same triangles costing count * intersectionCost
+
+		AABB leftBounds, rightBounds; // union of the triangle bounds on either side, become the children's bounds
+
+		int binOf(const glm::vec3 &centroid) const
+		{
+			int b = (int)((centroid[axis] - centroidMin) * binScale);
+			return b < binCount - 1 ? b : binCount - 1;
+		}
+	};
+
+	// Build scratch space, only alive during a build
+	// Every node owns a block of 2 * count - 2 slots in buildNodes for its descendants, so subtrees can be built
+	// concurrently without coordinating allocations. compactNodes() removes the unused slots afterwards
+	std::vector<BVHNode> buildNodes;
+	std::vector<AABB> triBounds;	  // per mesh triangle
+	std::vector<glm::vec3> centroids; // per mesh triangle
+	std::vector<Bin> binArena;		  // per-worker histograms for the parallel top-level splits (workers * 3 * binCount)
+	std::vector<unsigned int> partitionScratch;
+
+	// Refit state, kept between refits of the same tree
+	float builtCost;				// sahCost() right after the last build
+	float refitCost;				// sahCost() after the last refit, summed up by refit() itself
+	std::vector<int> refitOrder;	// reachable nodes grouped by depth, deepest level first
+	std::vector<size_t> refitLevels; // start of each level in refitOrder, plus the end
+
+	TriangleBlocks blocks;			  // triangles for the CPU tracer, see buildBlocks()
+	std::vector<int> leafBlocks;	  // per node, first block of the triangles below it if they were packed, -1 otherwise
+	std::vector<int> leafBlockCounts; // per node, number of blocks starting at leafBlocks
+
+	// Triangles below a node, triIndices [first, end) holds count of them if the subtree's range is contiguous
+	struct SubtreeRange
+	{
+		int first, end, count;
+	};
+
+	SubtreeRange subtreeRange(int nodeIndex, std::vector<SubtreeRange> &ranges) const;
+	void packBlocks(const Mesh &mesh, int nodeIndex, const std::vector<SubtreeRange> &ranges);
+
+	// Nodes whose triangles are tested directly: leaves and subtrees packed into blocks
+	bool testsTriangles(int nodeIndex) const { return nodes[nodeIndex].isLeaf() || (!leafBlocks.empty() && leafBlocks[nodeIndex] >= 0); }
+	int intersectTriangles(const Mesh &mesh, int nodeIndex, const glm::vec3 &orig, const glm::vec3 &dir, float &t, TraversalStats &work) const;
+	int intersectSubtree(const Mesh &mesh, int root, const glm::vec3 &orig, const glm::vec3 &dir, float &t, TraversalStats &work) const;
+	uint64_t intersectPacketSubtree(const Mesh &mesh, int root, RayPacket &packet, uint64_t rays, TraversalStats &work) const;
+
+	void beginBuild(const Mesh &mesh, ThreadPool *pool);
+	void createRoot();
+	void endBuild();
+	void compactNodes();
+
+	void subdivide(int nodeIndex, int blockStart, ThreadPool *pool);
+	bool findBestSplit(const BVHNode &node, Split &split) const;
+	bool evaluateBins(const Bin *bins, const AABB &centroidBounds, float parentArea, Split &split) const;
+	int partition(const BVHNode &node, const Split &split);
+	void makeChildren(int nodeIndex, int blockStart, const Split &split, int mid);
+
+	bool findBestSplitParallel(const BVHNode &node, Split &split, ThreadPool &pool);
+	int partitionParallel(const BVHNode &node, const Split &split, ThreadPool &pool);
+
+	template <typename Key>
+	void emitLBVH(std::vector<Key> &keys, int keyBits, ThreadPool &pool);
+
+	// A triangle as seen by the split builder, bounds are clipped to the part left after spatial splits
+	struct Reference
+	{
+		AABB bounds;
+		unsigned int tri;
+	};
+
+	// A candidate spatial split: the node's bounds are cut into binCount equally wide slabs along axis and the plane at the
+	// start of slab bin separates the children, references straddling it get chopped in two
+	struct SpatialSplit
+	{
+		int axis;
+		int bin;
+		int binCount;
+		float boundsMin; // node bounds min along axis
+		float binWidth;
+		float cost; // same scale as Split::cost
+
+		AABB leftBounds, rightBounds;
+		int leftCount, rightCount; // references that end up on either side, straddling ones counted on both
+
+		int binOf(float x) const
+		{
+			int b = (int)((x - boundsMin) / binWidth);
+			return b < 0 ? 0 : (b < binCount - 1 ? b : binCount - 1);
+		}
+		float position() const { return boundsMin + bin * binWidth; }
+	};
+
+	// Spatial splits are only tried above this depth, deeper nodes only get object splits
+	static const int maxSpatialDepth = 48;
+
+	void subdivideSBVH(int nodeIndex, std::vector<Reference> &refs, const Mesh &mesh, float rootArea, int depth, size_t &budget);
+	bool findObjectSplit(const std::vector<Reference> &refs, const AABB &nodeBounds, Split &split) const;
+	bool findSpatialSplit(const std::vector<Reference> &refs, const Mesh &mesh, const AABB &nodeBounds, SpatialSplit &split) const;
+	void partitionSpatial(const std::vector<Reference> &refs, const Mesh &mesh, SpatialSplit &split, std::vector<Reference> &left,
+						  std::vector<Reference> &right, size_t &budget) const;
+};
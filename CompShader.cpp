@@ -1,4 +1,5 @@
 #include <string>
+#include <chrono>
 #include <fstream>
 #include <sstream>
 #include <iostream>
@@ -9,10 +10,14 @@
 #include <glm\gtc\type_ptr.hpp>
 
 #include "CompShader.h"
+#include "ProgramCache.h"
 
 // Constructor
-CompShader::CompShader(const GLchar* compPath)
+CompShader::CompShader(const GLchar* compPath, int localSizeX, int localSizeY)
 {
+	localSize[0] = localSizeX;
+	localSize[1] = localSizeY;
+
 	// Make sure ifstream objects can throw exceptions
 	compShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 
@@ -35,8 +40,83 @@ CompShader::CompShader(const GLchar* compPath)
 		std::cout << "ERROR::COMPUTE_SHADER::FILE_NOT_SUCCESSFULLY_READ" << std::endl;
 	}
 
+	activate();
+}
+
+// The #define lines of the current defines and shape, one string per variant
+std::string CompShader::defineBlock() const
+{
+	std::ostringstream lines;
+	if (localSize[0] > 0) lines << "#define LOCAL_SIZE_X " << localSize[0] << "\n#define LOCAL_SIZE_Y " << localSize[1] << "\n";
+	for (Defines::const_iterator define = defines.begin(); define != defines.end(); ++define)
+		lines << "#define " << define->first << " " << define->second << "\n";
+	return lines.str();
+}
+
+void CompShader::activate()
+{
+	std::string block = defineBlock();
+	std::map<std::string, Variant>::iterator variant = programs.find(block);
+	if (variant == programs.end())
+	{
+		build(block);
+		variant = programs.insert(std::make_pair(block, Variant())).first;
+		variant->second.program = ID;
+		readUniformLocations(ID, variant->second.uniforms);
+		for (size_t i = 0; i < handleNames.size(); i++)
+			variant->second.handleLocations.push_back(findLocation(variant->second.uniforms, handleNames[i]));
+	}
+	ID = variant->second.program;
+	uniforms = &variant->second.uniforms;
+	handleLocations = &variant->second.handleLocations;
+}
+
+int CompShader::uniformLocation(const std::string &name) const
+{
+	return findLocation(*uniforms, name);
+}
+
+int CompShader::uniformHandle(const char *name)
+{
+	for (size_t i = 0; i < handleNames.size(); i++)
+		if (handleNames[i] == name) return (int)i;
+
+	handleNames.push_back(name);
+	for (std::map<std::string, Variant>::iterator variant = programs.begin(); variant != programs.end(); ++variant)
+		variant->second.handleLocations.push_back(findLocation(variant->second.uniforms, handleNames.back()));
+	return (int)handleNames.size() - 1;
+}
+
+// Compiles the source, with defineLines inserted right after its #version line (nothing but comments and whitespace may
+// come before #version), and links it into a new program. Loads the program from the binary cache instead when it has it
+void CompShader::build(const std::string &defineLines)
+{
+	std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
+
+	std::string source = compSourceCodeBuffer;
+	if (!defineLines.empty())
+	{
+		size_t at = 0;
+		size_t version = source.find("#version");
+		if (version != std::string::npos)
+		{
+			size_t lineEnd = source.find('\n', version);
+			at = lineEnd == std::string::npos ? source.size() : lineEnd + 1;
+		}
+		source.insert(at, defineLines);
+	}
+
+	std::string cacheKey = programCacheKey(source);
+	ID = glCreateProgram();
+	if (loadProgramBinary(ID, cacheKey))
+	{
+		recordProgramBuild(true, std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count());
+		return;
+	}
+	glDeleteProgram(ID); // may hold a binary the driver rejected
+
 	// Send string buffer's content to char*'s as c_strings
-	compSourceCode = compSourceCodeBuffer.c_str();
+	const char *compSourceCode = source.c_str();
 
 	// ---------- Compute Shader ---------- //
 	compShader = glCreateShader(GL_COMPUTE_SHADER);
@@ -55,6 +135,7 @@ CompShader::CompShader(const GLchar* compPath)
 	// ---------- Shader Program ---------- //
 	ID = glCreateProgram();
 	glAttachShader(ID, compShader);
+	programBinaryHint(ID);
 	glLinkProgram(ID);
 
 	// Error checking
@@ -64,9 +145,24 @@ CompShader::CompShader(const GLchar* compPath)
 		glGetProgramInfoLog(ID, 512, NULL, infoLog);
 		std::cout << "ERROR::COMPUTE_SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
 	}
+	else saveProgramBinary(ID, cacheKey);
 	// ---------- End ---------- //
 
 	glDeleteShader(compShader);
+	recordProgramBuild(false, std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count());
+}
+
+void CompShader::select(const Defines &defines)
+{
+	this->defines = defines;
+	activate();
+}
+
+void CompShader::setLocalSize(int x, int y)
+{
+	localSize[0] = x;
+	localSize[1] = y;
+	activate();
 }
 
 // Set shader to current
@@ -79,44 +175,74 @@ void CompShader::use()
 // -------------------
 void CompShader::setBool(const std::string &name, bool value) const
 {
-	glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+	glUniform1i(uniformLocation(name), (int)value);
 }
 
 void CompShader::setInt(const std::string &name, int value) const
 {
-	glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+	glUniform1i(uniformLocation(name), value);
+}
+
+void CompShader::setUInt(const std::string &name, unsigned int value) const
+{
+	glUniform1ui(uniformLocation(name), value);
 }
 
 void CompShader::setFloat(const std::string &name, float value) const
 {
-	glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+	glUniform1f(uniformLocation(name), value);
 }
 
 void CompShader::setFloat3(const std::string &name, float value1, float value2, float value3) const
 {
-	glUniform3f(glGetUniformLocation(ID, name.c_str()), value1, value2, value3);
+	glUniform3f(uniformLocation(name), value1, value2, value3);
 }
 void CompShader::setFloat3(const std::string &name, glm::vec3 val) const
 {
-	glUniform3f(glGetUniformLocation(ID, name.c_str()), val.x, val.y, val.z);
+	glUniform3f(uniformLocation(name), val.x, val.y, val.z);
 }
 
 void CompShader::setFloat4(const std::string &name, float value1, float value2, float value3, float value4) const
 {
-	glUniform4f(glGetUniformLocation(ID, name.c_str()), value1, value2, value3, value4);
+	glUniform4f(uniformLocation(name), value1, value2, value3, value4);
 }
 
 void CompShader::setMatrix3f(const std::string &name, glm::mat3 matrix) const
 {
-	glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, glm::value_ptr(matrix));
+	glUniformMatrix3fv(uniformLocation(name), 1, GL_FALSE, glm::value_ptr(matrix));
 }
 
 void CompShader::setMatrix4f(const std::string &name, glm::mat4 matrix) const
 {
-	glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, glm::value_ptr(matrix));
+	glUniformMatrix4fv(uniformLocation(name), 1, GL_FALSE, glm::value_ptr(matrix));
 }
 
 void CompShader::setDouble(const std::string &name, double value) const
 {
-	glUniform1d(glGetUniformLocation(ID, name.c_str()), value);
+	glUniform1d(uniformLocation(name), value);
+}
+
+void CompShader::setBool(int handle, bool value) const
+{
+	glUniform1i((*handleLocations)[handle], (int)value);
+}
+
+void CompShader::setInt(int handle, int value) const
+{
+	glUniform1i((*handleLocations)[handle], value);
+}
+
+void CompShader::setUInt(int handle, unsigned int value) const
+{
+	glUniform1ui((*handleLocations)[handle], value);
+}
+
+void CompShader::setFloat(int handle, float value) const
+{
+	glUniform1f((*handleLocations)[handle], value);
+}
+
+void CompShader::setFloat3(int handle, glm::vec3 val) const
+{
+	glUniform3f((*handleLocations)[handle], val.x, val.y, val.z);
 }
\ No newline at end of file
@@ -1,23 +1,53 @@
 #pragma once
 
 #include <fstream>
+#include <map>
 #include <sstream>
+#include <string>
+#include <vector>
 
 #include<glad\glad.h>
 #include<glm\glm.hpp>
 
+#include "ProgramCache.h"
+
 // Shader handles the loading-in and compilation of shader source code (written in GLSL). This is essentially a wrapper class around the shader object stored in GPU memory
 // See relevant source file for function descriptions
 class CompShader
 {
 public:
-	CompShader(const GLchar* compPath); // Constructor: Read in shader code files and build shader program
+	// Name -> value of #defines injected right after the source's #version line
+	typedef std::map<std::string, std::string> Defines;
+
+	// Constructor: Read in shader code files and build shader program
+	// A localSizeX x localSizeY workgroup shape is handed to the source as LOCAL_SIZE_X and LOCAL_SIZE_Y defines, 0 leaves the
+	// source's own shape
+	CompShader(const GLchar* compPath, int localSizeX = 0, int localSizeY = 0);
 
 	void use(); // Tells the OpenGL state machine to use (this)Shader
 
+	// Variants: the source compiled with different defines and workgroup shapes. Every variant is compiled and linked the
+	// first time it is selected and kept, selecting it again just switches programs. Each variant has its own uniform
+	// values, and a newly selected one has to be use()d
+	void select(const Defines &defines);
+	void setLocalSize(int x, int y); // selects the current defines with another workgroup shape
+	int localSizeX() const { return localSize[0]; }
+	int localSizeY() const { return localSize[1]; }
+	size_t variantCount() const { return programs.size(); }
+
+	// Location of a uniform of the selected variant, -1 if it has no such uniform (setting it then does nothing)
+	// Looked up in a table read when the variant was built, not asked from the driver
+	int uniformLocation(const std::string &name) const;
+
+	// Handle of a uniform for the setters below that take one instead of a name: the name is resolved in every variant once,
+	// when the handle is made or the variant is built, so setting it is an array index rather than a lookup. Use them for
+	// uniforms set every frame or pass
+	int uniformHandle(const char *name);
+
 	// Shader uniform setting functions (sets uniforms on the shader object stored in GPU memory)
 	void setBool(const std::string &name, bool value) const; // the addition of const means the function cannot modify the state of the (this) object
 	void setInt(const std::string &name, int value) const;
+	void setUInt(const std::string &name, unsigned int value) const;
 	void setFloat(const std::string &name, float value) const;
 	void setFloat3(const std::string &name, float value1, float value2, float value3) const;
 	void setFloat3(const std::string &name, glm::vec3 val) const;
@@ -27,18 +57,41 @@ public:
 
 	void setDouble(const std::string &name, double value) const;
 
+	void setBool(int handle, bool value) const;
+	void setInt(int handle, int value) const;
+	void setUInt(int handle, unsigned int value) const;
+	void setFloat(int handle, float value) const;
+	void setFloat3(int handle, glm::vec3 val) const;
+
 private:
 	unsigned int ID; // Shader program ID for referencing object stored on video card
 
 	unsigned int compShader; // Compute shader ID
 
-	const char* compSourceCode;
+	int localSize[2]; // injected workgroup shape, 0 if not injected
+	Defines defines;  // injected defines of the selected variant
+	// A linked program and its uniforms
+	struct Variant
+	{
+		unsigned int program;
+		UniformLocations uniforms;
+		std::vector<int> handleLocations; // location of every handle's uniform
+	};
+	std::map<std::string, Variant> programs;  // per injected define block
+	const UniformLocations *uniforms;		  // of the selected variant
+	const std::vector<int> *handleLocations; // of the selected variant
+	std::vector<std::string> handleNames;	  // uniform of every handle given out
+
 	std::string compSourceCodeBuffer;
 
 	std::ifstream compShaderFile;
 
 	std::stringstream compShaderStream;
 
+	std::string defineBlock() const;
+	void activate(); // makes ID the program of the current defines and shape, building it if needed
+	void build(const std::string &defineLines); // compiles and links compSourceCodeBuffer with defineLines injected into ID
+
 	// Error handling fields
 	int success;
 	char infoLog[512];
@@ -0,0 +1,509 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include "CpuRenderer.h"
+#include "RadixSort.h"
+
+void primaryRay(const RenderCamera &camera, int x, int y, int imageWidth, int imageHeight, glm::vec3 &orig, glm::vec3 &dir)
+{
+	glm::vec2 posOnLens = glm::vec2(x, y) / glm::vec2(imageWidth - 1, imageHeight - 1) - glm::vec2(0.5f);
+	orig = camera.pos + posOnLens.x * camera.right + posOnLens.y * camera.up;
+	dir = glm::normalize(orig - camera.light);
+}
+
+// Lens point of pixel (x, y), x and y don't need to be whole pixels
+static glm::vec3 lensPoint(const RenderCamera &camera, float x, float y, int imageWidth, int imageHeight)
+{
+	glm::vec2 posOnLens = glm::vec2(x, y) / glm::vec2(imageWidth - 1, imageHeight - 1) - glm::vec2(0.5f);
+	return camera.pos + posOnLens.x * camera.right + posOnLens.y * camera.up;
+}
+
+Frustum tileFrustum(const RenderCamera &camera, int x0, int y0, int x1, int y1, int imageWidth, int imageHeight)
+{
+	Frustum frustum;
+	frustum.apex = camera.light;
+	frustum.corners[0] = lensPoint(camera, x0 - 0.5f, y0 - 0.5f, imageWidth, imageHeight);
+	frustum.corners[1] = lensPoint(camera, x1 + 0.5f, y0 - 0.5f, imageWidth, imageHeight);
+	frustum.corners[2] = lensPoint(camera, x1 + 0.5f, y1 + 0.5f, imageWidth, imageHeight);
+	frustum.corners[3] = lensPoint(camera, x0 - 0.5f, y1 + 0.5f, imageWidth, imageHeight);
+	frustum.lens[0] = camera.pos;
+	frustum.lens[1] = camera.pos + camera.right;
+	frustum.lens[2] = camera.pos + camera.up;
+	frustum.computePlanes();
+	return frustum;
+}
+
+// Spreads the low 16 bits of v so there is a zero bit between each of them
+static inline unsigned int expandBits16(unsigned int v)
+{
+	v &= 0xffff;
+	v = (v | (v << 8)) & 0x00ff00ff;
+	v = (v | (v << 4)) & 0x0f0f0f0f;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
+
+// Spreads the low 9 bits of v so there are two zero bits between each of them
+static inline unsigned int expandBits9(unsigned int v)
+{
+	v &= 0x1ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+// Constructor
+CpuRenderer::CpuRenderer(const Scene &scene, const std::vector<BVH> &meshBVHs, const BVH &tlas) :
+	bgColor(0.0f), packetSize(0), cullTiles(true), bounces(0), reflectivity(0.5f), sortRays(true), scene(scene), meshBVHs(meshBVHs), tlas(tlas)
+{
+}
+
+void CpuRenderer::render(const RenderCamera &camera, int width, int height, std::vector<float> &pixels, ThreadPool &pool) const
+{
+	if (bounces > 0)
+	{
+		renderWavefront(camera, width, height, pixels, pool);
+		return;
+	}
+
+	pixels.resize((size_t)width * height * 4);
+	renderTileRows(camera, width, height, 0, (height + tileSize - 1) / tileSize, pixels.data(), pool);
+	pool.wait();
+}
+
+// Wavefront rendering: instead of following each pixel's ray through all of its bounces (where neighbouring pixels soon
+// diverge into different bounce counts and parts of the scene), every stage traces one compact queue of rays into a hit
+// buffer, then shades all the hits, adding their color to the pixels and collecting the reflected rays into the next,
+// shorter queue. Same stages as the kernel's (see "Wavefront bounces" in comp.glsl)
+void CpuRenderer::renderWavefront(const RenderCamera &camera, int width, int height, std::vector<float> &pixels, ThreadPool &pool,
+								 WavefrontStats *stats) const
+{
+	if (stats) *stats = WavefrontStats();
+	size_t pixelCount = (size_t)width * height;
+	pixels.assign(pixelCount * 4, 0.0f);
+	for (size_t i = 0; i < pixelCount; i++)
+		pixels[4 * i + 3] = 1.0f;
+
+	// primary rays tile by tile, so rays next to each other in the queue belong to neighbouring pixels
+	std::vector<QueuedRay> queue;
+	queue.reserve(pixelCount);
+	int tilesX = (width + tileSize - 1) / tileSize;
+	int tilesY = (height + tileSize - 1) / tileSize;
+	for (int tileY = 0; tileY < tilesY; tileY++)
+	{
+		for (int tileX = 0; tileX < tilesX; tileX++)
+		{
+			for (int y = tileY * tileSize; y < std::min((tileY + 1) * tileSize, height); y++)
+			{
+				for (int x = tileX * tileSize; x < std::min((tileX + 1) * tileSize, width); x++)
+				{
+					QueuedRay ray;
+					primaryRay(camera, x, y, width, height, ray.orig, ray.dir);
+					ray.pathLength = 0.0f;
+					ray.pixel = y * width + x;
+					ray.weight = glm::vec3(1.0f);
+					queue.push_back(ray);
+				}
+			}
+		}
+	}
+
+	std::vector<SceneHit> hits;
+	for (int bounce = 0; !queue.empty(); bounce++)
+	{
+		size_t chunks = (queue.size() + queueChunk - 1) / queueChunk;
+		std::chrono::steady_clock::time_point sortStart = std::chrono::steady_clock::now();
+		bool sorted = bounce > 0 && sortRays && queue.size() >= minSortedRays; // the primary rays already come in tile order
+		if (sorted) sortQueue(queue, pool);
+		std::chrono::steady_clock::time_point traceStart = std::chrono::steady_clock::now();
+
+		// trace
+		hits.resize(queue.size());
+		for (size_t chunk = 0; chunk < chunks; chunk++)
+		{
+			pool.submit([this, &queue, &hits, chunk] {
+				for (size_t i = chunk * queueChunk; i < std::min((chunk + 1) * queueChunk, queue.size()); i++)
+					intersectScene(scene, meshBVHs, tlas, queue[i].orig, queue[i].dir, hits[i]);
+			});
+		}
+		pool.wait();
+		if (stats)
+		{
+			stats->rays.push_back(queue.size());
+			stats->traceSeconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - traceStart).count());
+			stats->sortSeconds.push_back(sorted ? std::chrono::duration<double>(traceStart - sortStart).count() : 0.0);
+		}
+
+		// shade, every chunk collects its reflected rays on its own and the chunks are joined in order into the next queue
+		bool reflect = bounce < bounces && reflectivity > 0.0f;
+		std::vector<std::vector<QueuedRay> > reflected(chunks);
+		float *dst = pixels.data();
+		for (size_t chunk = 0; chunk < chunks; chunk++)
+		{
+			pool.submit([this, &queue, &hits, &reflected, chunk, reflect, dst] {
+				for (size_t i = chunk * queueChunk; i < std::min((chunk + 1) * queueChunk, queue.size()); i++)
+					shadeQueued(queue[i], hits[i], reflect, dst, reflected[chunk]);
+			});
+		}
+		pool.wait();
+
+		size_t next = 0;
+		for (size_t chunk = 0; chunk < chunks; chunk++)
+			next += reflected[chunk].size();
+		queue.clear();
+		queue.reserve(next);
+		for (size_t chunk = 0; chunk < chunks; chunk++)
+			queue.insert(queue.end(), reflected[chunk].begin(), reflected[chunk].end());
+	}
+}
+
+// Reorders the queue by ray direction octant (top 3 bits of the key) and then by the Morton code of the origin on a 512^3
+// grid over the scene bounds. Which order the rays of a queue are traced and shaded in doesn't change the image
+void CpuRenderer::sortQueue(std::vector<QueuedRay> &queue, ThreadPool &pool) const
+{
+	const float cells = 512.0f;
+	glm::vec3 boundsMin = tlas.nodes[0].boundsMin;
+	glm::vec3 cellScale = cells / glm::max(tlas.nodes[0].boundsMax - boundsMin, glm::vec3(1e-6f));
+
+	std::vector<unsigned int> keys(queue.size());
+	std::vector<unsigned int> order(queue.size());
+	pool.parallelFor(queue.size(), [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			const QueuedRay &ray = queue[i];
+			unsigned int octant = (ray.dir.x < 0.0f ? 1u : 0u) | (ray.dir.y < 0.0f ? 2u : 0u) | (ray.dir.z < 0.0f ? 4u : 0u);
+			glm::vec3 cell = glm::min(glm::max((ray.orig - boundsMin) * cellScale, glm::vec3(0.0f)), glm::vec3(cells - 1.0f));
+			keys[i] = octant << 27 | expandBits9((unsigned int)cell.x) << 2 | expandBits9((unsigned int)cell.y) << 1 |
+					  expandBits9((unsigned int)cell.z);
+			order[i] = (unsigned int)i;
+		}
+	});
+	radixSort(keys, order, 30, pool);
+
+	std::vector<QueuedRay> sorted(queue.size());
+	pool.parallelFor(queue.size(), [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			sorted[i] = queue[order[i]];
+	});
+	queue.swap(sorted);
+}
+
+// Adds the color of a queued ray's hit to its pixel, when reflect is set the hit also appends its reflected ray to reflected
+// The pixel only ever has this one ray in the current queue, so no other task writes to it
+void CpuRenderer::shadeQueued(const QueuedRay &ray, const SceneHit &hit, bool reflect, float *pixels, std::vector<QueuedRay> &reflected) const
+{
+	glm::vec3 color = bgColor;
+	if (hit.instance >= 0 && hit.t < 1000000.0f) // the kernel starts at t = 1000000
+	{
+		const Instance &instance = scene.instances[hit.instance];
+		glm::vec3 edge1, edge2;
+		hitEdges(hit, edge1, edge2);
+		bool backFacing = glm::dot(edge1, glm::cross(instance.toObjectDirection(ray.dir), edge2)) < 0.000001f;
+		if (instance.mirrors()) backFacing = !backFacing;
+
+		float distance = ray.pathLength + hit.t;
+		color = backFacing ? glm::vec3(0.0f) : glm::vec3(1.0f) / std::max(distance * distance, 1.0f);
+		if (reflect)
+		{
+			color *= 1.0f - reflectivity;
+
+			// normals go from object to world space with the transpose of worldToObject
+			glm::vec3 objectNormal = glm::cross(edge1, edge2);
+			glm::vec3 normal = glm::normalize(glm::vec3(instance.worldToObject[0]) * objectNormal.x +
+											  glm::vec3(instance.worldToObject[1]) * objectNormal.y +
+											  glm::vec3(instance.worldToObject[2]) * objectNormal.z);
+			if (glm::dot(normal, ray.dir) > 0.0f) normal = -normal; // the side the ray came from
+
+			QueuedRay bounced;
+			bounced.orig = ray.orig + hit.t * ray.dir + bounceOffset * normal;
+			bounced.pathLength = distance;
+			bounced.dir = ray.dir - 2.0f * glm::dot(ray.dir, normal) * normal;
+			bounced.pixel = ray.pixel;
+			bounced.weight = ray.weight * reflectivity;
+			reflected.push_back(bounced);
+		}
+	}
+
+	float *pixel = &pixels[4 * (size_t)ray.pixel];
+	pixel[0] += ray.weight.r * color.r;
+	pixel[1] += ray.weight.g * color.g;
+	pixel[2] += ray.weight.b * color.b;
+}
+
+void CpuRenderer::renderTileRows(const RenderCamera &camera, int width, int height, int firstTileRow, int tileRows, float *rows,
+								 ThreadPool &pool) const
+{
+	int tilesX = (width + tileSize - 1) / tileSize;
+	int firstRow = firstTileRow * tileSize;
+
+	// tiles along a Z curve, (Morton code, tile index) pairs
+	std::vector<std::pair<unsigned int, int> > order((size_t)tilesX * tileRows);
+	for (int tileY = firstTileRow; tileY < firstTileRow + tileRows; tileY++)
+		for (int tileX = 0; tileX < tilesX; tileX++)
+			order[(size_t)(tileY - firstTileRow) * tilesX + tileX] = std::make_pair(expandBits16(tileY) << 1 | expandBits16(tileX),
+																					 tileY * tilesX + tileX);
+	std::sort(order.begin(), order.end());
+
+	// every worker gets one contiguous run of the curve, a compact patch of the image whose rays share nodes. Each run is
+	// pushed back to front, so its owner renders it in curve order while thieves take from its far end
+	size_t workers = pool.size();
+	for (size_t w = 0; w < workers; w++)
+	{
+		size_t begin = order.size() * w / workers;
+		for (size_t i = order.size() * (w + 1) / workers; i > begin; i--)
+		{
+			int tileX = order[i - 1].second % tilesX;
+			int tileY = order[i - 1].second / tilesX;
+			pool.submitTo((unsigned int)w, [this, &camera, tileX, tileY, width, height, rows, firstRow] {
+				renderTile(camera, tileX, tileY, width, height, rows, firstRow);
+			});
+		}
+	}
+}
+
+void CpuRenderer::renderTile(const RenderCamera &camera, int tileX, int tileY, int width, int height, float *rows, int firstRow) const
+{
+	int xEnd = std::min((tileX + 1) * tileSize, width);
+	int yEnd = std::min((tileY + 1) * tileSize, height);
+
+	std::vector<int> visible;
+	bool culled = cullTiles && cullScene(scene, meshBVHs, tlas, tileFrustum(camera, tileX * tileSize, tileY * tileSize, xEnd - 1, yEnd - 1,
+																			  width, height), maxTileInstances, visible);
+	if (culled && visible.empty())
+	{
+		// nothing in view, every ray would miss
+		for (int y = tileY * tileSize; y < yEnd; y++)
+		{
+			for (int x = tileX * tileSize; x < xEnd; x++)
+			{
+				float *pixel = &rows[4 * ((size_t)(y - firstRow) * width + x)];
+				pixel[0] = bgColor.r;
+				pixel[1] = bgColor.g;
+				pixel[2] = bgColor.b;
+				pixel[3] = 1.0f;
+			}
+		}
+		return;
+	}
+
+	if (packetSize > 0)
+	{
+		renderPackets(camera, tileX, tileY, width, height, culled ? &visible : NULL, rows, firstRow);
+		return;
+	}
+
+	for (int y = tileY * tileSize; y < yEnd; y++)
+	{
+		for (int x = tileX * tileSize; x < xEnd; x++)
+		{
+			glm::vec3 orig, dir;
+			primaryRay(camera, x, y, width, height, orig, dir);
+			SceneHit hit;
+			if (culled) intersectScene(scene, meshBVHs, visible, orig, dir, hit);
+			else intersectScene(scene, meshBVHs, tlas, orig, dir, hit);
+			glm::vec3 color = shade(hit, dir);
+
+			float *pixel = &rows[4 * ((size_t)(y - firstRow) * width + x)];
+			pixel[0] = color.r;
+			pixel[1] = color.g;
+			pixel[2] = color.b;
+			pixel[3] = 1.0f;
+		}
+	}
+}
+
+// Packets that stick out of the image keep the lanes outside of it inactive (they trace a copy of an edge pixel's ray)
+void CpuRenderer::renderPackets(const RenderCamera &camera, int tileX, int tileY, int width, int height, const std::vector<int> *visible,
+								float *rows, int firstRow) const
+{
+	int xEnd = std::min((tileX + 1) * tileSize, width);
+	int yEnd = std::min((tileY + 1) * tileSize, height);
+	RayPacket packet;
+	packet.size = packetSize * packetSize;
+	for (int packetY = tileY * tileSize; packetY < yEnd; packetY += packetSize)
+	{
+		for (int packetX = tileX * tileSize; packetX < xEnd; packetX += packetSize)
+		{
+			uint64_t active = 0;
+			for (int lane = 0; lane < packet.size; lane++)
+			{
+				int x = packetX + lane % packetSize, y = packetY + lane / packetSize;
+				glm::vec3 orig, dir;
+				primaryRay(camera, std::min(x, xEnd - 1), std::min(y, yEnd - 1), width, height, orig, dir);
+				packet.setRay(lane, orig, dir);
+				if (x < xEnd && y < yEnd) active |= (uint64_t)1 << lane;
+			}
+
+			if (visible != NULL) intersectScenePacket(scene, meshBVHs, *visible, packet, active);
+			else intersectScenePacket(scene, meshBVHs, tlas, packet, active);
+
+			for (int lane = 0; lane < packet.size; lane++)
+			{
+				if (!(active >> lane & 1)) continue;
+				SceneHit hit;
+				hit.t = packet.t[lane];
+				hit.instance = packet.instance[lane];
+				hit.triangle = packet.triangle[lane];
+				glm::vec3 color = shade(hit, packet.direction(lane));
+
+				float *pixel = &rows[4 * ((size_t)(packetY + lane / packetSize - firstRow) * width + packetX + lane % packetSize)];
+				pixel[0] = color.r;
+				pixel[1] = color.g;
+				pixel[2] = color.b;
+				pixel[3] = 1.0f;
+			}
+		}
+	}
+}
+
+// Closest hit through the scene's BVHs, then the same facing test and shading as the kernel
+glm::vec3 CpuRenderer::castRay(const glm::vec3 &orig, const glm::vec3 &dir) const
+{
+	SceneHit hit;
+	intersectScene(scene, meshBVHs, tlas, orig, dir, hit);
+	return shade(hit, dir);
+}
+
+glm::vec3 CpuRenderer::shade(const SceneHit &hit, const glm::vec3 &dir) const
+{
+	if (hit.instance < 0 || hit.t >= 1000000.0f) return bgColor; // the kernel starts at t = 1000000
+
+	// facing in the instance's object space (det of the intersection test), swapped by mirroring transforms
+	const Instance &instance = scene.instances[hit.instance];
+	glm::vec3 edge1, edge2;
+	hitEdges(hit, edge1, edge2);
+	float det = glm::dot(edge1, glm::cross(instance.toObjectDirection(dir), edge2));
+	bool backFacing = det < 0.000001f;
+	if (instance.mirrors()) backFacing = !backFacing;
+
+	if (!backFacing) return glm::vec3(1.0f) / std::max(hit.t * hit.t, 1.0f);
+	else return glm::vec3(0.0f);
+}
+
+// Object space edges v1 - v0 and v2 - v0 of the hit triangle, like the records the kernel tests against
+void CpuRenderer::hitEdges(const SceneHit &hit, glm::vec3 &edge1, glm::vec3 &edge2) const
+{
+	const Mesh &mesh = scene.meshes[scene.instances[hit.instance].mesh];
+	const unsigned int *tri = &mesh.indices[3 * (size_t)hit.triangle];
+	glm::vec3 v0 = glm::vec3(mesh.positions[3 * (size_t)tri[0]], mesh.positions[3 * (size_t)tri[0] + 1], mesh.positions[3 * (size_t)tri[0] + 2]);
+	glm::vec3 v1 = glm::vec3(mesh.positions[3 * (size_t)tri[1]], mesh.positions[3 * (size_t)tri[1] + 1], mesh.positions[3 * (size_t)tri[1] + 2]);
+	glm::vec3 v2 = glm::vec3(mesh.positions[3 * (size_t)tri[2]], mesh.positions[3 * (size_t)tri[2] + 1], mesh.positions[3 * (size_t)tri[2] + 2]);
+	edge1 = v1 - v0;
+	edge2 = v2 - v0;
+}
+
+// Constructor
+NumaRenderer::NumaRenderer(const Scene &scene, const std::vector<BVH> &meshBVHs, const BVH &tlas, const NumaTopology &topology,
+						   unsigned int nodeCount) :
+	bgColor(0.0f), packetSize(0), cullTiles(true)
+{
+	if (nodeCount == 0 || nodeCount > topology.nodeCount()) nodeCount = topology.nodeCount();
+	for (unsigned int i = 0; i < nodeCount; i++)
+	{
+		nodes.push_back(std::unique_ptr<Node>(new Node()));
+		Node &node = *nodes.back();
+		node.pool.reset(new ThreadPool(topology.nodeCpus[i]));
+		node.firstTileRow = 0;
+		node.tileRows = 0;
+
+		// copied by one of the node's own workers, first touch puts the copies in its memory
+		node.pool->submit([&node, &scene, &meshBVHs, &tlas] {
+			node.scene = scene;
+			node.meshBVHs = meshBVHs;
+			node.tlas = tlas;
+		});
+	}
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		nodes[i]->pool->wait();
+		nodes[i]->renderer.reset(new CpuRenderer(nodes[i]->scene, nodes[i]->meshBVHs, nodes[i]->tlas));
+	}
+}
+
+unsigned int NumaRenderer::threadCount() const
+{
+	unsigned int count = 0;
+	for (size_t i = 0; i < nodes.size(); i++)
+		count += nodes[i]->pool->size();
+	return count;
+}
+
+void NumaRenderer::render(const RenderCamera &camera, int width, int height, std::vector<float> &pixels)
+{
+	int tilesY = (height + CpuRenderer::tileSize - 1) / CpuRenderer::tileSize;
+	unsigned int threads = threadCount();
+	size_t rowFloats = (size_t)width * 4;
+
+	unsigned int threadsBefore = 0;
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		Node &node = *nodes[i];
+		node.renderer->bgColor = bgColor;
+		node.renderer->packetSize = packetSize;
+		node.renderer->cullTiles = cullTiles;
+
+		// whole tile rows in proportion to the node's threads
+		node.firstTileRow = (int)((size_t)tilesY * threadsBefore / threads);
+		threadsBefore += node.pool->size();
+		node.tileRows = (int)((size_t)tilesY * threadsBefore / threads) - node.firstTileRow;
+		int rows = std::min(node.tileRows * CpuRenderer::tileSize, height - node.firstTileRow * CpuRenderer::tileSize);
+		if (node.tileRows == 0) continue;
+
+		// (re)allocated by the node's own workers when the image size changes, so the band's pages are local to it
+		if (node.band.size() != (size_t)rows * rowFloats)
+		{
+			node.pool->submit([&node, rows, rowFloats] { std::vector<float>((size_t)rows * rowFloats).swap(node.band); });
+			node.pool->wait();
+		}
+		node.renderer->renderTileRows(camera, width, height, node.firstTileRow, node.tileRows, node.band.data(), *node.pool);
+	}
+
+	// every node copies its band into the image as soon as it is done, in parallel with the others
+	pixels.resize((size_t)height * rowFloats);
+	float *dst = pixels.data();
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		Node &node = *nodes[i];
+		node.pool->wait();
+		if (node.tileRows == 0) continue;
+		node.pool->submit([&node, dst, rowFloats] {
+			memcpy(dst + (size_t)node.firstTileRow * CpuRenderer::tileSize * rowFloats, node.band.data(), node.band.size() * sizeof(float));
+		});
+	}
+	for (size_t i = 0; i < nodes.size(); i++)
+		nodes[i]->pool->wait();
+}
+
+
+bool writePPM(const char *path, const std::vector<float> &pixels, int width, int height)
+{
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
+	{
+		printf("ERROR::PPM::FILE_NOT_WRITABLE %s\n", path);
+		return false;
+	}
+
+	fprintf(file, "P6\n%i %i\n255\n", width, height);
+	std::vector<unsigned char> row((size_t)width * 3);
+	for (int y = height - 1; y >= 0; y--) // PPM rows go top to bottom
+	{
+		for (int x = 0; x < width; x++)
+		{
+			const float *pixel = &pixels[4 * ((size_t)y * width + x)];
+			for (int c = 0; c < 3; c++)
+				row[3 * x + c] = (unsigned char)(std::min(std::max(pixel[c], 0.0f), 1.0f) * 255.0f + 0.5f);
+		}
+		fwrite(row.data(), 1, row.size(), file);
+	}
+
+	bool written = !ferror(file);
+	fclose(file);
+	if (!written) printf("ERROR::PPM::WRITE_FAILED %s\n", path);
+	return written;
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <glm\glm.hpp>
+
+#include "ThreadPool.h"
+#include "BVH.h"
+#include "Scene.h"
+#include "Numa.h"
+
+// The camera uniforms of comp.glsl: rays leave the lens (centred on pos, spanned by right and up) pointing away from light
+struct RenderCamera
+{
+	glm::vec3 pos;
+	glm::vec3 right;
+	glm::vec3 up;
+	glm::vec3 light;
+};
+
+// The primary ray comp.glsl's main() shoots through pixel (x, y) of an imageWidth x imageHeight image
+void primaryRay(const RenderCamera &camera, int x, int y, int imageWidth, int imageHeight, glm::vec3 &orig, glm::vec3 &dir);
+
+// The frustum around the primary rays of pixels [x0, x1] x [y0, y1], widened by half a pixel on every side (tileFrustum in comp.glsl)
+Frustum tileFrustum(const RenderCamera &camera, int x0, int y0, int x1, int y1, int imageWidth, int imageHeight);
+
+// CpuRenderer renders the same image as the compute shader without a GPU, for render nodes that have none and as the
+// reference the kernel's output is checked against. The image is cut into tileSize x tileSize tiles that are traced as
+// separate pool tasks. Each worker is seeded with its own run of tiles along a Z curve, idle workers steal tiles from busy
+// ones so uneven tiles (sky vs. geometry) balance out, ThreadPool::workerStats() shows how well that went
+// See relevant source file for function descriptions
+class CpuRenderer
+{
+public:
+	// Constructor: Keep references to the scene and its BVHs (built by the caller), they must outlive the renderer
+	CpuRenderer(const Scene &scene, const std::vector<BVH> &meshBVHs, const BVH &tlas);
+
+	// Renders a width x height image into pixels as RGBA floats, row y = 0 first (the kernel's RGBA32F image layout)
+	void render(const RenderCamera &camera, int width, int height, std::vector<float> &pixels, ThreadPool &pool) const;
+
+	// Queues the tiles of tile rows [firstTileRow, firstTileRow + tileRows) of a width x height image on pool and returns
+	// without waiting for them (pool.wait() does, camera must live until then). rows holds just those pixel rows, starting
+	// with row firstTileRow * tileSize, laid out like render()'s pixels
+	void renderTileRows(const RenderCamera &camera, int width, int height, int firstTileRow, int tileRows, float *rows,
+						ThreadPool &pool) const;
+
+	glm::vec3 castRay(const glm::vec3 &orig, const glm::vec3 &dir) const; // castRay of comp.glsl
+	glm::vec3 shade(const SceneHit &hit, const glm::vec3 &dir) const;	   // the color castRay gives a hit
+
+	glm::vec3 bgColor;
+
+	// 0 traces every pixel's ray on its own, 4 or 8 traces squares of packetSize x packetSize pixels together as one
+	// RayPacket (primary rays of neighbouring pixels mostly visit the same nodes)
+	int packetSize;
+
+	// Cull the scene against every tile's frustum first (cullScene): tiles that see nothing are filled with bgColor without
+	// tracing, the others only trace the instances their frustum overlaps
+	bool cullTiles;
+
+	static const int maxTileInstances = 32; // tiles that see more are traced through the top-level BVH as usual
+
+	// Reflections after the primary hit (0 to 3), above 0 render() switches to the wavefront pipeline (see renderWavefront)
+	// Every surface reflects, reflectivity is the share of a hit's color that comes from its reflection
+	int bounces;
+	float reflectivity;
+
+	// Sort every queue of reflected rays by direction octant, then by origin along a Morton curve over the scene bounds,
+	// before tracing it. Reflections leave the surfaces in all directions, sorted neighbours in the queue (which the same
+	// task traces) start close together and head the same way again. Queues shorter than minSortedRays are traced as
+	// they are, sorting them costs more than it saves
+	bool sortRays;
+	static const size_t minSortedRays = 1 << 14;
+
+	// Work of one renderWavefront() per queue, index 0 is the primary rays
+	struct WavefrontStats
+	{
+		std::vector<size_t> rays;
+		std::vector<double> traceSeconds;
+		std::vector<double> sortSeconds; // 0 for queues that weren't sorted
+	};
+
+	// The wavefront pipeline render() uses when bounces > 0: every stage traces one compact queue of rays, then shades the
+	// hits and collects their reflections into the next queue. Fills stats if given
+	void renderWavefront(const RenderCamera &camera, int width, int height, std::vector<float> &pixels, ThreadPool &pool,
+						 WavefrontStats *stats = NULL) const;
+
+	static const int tileSize = 32;
+
+private:
+	const Scene &scene;
+	const std::vector<BVH> &meshBVHs;
+	const BVH &tlas;
+
+	// A ray waiting in a wavefront queue
+	struct QueuedRay
+	{
+		glm::vec3 orig;
+		float pathLength; // distance travelled before orig, the shading falls off with the whole path like the primary rays'
+		glm::vec3 dir;
+		int pixel;		  // y * width + x
+		glm::vec3 weight; // share of the pixel's color the ray carries
+	};
+
+	static const size_t queueChunk = 4096; // rays per task in the wavefront stages
+	static constexpr float bounceOffset = 0.0001f; // reflected rays start this far off the surface so they don't hit it again
+
+	void sortQueue(std::vector<QueuedRay> &queue, ThreadPool &pool) const;
+	void shadeQueued(const QueuedRay &ray, const SceneHit &hit, bool reflect, float *pixels, std::vector<QueuedRay> &reflected) const;
+	void hitEdges(const SceneHit &hit, glm::vec3 &edge1, glm::vec3 &edge2) const;
+
+	void renderTile(const RenderCamera &camera, int tileX, int tileY, int width, int height, float *rows, int firstRow) const;
+	void renderPackets(const RenderCamera &camera, int tileX, int tileY, int width, int height, const std::vector<int> *visible,
+					   float *rows, int firstRow) const;
+};
+
+// NumaRenderer spreads CpuRenderer over the NUMA nodes of a machine so no thread reads the scene or writes pixels across
+// the interconnect: every node gets a pool of workers pinned to its CPUs, its own copy of the scene and BVHs and its own
+// band of the framebuffer, all allocated and first written by those workers (so the OS places them in the node's memory).
+// Each node renders the tiles of its band, stealing only among its own workers, and the bands are copied into the image
+// See relevant source file for function descriptions
+class NumaRenderer
+{
+public:
+	// Constructor: Set up the first nodeCount nodes of topology (0 = all of them), copying the scene and its BVHs to each
+	NumaRenderer(const Scene &scene, const std::vector<BVH> &meshBVHs, const BVH &tlas, const NumaTopology &topology,
+				 unsigned int nodeCount = 0);
+
+	// Same image as CpuRenderer::render, the bands are sized by the nodes' thread counts
+	void render(const RenderCamera &camera, int width, int height, std::vector<float> &pixels);
+
+	unsigned int nodeCount() const { return (unsigned int)nodes.size(); }
+	unsigned int threadCount() const;
+	ThreadPool &nodePool(unsigned int node) { return *nodes[node]->pool; }
+
+	// passed on to every node's CpuRenderer, see there
+	glm::vec3 bgColor;
+	int packetSize;
+	bool cullTiles;
+
+private:
+	NumaRenderer(const NumaRenderer &); // non-copyable, owns threads
+	NumaRenderer &operator=(const NumaRenderer &);
+
+	struct Node
+	{
+		std::unique_ptr<ThreadPool> pool;
+		Scene scene; // replicas in this node's memory
+		std::vector<BVH> meshBVHs;
+		BVH tlas;
+		std::unique_ptr<CpuRenderer> renderer;
+
+		std::vector<float> band; // this node's pixel rows
+		int firstTileRow;
+		int tileRows;
+	};
+	std::vector<std::unique_ptr<Node> > nodes;
+};
+
+// Writes RGBA float pixels (row y = 0 at the bottom, as rendered) to a binary PPM, clamped to [0, 1]
+// Returns false if the file could not be written
+bool writePPM(const char *path, const std::vector<float> &pixels, int width, int height);
@@ -0,0 +1,234 @@
+#include <vector>
+#include <utility>
+
+#include <glad\glad.h>
+
+#include "GpuLBVH.h"
+
+static const unsigned int workGroupSize = 256;	  // local_size_x of every pass
+static const unsigned int maxWorkGroups = 65535; // passes loop over anything beyond GL_MAX_COMPUTE_WORK_GROUP_COUNT's guaranteed minimum
+
+// Morton codes have 30 bits, sorted 5 at a time (32 digits) in 6 passes
+static const unsigned int keyBits = 30;
+static const unsigned int radixBits = 5;
+static const unsigned int radixSize = 1 << radixBits;
+static const unsigned int scanTileSize = 1024; // block counts scanned per workgroup by radix_scan.glsl
+
+static unsigned int workGroupsFor(unsigned int items)
+{
+	unsigned int groups = (items + workGroupSize - 1) / workGroupSize;
+	if (groups < 1) groups = 1;
+	return groups < maxWorkGroups ? groups : maxWorkGroups;
+}
+
+static unsigned int createBuffer(GLsizeiptr size, const void *data)
+{
+	unsigned int buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, size > 0 ? size : 4, data, GL_DYNAMIC_COPY);
+	return buffer;
+}
+
+static void dispatch(unsigned int groups)
+{
+	glDispatchCompute(groups, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT); // every pass reads what the previous one wrote
+}
+
+// Constructor
+GpuLBVH::GpuLBVH() :
+	boundsPass("lbvh_bounds.glsl"),
+	mortonPass("lbvh_morton.glsl"),
+	countPass("radix_count.glsl"),
+	scanPass("radix_scan.glsl"),
+	scanAddPass("radix_scan_add.glsl"),
+	scatterPass("radix_scatter.glsl"),
+	hierarchyPass("lbvh_hierarchy.glsl"),
+	refitPass("lbvh_refit.glsl"),
+	triCount(0), nodeBuffer(0), boundsBuffer(0), blockCountBuffer(0), internalBuffer(0), leafSlotBuffer(0), costBuffer(0)
+{
+	keyBuffers[0] = keyBuffers[1] = 0;
+	valueBuffers[0] = valueBuffers[1] = 0;
+}
+
+// Destructor
+GpuLBVH::~GpuLBVH()
+{
+	deleteScratch();
+}
+
+void GpuLBVH::deleteScratch()
+{
+	unsigned int buffers[] = {boundsBuffer, keyBuffers[0], keyBuffers[1], valueBuffers[0], valueBuffers[1],
+							  blockCountBuffer, internalBuffer, leafSlotBuffer, costBuffer};
+	for (int i = 0; i < 9; i++)
+		if (buffers[i] != 0) glDeleteBuffers(1, &buffers[i]);
+	if (!tileSumBuffers.empty()) glDeleteBuffers((GLsizei)tileSumBuffers.size(), tileSumBuffers.data());
+	tileSumBuffers.clear();
+
+	boundsBuffer = blockCountBuffer = internalBuffer = leafSlotBuffer = costBuffer = 0;
+	keyBuffers[0] = keyBuffers[1] = 0;
+	valueBuffers[0] = valueBuffers[1] = 0;
+}
+
+void GpuLBVH::build(unsigned int vertices, unsigned int sourceIndices, unsigned int count, unsigned int &indexSSBO, unsigned int &bvhSSBO)
+{
+	deleteScratch();
+	triCount = count;
+	unsigned int slotCount = count > 0 ? 2 * count - 1 : 1;
+	unsigned int blockCount = (count + workGroupSize - 1) / workGroupSize;
+
+	indexSSBO = createBuffer((GLsizeiptr)count * 3 * sizeof(unsigned int), NULL);
+	bvhSSBO = createBuffer((GLsizeiptr)slotCount * sizeof(BVHNode), NULL);
+	nodeBuffer = bvhSSBO;
+
+	unsigned int initialBounds[6] = {0xffffffffu, 0xffffffffu, 0xffffffffu, 0u, 0u, 0u};
+	boundsBuffer = createBuffer(sizeof(initialBounds), initialBounds);
+	for (int i = 0; i < 2; i++)
+	{
+		keyBuffers[i] = createBuffer((GLsizeiptr)count * sizeof(unsigned int), NULL);
+		valueBuffers[i] = createBuffer((GLsizeiptr)count * sizeof(unsigned int), NULL);
+	}
+	blockCountBuffer = createBuffer((GLsizeiptr)blockCount * radixSize * sizeof(unsigned int), NULL);
+	for (unsigned int length = blockCount * radixSize;; length = (length + scanTileSize - 1) / scanTileSize)
+	{
+		unsigned int tileCount = (length + scanTileSize - 1) / scanTileSize;
+		tileSumBuffers.push_back(createBuffer((GLsizeiptr)tileCount * sizeof(unsigned int), NULL));
+		if (tileCount <= 1) break;
+	}
+	internalBuffer = createBuffer((GLsizeiptr)(count > 1 ? count - 1 : 1) * 4 * sizeof(int), NULL);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL); // zero the arrival counters
+	leafSlotBuffer = createBuffer((GLsizeiptr)count * sizeof(int), NULL);
+	costBuffer = createBuffer((GLsizeiptr)slotCount * sizeof(float), NULL);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	if (count == 0) return;
+
+	// ---------- Morton codes ---------- //
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, vertices);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, boundsBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, sourceIndices);
+	boundsPass.use();
+	boundsPass.setUInt("triCount", count);
+	dispatch(workGroupsFor(count));
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, keyBuffers[0]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, valueBuffers[0]);
+	mortonPass.use();
+	mortonPass.setUInt("triCount", count);
+	dispatch(workGroupsFor(count));
+	// ---------- End ---------- //
+
+	// ---------- Radix sort, 6 passes of 5 bits ---------- //
+	// the key and value buffers ping-pong, after an even number of passes the result is back in keyBuffers[0]
+	for (unsigned int shift = 0; shift < keyBits; shift += radixBits)
+	{
+		int in = (shift / radixBits) % 2;
+		int out = 1 - in;
+
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, keyBuffers[in]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, blockCountBuffer);
+		countPass.use();
+		countPass.setUInt("keyCount", count);
+		countPass.setUInt("shift", shift);
+		dispatch(workGroupsFor(count));
+
+		scan(blockCountBuffer, blockCount * radixSize, 0);
+
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, blockCountBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, valueBuffers[in]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, keyBuffers[out]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, valueBuffers[out]);
+		scatterPass.use();
+		scatterPass.setUInt("keyCount", count);
+		scatterPass.setUInt("shift", shift);
+		dispatch(workGroupsFor(count));
+	}
+	// ---------- End ---------- //
+
+	// ---------- Hierarchy ---------- //
+	if (count == 1)
+	{
+		// nothing to split, the root is the only leaf (its bounds come from the refit pass)
+		BVHNode root = BVHNode();
+		root.leftFirst = 0;
+		root.count = 1;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, bvhSSBO);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(BVHNode), &root);
+		int rootSlot = 0;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, leafSlotBuffer);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(int), &rootSlot);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, sourceIndices);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, keyBuffers[0]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, valueBuffers[0]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, indexSSBO);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, bvhSSBO);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, internalBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, leafSlotBuffer);
+	hierarchyPass.use();
+	hierarchyPass.setUInt("triCount", count);
+	dispatch(workGroupsFor(count));
+	// ---------- End ---------- //
+
+	// ---------- Refit ---------- //
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, vertices);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, bvhSSBO);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, internalBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, leafSlotBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, costBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, indexSSBO);
+	refitPass.use();
+	refitPass.setUInt("triCount", count);
+	dispatch(workGroupsFor(count));
+	// ---------- End ---------- //
+
+	for (unsigned int binding = 0; binding < 7; binding++)
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, 0);
+}
+
+// Exclusive prefix sum of length counts in place, tileSumBuffers[level] gets the totals of the tiles radix_scan.glsl scans
+// Those are scanned the same way one level up and added back, until a level fits in a single tile
+void GpuLBVH::scan(unsigned int counts, unsigned int length, size_t level)
+{
+	unsigned int tileCount = (length + scanTileSize - 1) / scanTileSize;
+	unsigned int groups = tileCount < maxWorkGroups ? tileCount : maxWorkGroups;
+	unsigned int tileSums = tileSumBuffers[level];
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, counts);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, tileSums);
+	scanPass.use();
+	scanPass.setUInt("countLength", length);
+	dispatch(groups);
+	if (tileCount <= 1) return; // a single tile starts at 0, nothing to add
+
+	scan(tileSums, tileCount, level + 1);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, counts);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, tileSums);
+	scanAddPass.use();
+	scanAddPass.setUInt("countLength", length);
+	dispatch(groups);
+}
+
+void GpuLBVH::readBack(BVH &bvh) const
+{
+	bvh.nodes.resize(triCount > 0 ? 2 * (size_t)triCount - 1 : 0);
+	bvh.triIndices.resize(triCount);
+	if (triCount == 0)
+	{
+		bvh.markRebuilt();
+		return;
+	}
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, nodeBuffer);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, bvh.nodes.size() * sizeof(BVHNode), bvh.nodes.data());
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, valueBuffers[0]);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, bvh.triIndices.size() * sizeof(unsigned int), bvh.triIndices.data());
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	bvh.markRebuilt();
+}
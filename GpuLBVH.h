@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+
+#include "CompShader.h"
+#include "BVH.h"
+
+// GpuLBVH builds the same kind of tree as BVH::buildLBVH (30-bit Morton codes, SAH collapse) with a chain of compute passes,
+// so the triangles never make a round trip through the CPU. Output buffers match what uploadMeshes() produces for a single
+// mesh, the ray tracing kernel can't tell the difference
+// Only core OpenGL 4.3 features are used (no subgroup operations or extensions), so it also runs on Mesa's llvmpipe
+// See relevant source file for function descriptions
+class GpuLBVH
+{
+public:
+	GpuLBVH();	// Constructor: Compile the build passes (needs a current OpenGL context)
+	~GpuLBVH(); // Destructor: Delete the scratch buffers of the last build
+
+	// Builds over triCount triangles given by sourceIndices (3 vertex indices each, mesh order) into vertices (3 floats each)
+	// Creates indexSSBO holding the triangles' indices in leaf order and bvhSSBO holding 2 * triCount - 1 node slots (slots
+	// of collapsed subtrees stay unused). vertices is only read, the kernel uses it as is
+	void build(unsigned int vertices, unsigned int sourceIndices, unsigned int triCount, unsigned int &indexSSBO, unsigned int &bvhSSBO);
+
+	// Copies the last build's nodes and triangle order into bvh, for CPU-side statistics and rendering
+	void readBack(BVH &bvh) const;
+
+private:
+	CompShader boundsPass;	  // centroid bounds
+	CompShader mortonPass;	  // Morton code per triangle
+	CompShader countPass;	  // radix sort: digit counts per block
+	CompShader scanPass;	  // radix sort: prefix sum over the counts, per tile
+	CompShader scanAddPass;	  // radix sort: adds the scanned tile sums back
+	CompShader scatterPass;	  // radix sort: stable scatter
+	CompShader hierarchyPass; // Karras split search, triangle reordering
+	CompShader refitPass;	  // bottom-up bounds and SAH collapse
+
+	unsigned int triCount;
+	unsigned int nodeBuffer;
+	unsigned int boundsBuffer;
+	unsigned int keyBuffers[2];
+	unsigned int valueBuffers[2];
+	unsigned int blockCountBuffer;
+	std::vector<unsigned int> tileSumBuffers; // one per level of the block count scan
+	unsigned int internalBuffer;
+	unsigned int leafSlotBuffer;
+	unsigned int costBuffer;
+
+	void scan(unsigned int counts, unsigned int length, size_t level);
+	void deleteScratch();
+};
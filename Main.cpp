@@ -9,8 +9,15 @@
  * | - GLM (OpenGL Mathematics: Vector and matrix operations library) |
  * -------------------------------------------------------------------- */
 
+#include <algorithm>
 #include <string>
+#include <cstring>
 #include <cmath>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <vector>
 #include <iostream>
 
 #include <glad\glad.h>
@@ -20,6 +27,15 @@
 
 #include "Shader.h"
 #include "CompShader.h"
+#include "ObjLoader.h"
+#include "ThreadPool.h"
+#include "BVH.h"
+#include "GpuLBVH.h"
+#include "Scene.h"
+#include "WideBVH.h"
+#include "CpuRenderer.h"
+#include "ProgramCache.h"
+#include "UploadRing.h"
 
 const float GOLDEN_RATIO = 1.61803398875f;
 
@@ -31,6 +47,37 @@ int height = width;// / aspectRatio;
 float fov = 40; // in degrees
 glm::vec3 bgColor = glm::vec3(0.0f, 0.3f, 0.28f);
 
+// command line options, see parseArgs
+const char *scenePath = "scene.obj";
+bool benchMode = false; // time the kernel with and without the BVH instead of opening the interactive view
+bool visitBenchMode = false; // count BVH node visits per primary ray on the CPU, SAH vs. split BVH, without opening a window
+bool cpuMode = false;		// render one frame with CpuRenderer and write it to outPath, no window or GPU needed
+bool packetBenchMode = false; // time CpuRenderer with single rays and with 4x4 and 8x8 ray packets, no window or GPU needed
+bool numaBenchMode = false; // time NumaRenderer on 1 to N NUMA nodes, no window or GPU needed
+bool numaMode = false;		// --cpu renders with pinned workers and per-node scene copies (NumaRenderer)
+bool bounceBenchMode = false; // time CpuRenderer's reflection rays with and without sorting them between bounces, no window or GPU needed
+const char *outPath = "render.ppm";
+int packetSize = 4; // CPU renderer ray packets are packetSize x packetSize pixels, 0 traces single rays
+bool threadStats = false; // print every worker's busy and idle time after a CPU render, not just the spread
+bool tileCulling = true; // cull the scene against every screen tile's frustum before tracing its rays (kernel and CPU renderer)
+int bvhBins = 16;		// SAH bins per axis
+std::string bvhBuilder = "sah"; // sah, sbvh (SAH with spatial splits), lbvh (30-bit Morton codes), lbvh63 (63-bit Morton codes)
+								// or gpu-lbvh (30-bit, compute shaders)
+float splitBudget = 0.25f;		// extra triangle references the split BVH may create, relative to the triangle count
+bool wideBVH = false;	   // trace 8-wide BVHs with quantized child boxes instead of the binary ones
+bool animateScene = false; // move a ripple through the scene every frame, the BVH is refitted instead of rebuilt
+int bvhStackSize = 64;	   // traversal stack entries comp.glsl is compiled with, buildScene fits it to the scene's trees
+int wideStackSize = 96;	   // same for the 8-wide mesh BVHs
+
+bool coldStart = false;		  // compile every shader program from source instead of loading the binary cache (it is still written)
+bool retuneWorkgroup = false; // time the kernel's workgroup shapes again even if this driver has a cached winner
+const char *workgroupCachePath = "workgroup_cache.txt"; // autotuned workgroup shape per driver, see autotuneWorkgroup
+
+float rebuildThreshold = 1.5f; // rebuild the BVH once refitting has made its SAH cost this many times worse than when built
+
+const size_t minUploadRegion = 64 * 1024;		 // upload ring region for the camera block and small updates
+const size_t maxUploadRegion = 32 * 1024 * 1024; // largest region (three are mapped), bigger frames send the rest with glBufferSubData
+
 unsigned int frameCount;
 
 // mouse coordinates, WARNING: mouseX and mouseY are only initialized when mouse first moves
@@ -41,6 +88,8 @@ float mouseY;
 // reflections toggling
 bool reflections = false;
 bool reflectionsPrimed = false;
+int reflectionBounces = 3; // reflections per pixel while reflections are on, --bounces n
+float reflectivity = 0.5f;  // share of a surface's color that comes from its reflection
 
 float texCoords[] = {
     0.0f, 0.0f,
@@ -67,26 +116,153 @@ struct Camera
 	glm::vec3 upDir;
 } cam;
 
+// CPU side acceleration structures of the scene
+struct SceneBVHs
+{
+	std::vector<BVH> meshes;		 // one bottom-level BVH per unique mesh
+	std::vector<WideBVH> wideMeshes; // 8-wide versions of meshes, only made with --wide
+	BVH tlas;						 // top-level BVH over the instances
+};
+
+// GPU copies of the scene, the layouts are described in comp.glsl
+struct SceneBuffers
+{
+	unsigned int vertices;	// every mesh's vertices as loaded, one mesh after another
+	unsigned int indices;	// every mesh's triangles (3 vertex indices, made global) in its BVH's leaf order
+							// (vertices and indices are deleted once the records are written, unless --animate)
+	unsigned int records;	// binding 1: intersection record per triangle of indices, see tri_records.glsl
+	unsigned int nodes;		// binding 2: every mesh's BVH one after another, child and triangle indices made global
+	unsigned int tlas;		// binding 3: top-level BVH over the instances
+	unsigned int instances; // binding 4: GPUInstance records in the top-level BVH's leaf order
+
+	std::vector<unsigned int> firstVertex;	 // per mesh, where its vertices start in vertices
+	std::vector<unsigned int> firstTriangle; // per mesh, where its triangles start in indices
+	std::vector<unsigned int> firstNode;	 // per mesh, where its BVH starts in nodes
+	unsigned int triangleCount;				 // triangles in indices (and records)
+};
+
+// GPU queues of the wavefront bounce stages (comp.glsl's stage 1 to 3), sized for one ray per pixel
+struct WavefrontBuffers
+{
+	unsigned int queues[2];	  // QueuedRay arrays, one is traced (binding 8) while the other is filled (binding 9)
+	unsigned int hits;		  // binding 10: QueuedHit per ray of the traced queue
+	unsigned int counters[2]; // atomic counter with each queue's length
+	unsigned int dispatch;	  // binding 11: workgroup counts of the trace and shade stages, written by stage 4
+	size_t capacity;		  // rays per queue, 0 while the buffers don't exist
+};
+
+// Matches the std140 Camera block of comp.glsl (96 bytes), every vec3 takes up a vec4 there
+struct GPUCamera
+{
+	glm::vec4 bgColor;
+	glm::vec4 pos;
+	glm::vec4 front;
+	glm::vec4 right;
+	glm::vec4 up;
+	glm::vec4 light;
+};
+
+// The kernel's Camera uniform buffer (binding 0) and what was last written to it
+struct CameraBuffer
+{
+	unsigned int buffer;
+	GPUCamera uploaded;
+	bool valid; // false until the first upload
+} cameraBuffer;
+
+// Handles of the kernel uniforms set per frame and stage, resolved once when comp.glsl is loaded (see CompShader::uniformHandle)
+struct KernelUniforms
+{
+	int stage;
+	int bounce;
+	int reflectivity;
+} kernelUniforms;
+
+// Matches the std430 Instance struct of comp.glsl (64 bytes)
+struct GPUInstance
+{
+	glm::vec4 worldToObject[3];
+	int rootNode;
+	int firstTriangle;
+	int triangleCount;
+	int mirrored;
+};
+
 // Timing Logic
 // ------------
 float deltaTime = 0.0f;
 float lastFrameTime = 0.0f;
 
+bool parseArgs(int argc, char **argv);
 bool initGLFW(GLFWwindow **window);
 void processInput(GLFWwindow *window);
 void rotateCamera(glm::vec3 about, float amount);
 
 int nextPowerOfTwo(int x);
 
+void makeTetrahedron(Mesh &mesh);
+void writeIndices(const Mesh &mesh, const unsigned int *order, size_t count, unsigned int firstVertex, unsigned int *dst);
+unsigned int createStorageBuffer(const void *data, size_t size);
+void buildBVH(BVH &bvh, const Mesh &mesh, ThreadPool &pool);
+void buildBVHOnGPU(BVH &bvh, const Mesh &mesh, unsigned int &vertexSSBO, unsigned int &indexSSBO, unsigned int &bvhSSBO);
+void buildScene(const Scene &scene, SceneBVHs &bvhs, ThreadPool &pool, SceneBuffers &buffers);
+void uploadMeshes(const Scene &scene, const SceneBVHs &bvhs, SceneBuffers &buffers);
+void writeTriangleRecords(SceneBuffers &buffers, unsigned int firstTriangle, unsigned int count);
+void uploadInstances(const Scene &scene, const SceneBVHs &bvhs, SceneBuffers &buffers, UploadRing *ring = NULL);
+void deleteSceneBuffers(SceneBuffers &buffers);
+void sizeKernelStacks(const SceneBVHs &bvhs);
+BVHNode globalNode(const BVHNode &node, unsigned int firstNode, unsigned int firstTriangle);
+WideNode globalWideNode(const WideNode &node, unsigned int firstNode, unsigned int firstTriangle);
+const std::vector<unsigned int> &uploadOrder(const SceneBVHs &bvhs, size_t mesh);
+
+void animateMesh(Mesh &mesh, const std::vector<float> &restPositions, const AABB &restBounds, float time,
+				 std::vector<unsigned char> &changedVertices, ThreadPool &pool);
+bool updateScene(const Scene &scene, unsigned int meshIndex, const std::vector<unsigned char> &changedVertices,
+				 SceneBVHs &bvhs, ThreadPool &pool, SceneBuffers &buffers, UploadRing &ring);
+size_t uploadRegionSize(size_t frameBytes);
+void fitUploadRing(std::unique_ptr<UploadRing> &ring, size_t frameBytes, bool shrink);
+void forEachDirtyRun(const std::vector<unsigned char> &dirty, const std::function<void(size_t first, size_t count)> &upload);
+
+void initCamera();
+glm::vec3 cameraLightPos();
+RenderCamera renderCamera();
+void createCameraBuffer(CameraBuffer &camera);
+void updateCameraBuffer(CameraBuffer &camera, UploadRing *ring = NULL);
+void deleteCameraBuffer(CameraBuffer &camera);
+CompShader::Defines kernelDefines(bool useBVH, bool culling, int bounces);
+void autotuneWorkgroup(CompShader &compShader);
+void dispatchPixels(const CompShader &compShader);
+void createWavefrontBuffers(WavefrontBuffers &buffers, size_t capacity);
+void deleteWavefrontBuffers(WavefrontBuffers &buffers);
+void dispatchWavefront(CompShader &compShader, WavefrontBuffers &buffers, int bounces);
+void runBenchmark(CompShader &compShader);
+bool runVisitBenchmark();
+bool runCpuRender();
+bool runPacketBenchmark();
+bool runNumaBenchmark();
+bool runBounceBenchmark();
+void loadCpuScene(ThreadPool &pool, Scene &scene, std::vector<BVH> &meshBVHs, BVH &tlas);
+void printWorkerStats(const ThreadPool &pool);
+void printProgramCacheStats();
+
 // callback functions
 void mouse_callback(GLFWwindow *window, double xPos, double yPos);  // rotating camera / looking around
 void scroll_callback(GLFWwindow *window, double xOffset, double yOffset); // scaling
 void framebuffer_size_callback(GLFWwindow* window, int newWidth, int newHeight); // resizing window
 
-int main(void)
+int main(int argc, char **argv)
 {
 	GLFWwindow *window;
 
+	if (!parseArgs(argc, argv)) return -1;
+
+	initCamera();
+	if (visitBenchMode) return runVisitBenchmark() ? 0 : -1; // CPU only, no window needed
+	if (cpuMode) return runCpuRender() ? 0 : -1;
+	if (packetBenchMode) return runPacketBenchmark() ? 0 : -1;
+	if (numaBenchMode) return runNumaBenchmark() ? 0 : -1;
+	if (bounceBenchMode) return runBounceBenchmark() ? 0 : -1;
+
 	// initialize GLFW
 	if (!initGLFW(&window))
 	{
@@ -122,23 +298,55 @@ int main(void)
 	glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &work_grp_inv);
 	printf("max local work group invocations %i\n", work_grp_inv);
 
-	// Initialize Camera
-	cam.moveSpeed = 1.5;
-	cam.rotSpeed = 1;
-	cam.scaleSpeed = 0.1;
-	cam.zoomSpeed = 0.01;
-	cam.scale = 1;
-	cam.zoom = 1;
-	cam.lightPos = glm::vec3(0, 0, -2 - 1.402232f);
-	cam.pos = glm::vec3(0, 0, 3);
-	cam.frontDir = glm::vec3(0, 0, -1);
-	cam.rightDir = glm::vec3(1, 0, 0);
-	cam.upDir = glm::vec3(0, 1, 0);
-
 	// Initialize shaders
-	CompShader compShader("comp.glsl");
+	setProgramCacheReads(!coldStart);
+	CompShader compShader("comp.glsl", 8, 8); // workgroup shape until autotuneWorkgroup has picked one
+	kernelUniforms.stage = compShader.uniformHandle("stage");
+	kernelUniforms.bounce = compShader.uniformHandle("bounce");
+	kernelUniforms.reflectivity = compShader.uniformHandle("reflectivity");
 	Shader shader("vert.glsl", "frag.glsl");
 
+	// Worker threads for CPU-side scene preparation
+	ThreadPool pool;
+
+	// Load scene geometry and send it to the compute shader
+	Scene scene;
+	if (!loadScene(scenePath, scene, pool))
+	{
+		std::cout << "No triangles loaded, using the built-in tetrahedron" << std::endl;
+		scene.meshes.resize(1);
+		scene.instances.resize(1);
+		makeTetrahedron(scene.meshes[0]);
+	}
+
+	SceneBVHs bvhs;
+	SceneBuffers sceneBuffers;
+	buildScene(scene, bvhs, pool, sceneBuffers);
+	createCameraBuffer(cameraBuffer);
+	autotuneWorkgroup(compShader);
+	compShader.select(kernelDefines(true, tileCulling, reflectionBounces)); // built now so that R switches to it right away
+	printProgramCacheStats();
+
+	// undeformed copy of the first mesh for --animate (every instance of it moves along)
+	std::vector<float> restPositions;
+	std::vector<unsigned char> changedVertices;
+	AABB restBounds;
+	if (animateScene)
+	{
+		restPositions = scene.meshes[0].positions;
+		restBounds.min = bvhs.meshes[0].nodes[0].boundsMin;
+		restBounds.max = bvhs.meshes[0].nodes[0].boundsMax;
+	}
+
+	if (benchMode)
+	{
+		runBenchmark(compShader);
+		deleteCameraBuffer(cameraBuffer);
+		deleteSceneBuffers(sceneBuffers);
+		glfwTerminate();
+		return 0;
+	}
+
 	// Create rectangle, this will be the screen and represents the camera lens surface
 
 	// texture coordinates
@@ -185,7 +393,13 @@ int main(void)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
-	glBindImageTexture(0, tex_output, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+	glBindImageTexture(0, tex_output, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F); // the shade stage adds to the pixels
+	WavefrontBuffers wavefront;
+	wavefront.capacity = 0;
+
+	// per-frame uploads (camera, and with --animate the moved vertices and refitted nodes) go through a persistently mapped ring
+	std::unique_ptr<UploadRing> ring(new UploadRing(uploadRegionSize(0)));
+	if (!ring->persistent()) printf("No OpenGL 4.4 (glBufferStorage), per-frame uploads use glBufferSubData\n");
 
 	// OpenGL-Machine settings
 	glClearColor(bgColor.r, bgColor.g, bgColor.b, 1.0f);		 // set clear color
@@ -203,26 +417,42 @@ int main(void)
 		if (frameCount % 100 == 0)
 		{
 			printf("FPS: %f\n", 1.0f / deltaTime);
+			const UploadRing::Stats &uploads = ring->stats();
+			if (uploads.frames > 0)
+			{
+				printf("Uploads: %.1f KB per frame (%.1f KB through the ring, %.1f KB with glBufferSubData), %zu fence waits in %zu frames, %.1f KB regions\n",
+					   (uploads.ringBytes + uploads.fallbackBytes) / 1024.0 / uploads.frames, uploads.ringBytes / 1024.0 / uploads.frames,
+					   uploads.fallbackBytes / 1024.0 / uploads.frames, uploads.fenceWaits, uploads.frames, ring->regionBytes() / 1024.0);
+				fitUploadRing(ring, uploads.peakFrameBytes, true); // give back what the last 100 frames didn't need
+			}
+			ring->resetStats();
+		}
+
+		ring->beginFrame();
+		bool rebuilt = false;
+		if (animateScene)
+		{
+			animateMesh(scene.meshes[0], restPositions, restBounds, currentFrameTime, changedVertices, pool);
+			rebuilt = updateScene(scene, 0, changedVertices, bvhs, pool, sceneBuffers, *ring);
 		}
 
 		// Compute Shader
+		int bounces = reflections ? reflectionBounces : 0;
+		compShader.select(kernelDefines(true, tileCulling, bounces));
 		compShader.use();
-		// set compute shader uniforms
-		compShader.setFloat3("bgColor", bgColor);
-		// compShader.setFloat("aspectRatio", aspectRatio);
-		// compShader.setBool("reflections", reflections);
-		// compShader.setFloat("zoom", cam.zoom);
-		// compShader.setFloat("scale", cam.scale);
-		compShader.setFloat3("test", glm::vec3(1,0,1));
-		compShader.setFloat3("camFront", cam.frontDir);
-		compShader.setFloat3("camRight", cam.rightDir);
-		compShader.setFloat3("camUp", cam.upDir);
-		compShader.setFloat3("camPos", cam.pos);
-		cam.lightPos = cam.pos - 0.5f/(float)asin(glm::radians(fov/2)) * cam.frontDir; // move the light-ray source behind the camera position such that the rays at either side of the width of the
-		compShader.setFloat3("camLight", cam.lightPos);
-		glDispatchCompute(width, height, 1);
+		updateCameraBuffer(cameraBuffer, ring.get());
+		if (bounces > 0)
+			dispatchWavefront(compShader, wavefront, reflectionBounces);
+		else
+		{
+			compShader.setInt(kernelUniforms.stage, 0);
+			dispatchPixels(compShader);
+		}
 		// make sure writing to image has finished before read
 		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+		ring->endFrame();
+		if (rebuilt) fitUploadRing(ring, ring->stats().peakFrameBytes, true); // the new trees' refits touch other nodes
+		else fitUploadRing(ring, ring->lastFrameBytes(), false);
 
 		glClear(GL_COLOR_BUFFER_BIT); // clear back buffer
 
@@ -242,6 +472,10 @@ int main(void)
 		glfwSwapBuffers(window);
 	}
 
+	ring.reset(); // unmaps, needs the context
+	deleteWavefrontBuffers(wavefront);
+	deleteCameraBuffer(cameraBuffer);
+	deleteSceneBuffers(sceneBuffers);
 	glDeleteBuffers(1, &EBO);
 	glDeleteBuffers(1, &VBO);
 	glDeleteVertexArrays(1, &VAO);
@@ -250,6 +484,54 @@ int main(void)
 	return 0;
 }
 
+// Reads the command line: [--bench] [--bench-visits] [--bench-packets] [--bench-numa] [--bench-bounces] [--cpu] [--numa] [--out image.ppm]
+// [--packet 0|4|8] [--thread-stats] [--no-cull] [--retune] [--cold-start] [--bounces n] [--animate] [--wide]
+// [--bins n] [--builder sah|sbvh|lbvh|lbvh63|gpu-lbvh] [--split-budget x] [scene.obj]
+bool parseArgs(int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--bench") == 0) benchMode = true;
+		else if (strcmp(argv[i], "--bench-visits") == 0) visitBenchMode = true;
+		else if (strcmp(argv[i], "--bench-packets") == 0) packetBenchMode = true;
+		else if (strcmp(argv[i], "--bench-numa") == 0) numaBenchMode = true;
+		else if (strcmp(argv[i], "--bench-bounces") == 0) bounceBenchMode = true;
+		else if (strcmp(argv[i], "--numa") == 0) numaMode = true;
+		else if (strcmp(argv[i], "--cpu") == 0) cpuMode = true;
+		else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) outPath = argv[++i];
+		else if (strcmp(argv[i], "--packet") == 0 && i + 1 < argc &&
+				 (strcmp(argv[i + 1], "0") == 0 || strcmp(argv[i + 1], "4") == 0 || strcmp(argv[i + 1], "8") == 0))
+			packetSize = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--thread-stats") == 0) threadStats = true;
+		else if (strcmp(argv[i], "--no-cull") == 0) tileCulling = false;
+		else if (strcmp(argv[i], "--retune") == 0) retuneWorkgroup = true;
+		else if (strcmp(argv[i], "--cold-start") == 0) coldStart = true;
+		else if (strcmp(argv[i], "--bounces") == 0 && i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '3' && argv[i + 1][1] == 0)
+		{
+			reflectionBounces = atoi(argv[++i]);
+			reflections = reflectionBounces > 0;
+		}
+		else if (strcmp(argv[i], "--animate") == 0) animateScene = true;
+		else if (strcmp(argv[i], "--wide") == 0) wideBVH = true;
+		else if (strcmp(argv[i], "--bins") == 0 && i + 1 < argc) bvhBins = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--split-budget") == 0 && i + 1 < argc) splitBudget = (float)atof(argv[++i]);
+		else if (strcmp(argv[i], "--builder") == 0 && i + 1 < argc &&
+				 (strcmp(argv[i + 1], "sah") == 0 || strcmp(argv[i + 1], "sbvh") == 0 || strcmp(argv[i + 1], "lbvh") == 0 ||
+				  strcmp(argv[i + 1], "lbvh63") == 0 || strcmp(argv[i + 1], "gpu-lbvh") == 0))
+			bvhBuilder = argv[++i];
+		else if (argv[i][0] == '-')
+		{
+			printf("Unknown option %s\nUsage: %s [--bench] [--bench-visits] [--bench-packets] [--bench-numa] [--bench-bounces] [--cpu] [--numa] [--out image.ppm] "
+				   "[--packet 0|4|8] [--thread-stats] [--no-cull] [--retune] [--cold-start] [--bounces 0-3] "
+				   "[--animate] [--wide] [--bins n] "
+				   "[--builder sah|sbvh|lbvh|lbvh63|gpu-lbvh] [--split-budget x] [scene.obj]\n", argv[i], argv[0]);
+			return false;
+		}
+		else scenePath = argv[i];
+	}
+	return true;
+}
+
 // More a convenience, this function encapsulates all of the initialization proceedures for creating a GLFW window
 bool initGLFW(GLFWwindow **window)
 {
@@ -404,6 +686,1213 @@ void framebuffer_size_callback(GLFWwindow* window, int newWidth, int newHeight)
     glViewport(0, 0, width, height);
 } 
 
+// The scene rendered when no .obj file could be loaded: three faces along the axis planes and one slanted face
+void makeTetrahedron(Mesh &mesh)
+{
+	float positions[] = {
+		0, 0, 0,
+		1, 0, 0,
+		0, 0, 1,
+		0, 1, 0};
+	unsigned int indices[] = {
+		0, 1, 2,  // 0xz
+		0, 2, 3,  // 0zy
+		0, 3, 1,  // 0yx
+		1, 3, 2}; // xyz
+
+	mesh.positions.assign(positions, positions + 12);
+	mesh.indices.assign(indices, indices + 12);
+}
+
+// Writes the vertex indices of count triangles of mesh, picked by order, offset by firstVertex (the IndexBuffer layout of
+// comp.glsl). The indices themselves are the ones the .obj file gave, only the order of the triangles changes
+void writeIndices(const Mesh &mesh, const unsigned int *order, size_t count, unsigned int firstVertex, unsigned int *dst)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		const unsigned int *tri = &mesh.indices[3 * (size_t)order[i]];
+		*dst++ = tri[0] + firstVertex;
+		*dst++ = tri[1] + firstVertex;
+		*dst++ = tri[2] + firstVertex;
+	}
+}
+
+// Creates a shader storage buffer holding a copy of size bytes at data
+unsigned int createStorageBuffer(const void *data, size_t size)
+{
+	unsigned int SSBO;
+	glGenBuffers(1, &SSBO);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)size, data, GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	return SSBO;
+}
+
+// Builds the BVH with the builder picked on the command line and logs build time and tree quality
+void buildBVH(BVH &bvh, const Mesh &mesh, ThreadPool &pool)
+{
+	std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
+
+	char description[64];
+	if (bvhBuilder == "lbvh" || bvhBuilder == "lbvh63")
+	{
+		int mortonBits = bvhBuilder == "lbvh" ? 30 : 63;
+		bvh.buildLBVH(mesh, pool, mortonBits);
+		snprintf(description, sizeof(description), "LBVH, %i-bit Morton codes", mortonBits);
+	}
+	else if (bvhBuilder == "sbvh")
+	{
+		bvh.binCount = bvhBins;
+		bvh.buildSBVH(mesh, splitBudget);
+		snprintf(description, sizeof(description), "split SAH, %i bins, %zu references", bvh.binCount, bvh.triIndices.size());
+	}
+	else
+	{
+		bvh.binCount = bvhBins;
+		bvh.buildParallel(mesh, pool);
+		snprintf(description, sizeof(description), "binned SAH, %i bins", bvh.binCount);
+	}
+
+	double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+	printf("Built BVH (%s, %u threads): %zu nodes, depth %i, SAH cost %.2f in %.1f ms\n",
+		   description, pool.size(), bvh.nodes.size(), bvh.depth(), bvh.sahCost(), buildSeconds * 1000.0);
+}
+
+// Builds one BVH per unique mesh with the selected builder plus the top-level BVH over the instances, and uploads all of it
+// Memory grows with the unique geometry only, every instance adds one 64 byte record and a few top-level nodes
+void buildScene(const Scene &scene, SceneBVHs &bvhs, ThreadPool &pool, SceneBuffers &buffers)
+{
+	bvhs.meshes.assign(scene.meshes.size(), BVH());
+	bvhs.wideMeshes.clear();
+	if (bvhBuilder == "gpu-lbvh" && scene.meshes.size() == 1 && !wideBVH)
+	{
+		// the GPU builder's output is used as is, a single mesh needs no index fix-ups
+		buildBVHOnGPU(bvhs.meshes[0], scene.meshes[0], buffers.vertices, buffers.indices, buffers.nodes);
+		buffers.firstVertex.assign(1, 0);
+		buffers.firstTriangle.assign(1, 0);
+		buffers.firstNode.assign(1, 0);
+		buffers.triangleCount = scene.meshes[0].triangleCount();
+	}
+	else
+	{
+		for (size_t i = 0; i < scene.meshes.size(); i++)
+		{
+			if (bvhBuilder == "gpu-lbvh")
+			{
+				// several meshes are packed into one buffer on the CPU, keep the read back copy
+				unsigned int vertexSSBO, indexSSBO, bvhSSBO;
+				buildBVHOnGPU(bvhs.meshes[i], scene.meshes[i], vertexSSBO, indexSSBO, bvhSSBO);
+				glDeleteBuffers(1, &bvhSSBO);
+				glDeleteBuffers(1, &indexSSBO);
+				glDeleteBuffers(1, &vertexSSBO);
+			}
+			else buildBVH(bvhs.meshes[i], scene.meshes[i], pool);
+		}
+
+		if (wideBVH)
+		{
+			bvhs.wideMeshes.resize(scene.meshes.size());
+			for (size_t i = 0; i < scene.meshes.size(); i++)
+			{
+				std::chrono::steady_clock::time_point collapseStart = std::chrono::steady_clock::now();
+				bvhs.wideMeshes[i].build(bvhs.meshes[i], scene.meshes[i]);
+				double collapseSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - collapseStart).count();
+
+				size_t binaryBytes = bvhs.meshes[i].nodes.size() * sizeof(BVHNode);
+				size_t wideBytes = bvhs.wideMeshes[i].nodes.size() * sizeof(WideNode);
+				printf("Collapsed to 8-wide BVH: %zu nodes, %.2f MB instead of %.2f MB (%.1fx smaller) in %.1f ms\n",
+					   bvhs.wideMeshes[i].nodes.size(), wideBytes / 1048576.0, binaryBytes / 1048576.0,
+					   (double)binaryBytes / (wideBytes > 0 ? wideBytes : 1), collapseSeconds * 1000.0);
+			}
+		}
+		uploadMeshes(scene, bvhs, buffers);
+	}
+
+	std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
+	buildTLAS(scene, bvhs.meshes, bvhs.tlas);
+	double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+	printf("Built top-level BVH over %zu instances: %zu nodes, depth %i in %.1f ms\n",
+		   scene.instances.size(), bvhs.tlas.nodes.size(), bvhs.tlas.depth(), buildSeconds * 1000.0);
+
+	buffers.records = 0;
+	writeTriangleRecords(buffers, 0, buffers.triangleCount);
+
+	// the kernel only reads the records, the vertex and index buffers they came from are kept for --animate to recompute
+	// them from. Without it they would only double the triangles' footprint
+	if (!animateScene)
+	{
+		glDeleteBuffers(1, &buffers.indices);
+		glDeleteBuffers(1, &buffers.vertices);
+		buffers.vertices = buffers.indices = 0;
+	}
+
+	buffers.tlas = buffers.instances = 0;
+	uploadInstances(scene, bvhs, buffers);
+	sizeKernelStacks(bvhs);
+
+	size_t nodeBytes = 0, vertexCount = 0, uploadedTriangles = 0, flattenedTriangles = 0;
+	for (size_t i = 0; i < scene.meshes.size(); i++)
+	{
+		vertexCount += scene.meshes[i].vertexCount();
+		nodeBytes += wideBVH ? bvhs.wideMeshes[i].nodes.size() * sizeof(WideNode) : bvhs.meshes[i].nodes.size() * sizeof(BVHNode);
+		uploadedTriangles += uploadOrder(bvhs, i).size(); // more than the mesh's triangles where the split BVH duplicated some
+	}
+	for (size_t i = 0; i < scene.instances.size(); i++)
+		flattenedTriangles += scene.meshes[scene.instances[i].mesh].triangleCount();
+	size_t meshBufferBytes = animateScene ? vertexCount * 3 * sizeof(float) + uploadedTriangles * 3 * sizeof(unsigned int) : 0;
+	double sceneMB = (meshBufferBytes + uploadedTriangles * 9 * sizeof(float) + nodeBytes +
+					  bvhs.tlas.nodes.size() * sizeof(BVHNode) + scene.instances.size() * sizeof(GPUInstance)) / 1048576.0;
+	printf("Scene on the GPU: %.1f MB for %zu triangles in %zu instances (%zu triangles flattened)\n",
+		   sceneMB, scene.triangleCount(), scene.instances.size(), flattenedTriangles);
+}
+
+// The kernel's traversal stacks have no overflow path, so they are compiled with room for the deepest tree (see
+// kernelDefines). A binary walk stacks at most one node per level below the root (cullTile up to two at the last), sizes
+// are rounded up to multiples of 32 so rebuilds of a similar tree reuse the kernel variants already compiled
+// An 8-wide node stacks up to 7 of its children, so the wide stack needs 7 entries per level above the deepest node
+void sizeKernelStacks(const SceneBVHs &bvhs)
+{
+	int depth = bvhs.tlas.depth(), wideDepth = 0;
+	for (size_t i = 0; i < bvhs.meshes.size() && !wideBVH; i++)
+		depth = std::max(depth, bvhs.meshes[i].depth());
+	for (size_t i = 0; i < bvhs.wideMeshes.size(); i++)
+		wideDepth = std::max(wideDepth, bvhs.wideMeshes[i].depth());
+
+	int size = std::max(64, (depth + 31) / 32 * 32);
+	if (size != bvhStackSize) printf("Kernel traversal stack: %i entries for BVHs of depth %i\n", size, depth);
+	bvhStackSize = size;
+
+	int wideSize = std::max(96, (7 * std::max(wideDepth - 1, 0) + 31) / 32 * 32);
+	if (wideSize != wideStackSize) printf("Kernel 8-wide traversal stack: %i entries for BVHs of depth %i\n", wideSize, wideDepth);
+	wideStackSize = wideSize;
+}
+
+// The order a mesh's triangles are uploaded in, the leaf order of whichever BVH the kernel traverses
+const std::vector<unsigned int> &uploadOrder(const SceneBVHs &bvhs, size_t mesh)
+{
+	return wideBVH ? bvhs.wideMeshes[mesh].triIndices : bvhs.meshes[mesh].triIndices;
+}
+
+// Packs every mesh's vertices, triangle indices (in its BVH's leaf order) and BVH nodes into buffers, one mesh after another
+// The nodes are bound to SSBO binding 2 (5 for wide nodes), the kernel reads the triangles through writeTriangleRecords()
+void uploadMeshes(const Scene &scene, const SceneBVHs &bvhs, SceneBuffers &buffers)
+{
+	size_t vertexCount = 0, triangleCount = 0, nodeCount = 0;
+	buffers.firstVertex.resize(scene.meshes.size());
+	buffers.firstTriangle.resize(scene.meshes.size());
+	buffers.firstNode.resize(scene.meshes.size());
+	for (size_t i = 0; i < scene.meshes.size(); i++)
+	{
+		buffers.firstVertex[i] = (unsigned int)vertexCount;
+		buffers.firstTriangle[i] = (unsigned int)triangleCount;
+		buffers.firstNode[i] = (unsigned int)nodeCount;
+		vertexCount += scene.meshes[i].vertexCount();
+		triangleCount += uploadOrder(bvhs, i).size();
+		nodeCount += wideBVH ? bvhs.wideMeshes[i].nodes.size() : bvhs.meshes[i].nodes.size();
+	}
+	buffers.triangleCount = (unsigned int)triangleCount;
+
+	// written straight into the mapped buffers, so no second full-size copy of the scene is held in RAM
+	GLsizeiptr size = (GLsizeiptr)vertexCount * 3 * sizeof(float);
+	glGenBuffers(1, &buffers.vertices);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers.vertices);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, size, NULL, GL_STATIC_DRAW);
+	float *vertexDst = (float *)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (vertexDst != NULL)
+	{
+		for (size_t i = 0; i < scene.meshes.size(); i++)
+		{
+			const std::vector<float> &positions = scene.meshes[i].positions;
+			std::copy(positions.begin(), positions.end(), vertexDst + 3 * (size_t)buffers.firstVertex[i]);
+		}
+		glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+	}
+	else std::cout << "ERROR::VERTEX_BUFFER::MAPPING_FAILED" << std::endl;
+
+	size = (GLsizeiptr)triangleCount * 3 * sizeof(unsigned int);
+	glGenBuffers(1, &buffers.indices);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers.indices);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, size, NULL, GL_STATIC_DRAW);
+	unsigned int *indexDst = (unsigned int *)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (indexDst != NULL)
+	{
+		for (size_t i = 0; i < scene.meshes.size(); i++)
+		{
+			const std::vector<unsigned int> &order = uploadOrder(bvhs, i);
+			writeIndices(scene.meshes[i], order.data(), order.size(), buffers.firstVertex[i], indexDst + 3 * (size_t)buffers.firstTriangle[i]);
+		}
+		glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+	}
+	else std::cout << "ERROR::INDEX_BUFFER::MAPPING_FAILED" << std::endl;
+
+	size = (GLsizeiptr)nodeCount * (wideBVH ? sizeof(WideNode) : sizeof(BVHNode));
+	glGenBuffers(1, &buffers.nodes);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers.nodes);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, size, NULL, GL_STATIC_DRAW);
+	void *nodeDst = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (nodeDst != NULL)
+	{
+		for (size_t i = 0; i < scene.meshes.size(); i++)
+		{
+			unsigned int firstNode = buffers.firstNode[i], firstTriangle = buffers.firstTriangle[i];
+			if (wideBVH)
+			{
+				const std::vector<WideNode> &nodes = bvhs.wideMeshes[i].nodes;
+				for (size_t n = 0; n < nodes.size(); n++)
+					((WideNode *)nodeDst)[firstNode + n] = globalWideNode(nodes[n], firstNode, firstTriangle);
+			}
+			else
+			{
+				const std::vector<BVHNode> &nodes = bvhs.meshes[i].nodes;
+				for (size_t n = 0; n < nodes.size(); n++)
+					((BVHNode *)nodeDst)[firstNode + n] = globalNode(nodes[n], firstNode, firstTriangle);
+			}
+		}
+		glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+	}
+	else std::cout << "ERROR::BVH_BUFFER::MAPPING_FAILED" << std::endl;
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, wideBVH ? 5 : 2, buffers.nodes);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+// Runs tri_records.glsl over triangles [firstTriangle, firstTriangle + count) of the index buffer, creating the record
+// buffer first if there is none. The records are bound to SSBO binding 1 for the kernel
+void writeTriangleRecords(SceneBuffers &buffers, unsigned int firstTriangle, unsigned int count)
+{
+	static CompShader recordPass("tri_records.glsl"); // compiled on first use, the GL context exists by then
+	static const int firstTriangleUniform = recordPass.uniformHandle("firstTriangle");
+	static const int triCountUniform = recordPass.uniformHandle("triCount");
+	static const int recordStrideUniform = recordPass.uniformHandle("recordStride");
+
+	if (buffers.records == 0)
+		buffers.records = createStorageBuffer(NULL, (size_t)(buffers.triangleCount > 0 ? buffers.triangleCount : 1) * 9 * sizeof(float));
+
+	if (count > 0)
+	{
+		// bindings the kernel doesn't use, so none of its buffers need to be bound again afterwards
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, buffers.vertices);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, buffers.indices);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, buffers.records);
+		recordPass.use();
+		recordPass.setUInt(firstTriangleUniform, firstTriangle);
+		recordPass.setUInt(triCountUniform, count);
+		recordPass.setUInt(recordStrideUniform, buffers.triangleCount);
+		unsigned int groups = (count + 255) / 256;
+		glDispatchCompute(groups < 65535 ? groups : 65535, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT); // the kernel reads the records next
+	}
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, buffers.records);
+}
+
+// Writes the top-level BVH and instance buffers at SSBO bindings 3 and 4, instances go in the top-level leaf order
+// The buffers are created the first time, the top-level one big enough for any tree over the instances (2n - 1 nodes) so
+// later updates of it fit. Updates go through ring if given
+void uploadInstances(const Scene &scene, const SceneBVHs &bvhs, SceneBuffers &buffers, UploadRing *ring)
+{
+	const BVH &tlas = bvhs.tlas;
+	std::vector<GPUInstance> records(tlas.triIndices.size());
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		const Instance &instance = scene.instances[tlas.triIndices[i]];
+		GPUInstance &record = records[i];
+		for (int row = 0; row < 3; row++)
+			record.worldToObject[row] = instance.worldToObject[row];
+		record.rootNode = (int)buffers.firstNode[instance.mesh];
+		record.firstTriangle = (int)buffers.firstTriangle[instance.mesh];
+		record.triangleCount = (int)bvhs.meshes[instance.mesh].triIndices.size();
+		record.mirrored = instance.mirrors() ? 1 : 0;
+	}
+
+	if (buffers.tlas == 0)
+	{
+		size_t maxNodes = 2 * scene.instances.size() - 1;
+		buffers.tlas = createStorageBuffer(NULL, std::max(maxNodes, tlas.nodes.size()) * sizeof(BVHNode));
+		buffers.instances = createStorageBuffer(NULL, records.size() * sizeof(GPUInstance));
+	}
+
+	size_t tlasBytes = tlas.nodes.size() * sizeof(BVHNode), instanceBytes = records.size() * sizeof(GPUInstance);
+	if (ring)
+	{
+		ring->upload(buffers.tlas, 0, tlas.nodes.data(), tlasBytes);
+		ring->upload(buffers.instances, 0, records.data(), instanceBytes);
+	}
+	else
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers.tlas);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, tlasBytes, tlas.nodes.data());
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers.instances);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, instanceBytes, records.data());
+	}
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, buffers.tlas);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, buffers.instances);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void deleteSceneBuffers(SceneBuffers &buffers)
+{
+	glDeleteBuffers(1, &buffers.instances);
+	glDeleteBuffers(1, &buffers.tlas);
+	glDeleteBuffers(1, &buffers.nodes);
+	glDeleteBuffers(1, &buffers.records);
+	glDeleteBuffers(1, &buffers.indices);
+	glDeleteBuffers(1, &buffers.vertices);
+	buffers.vertices = buffers.indices = buffers.records = buffers.nodes = buffers.tlas = buffers.instances = 0;
+}
+
+// Same for the wide nodes
+WideNode globalWideNode(const WideNode &node, unsigned int firstNode, unsigned int firstTriangle)
+{
+	WideNode global = node;
+	global.childBase += firstNode;
+	global.triBase += firstTriangle;
+	return global;
+}
+
+// A mesh BVH's node with its child or triangle index moved to where the mesh sits in the packed buffers
+BVHNode globalNode(const BVHNode &node, unsigned int firstNode, unsigned int firstTriangle)
+{
+	BVHNode global = node;
+	global.leftFirst += node.isLeaf() ? firstTriangle : firstNode;
+	return global;
+}
+
+// Uploads the vertices and the triangles in mesh order and lets GpuLBVH sort and build them on the GPU, the nodes are bound
+// to SSBO binding 2. bvh receives a read back copy for the statistics and for refitting
+void buildBVHOnGPU(BVH &bvh, const Mesh &mesh, unsigned int &vertexSSBO, unsigned int &indexSSBO, unsigned int &bvhSSBO)
+{
+	vertexSSBO = createStorageBuffer(mesh.positions.data(), mesh.positions.size() * sizeof(float));
+	unsigned int sourceSSBO = createStorageBuffer(mesh.indices.data(), mesh.indices.size() * sizeof(unsigned int));
+
+	GpuLBVH builder; // compiles the passes, kept out of the timing below
+	glFinish();
+	std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
+
+	builder.build(vertexSSBO, sourceSSBO, mesh.triangleCount(), indexSSBO, bvhSSBO);
+	glFinish();
+
+	double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+	builder.readBack(bvh);
+	glDeleteBuffers(1, &sourceSSBO);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, bvhSSBO);
+
+	printf("Built BVH (LBVH on the GPU, 30-bit Morton codes): %zu node slots, depth %i, SAH cost %.2f in %.1f ms\n",
+		   bvh.nodes.size(), bvh.depth(), bvh.sahCost(), buildSeconds * 1000.0);
+}
+
+// ---------- Animation ---------- //
+
+// Moves a ripple along the scene's x axis: vertices within a slab around the wave front are lifted along y, everything else
+// sits at its rest position. changedVertices[i] is set to 1 for the vertices that moved since the previous call
+void animateMesh(Mesh &mesh, const std::vector<float> &restPositions, const AABB &restBounds, float time,
+				 std::vector<unsigned char> &changedVertices, ThreadPool &pool)
+{
+	glm::vec3 extent = restBounds.max - restBounds.min;
+	float halfWidth = extent.x * 0.1f;
+	float amplitude = glm::max(extent.x, glm::max(extent.y, extent.z)) * 0.05f;
+	float period = extent.x + 4.0f * halfWidth; // the front enters and leaves the scene completely
+	float front = restBounds.min.x - 2.0f * halfWidth + std::fmod(time * 0.25f * extent.x, period);
+
+	changedVertices.resize(mesh.vertexCount());
+	pool.parallelFor(mesh.vertexCount(), [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			float w = (restPositions[3 * i] - front) / halfWidth;
+			float y = restPositions[3 * i + 1];
+			if (w > -1.0f && w < 1.0f) y += amplitude * 0.5f * (1.0f + std::cos(3.14159265f * w));
+
+			changedVertices[i] = mesh.positions[3 * i + 1] != y;
+			mesh.positions[3 * i + 1] = y;
+		}
+	});
+}
+
+// Refits the mesh's BVH to the moved vertices and re-uploads only the vertices and nodes that changed, or rebuilds the
+// scene's BVHs from scratch once the refitted tree has become more than rebuildThreshold times as expensive as a fresh one
+// The top-level BVH is rebuilt either way, the instances' boxes follow the mesh. Returns true if the BVHs were rebuilt
+bool updateScene(const Scene &scene, unsigned int meshIndex, const std::vector<unsigned char> &changedVertices,
+				 SceneBVHs &bvhs, ThreadPool &pool, SceneBuffers &buffers, UploadRing &ring)
+{
+	const Mesh &mesh = scene.meshes[meshIndex];
+	BVH &bvh = bvhs.meshes[meshIndex];
+
+	std::vector<unsigned char> changedNodes;
+	bvh.refit(mesh, pool, changedNodes);
+
+	float degradation = bvh.degradation();
+	if (degradation > rebuildThreshold)
+	{
+		printf("BVH SAH cost grew %.2fx since it was built, rebuilding\n", degradation);
+		deleteSceneBuffers(buffers);
+		buildScene(scene, bvhs, pool, buffers);
+		return true;
+	}
+	if (wideBVH) bvhs.wideMeshes[meshIndex].refit(bvh, mesh, pool, changedNodes);
+
+	unsigned int firstVertex = buffers.firstVertex[meshIndex];
+	unsigned int firstTriangle = buffers.firstTriangle[meshIndex];
+	unsigned int firstNode = buffers.firstNode[meshIndex];
+
+	// the index buffer stays as it is, only the moved vertices are sent and the mesh's records recomputed from them
+	forEachDirtyRun(changedVertices, [&](size_t first, size_t count) {
+		ring.upload(buffers.vertices, (firstVertex + first) * 3 * sizeof(float), &mesh.positions[3 * first], count * 3 * sizeof(float));
+	});
+	writeTriangleRecords(buffers, firstTriangle, (unsigned int)uploadOrder(bvhs, meshIndex).size());
+
+	if (wideBVH)
+	{
+		const std::vector<WideNode> &nodes = bvhs.wideMeshes[meshIndex].nodes;
+		std::vector<WideNode> nodeStaging;
+		forEachDirtyRun(changedNodes, [&](size_t first, size_t count) {
+			nodeStaging.resize(count);
+			for (size_t n = 0; n < count; n++)
+				nodeStaging[n] = globalWideNode(nodes[first + n], firstNode, firstTriangle);
+			ring.upload(buffers.nodes, (firstNode + first) * sizeof(WideNode), nodeStaging.data(), count * sizeof(WideNode));
+		});
+	}
+	else
+	{
+		std::vector<BVHNode> nodeStaging;
+		forEachDirtyRun(changedNodes, [&](size_t first, size_t count) {
+			nodeStaging.resize(count);
+			for (size_t n = 0; n < count; n++)
+				nodeStaging[n] = globalNode(bvh.nodes[first + n], firstNode, firstTriangle);
+			ring.upload(buffers.nodes, (firstNode + first) * sizeof(BVHNode), nodeStaging.data(), count * sizeof(BVHNode));
+		});
+	}
+
+	buildTLAS(scene, bvhs.meshes, bvhs.tlas);
+	uploadInstances(scene, bvhs, buffers, &ring);
+	return false;
+}
+
+// Upload ring region for frames that send frameBytes: a quarter more for headroom, rounded up to 64 KB and kept within
+// [minUploadRegion, maxUploadRegion]
+size_t uploadRegionSize(size_t frameBytes)
+{
+	size_t size = (frameBytes + frameBytes / 4 + minUploadRegion - 1) / minUploadRegion * minUploadRegion;
+	return std::min(std::max(size, minUploadRegion), maxUploadRegion);
+}
+
+// The ring is sized from what frames actually send (the moved vertices and changed nodes of --animate, not whole meshes):
+// it grows right after a frame that didn't fit, whose overflow went through glBufferSubData, and with shrink it is also made
+// smaller to fit frameBytes. Only call it between frames
+void fitUploadRing(std::unique_ptr<UploadRing> &ring, size_t frameBytes, bool shrink)
+{
+	size_t size = uploadRegionSize(frameBytes);
+	if (size == ring->regionBytes() || (size < ring->regionBytes() && !shrink)) return;
+	ring.reset(); // queued copies out of it still run, the GL keeps the buffer until they are done
+	ring.reset(new UploadRing(size));
+}
+
+// Calls upload(first, count) for every run of set flags in dirty. Runs separated by only a few clean elements are joined,
+// re-sending those is cheaper than another glBufferSubData call
+void forEachDirtyRun(const std::vector<unsigned char> &dirty, const std::function<void(size_t first, size_t count)> &upload)
+{
+	const size_t mergeGap = 64;
+
+	size_t i = 0;
+	while (i < dirty.size())
+	{
+		if (!dirty[i])
+		{
+			i++;
+			continue;
+		}
+
+		size_t first = i;
+		size_t last = i; // last dirty element of the run
+		for (i++; i < dirty.size() && i - last <= mergeGap; i++)
+			if (dirty[i]) last = i;
+
+		upload(first, last - first + 1);
+		i = last + 1;
+	}
+}
+// ---------- End ---------- //
+
+// Creates the Camera uniform buffer and binds it to binding 0, where every variant of the kernel reads it
+void createCameraBuffer(CameraBuffer &camera)
+{
+	glGenBuffers(1, &camera.buffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, camera.buffer);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(GPUCamera), NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, 0, camera.buffer);
+	camera.valid = false;
+}
+
+// Writes the current camera and background color to the Camera uniform buffer, in one glBufferSubData (or one copy out of
+// ring) and only if they changed since the last write
+void updateCameraBuffer(CameraBuffer &camera, UploadRing *ring)
+{
+	cam.lightPos = cameraLightPos();
+	GPUCamera block;
+	block.bgColor = glm::vec4(bgColor, 0.0f);
+	block.pos = glm::vec4(cam.pos, 0.0f);
+	block.front = glm::vec4(cam.frontDir, 0.0f);
+	block.right = glm::vec4(cam.rightDir, 0.0f);
+	block.up = glm::vec4(cam.upDir, 0.0f);
+	block.light = glm::vec4(cam.lightPos, 0.0f);
+	if (camera.valid && memcmp(&block, &camera.uploaded, sizeof(block)) == 0) return;
+
+	if (ring) ring->upload(camera.buffer, 0, &block, sizeof(block));
+	else
+	{
+		glBindBuffer(GL_UNIFORM_BUFFER, camera.buffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+	camera.uploaded = block;
+	camera.valid = true;
+}
+
+void deleteCameraBuffer(CameraBuffer &camera)
+{
+	glDeleteBuffers(1, &camera.buffer);
+	camera.valid = false;
+}
+
+// The kernel variant for a mode, compiled in instead of branched on per pixel (see the defines at the top of comp.glsl)
+// The 8-wide BVH follows --wide, the stack size the current scene (see sizeKernelStacks)
+CompShader::Defines kernelDefines(bool useBVH, bool culling, int bounces)
+{
+	CompShader::Defines defines;
+	defines["USE_BVH"] = useBVH ? "1" : "0";
+	defines["WIDE_BVH"] = wideBVH ? "1" : "0";
+	defines["TILE_CULLING"] = culling ? "1" : "0";
+	defines["BOUNCES"] = std::to_string(bounces);
+	defines["BVH_STACK_SIZE"] = std::to_string(bvhStackSize);
+	defines["WIDE_STACK_SIZE"] = std::to_string(wideStackSize);
+	return defines;
+}
+
+// One invocation per pixel, in workgroups of the shape compShader was built with
+void dispatchPixels(const CompShader &compShader)
+{
+	int groupWidth = compShader.localSizeX(), groupHeight = compShader.localSizeY();
+	glDispatchCompute((width + groupWidth - 1) / groupWidth, (height + groupHeight - 1) / groupHeight, 1);
+}
+
+// Picks the workgroup shape the kernel runs fastest with on this GPU: compShader is rebuilt with every candidate shape and
+// renders the start-up view a few times with each (BVH and tile culling on, timed with GL_TIME_ELAPSED queries, the first
+// frame is a warm-up). The winner goes into workgroupCachePath under the driver's vendor, renderer and version strings, so
+// later starts on the same driver just read it back (unless --retune)
+void autotuneWorkgroup(CompShader &compShader)
+{
+	const int frames = 4;
+	const int candidates[][2] = {{8, 8}, {16, 8}, {8, 16}, {16, 16}, {32, 4}, {32, 8}, {64, 2}, {64, 4}};
+	const int candidateCount = sizeof(candidates) / sizeof(candidates[0]);
+
+	std::string device = std::string((const char *)glGetString(GL_VENDOR)) + " / " + (const char *)glGetString(GL_RENDERER) +
+						 " / " + (const char *)glGetString(GL_VERSION);
+
+	// one "x y device" line per driver, the lines of other drivers are kept as they are
+	std::vector<std::string> cacheLines;
+	std::ifstream cacheFile(workgroupCachePath);
+	std::string line;
+	while (std::getline(cacheFile, line))
+	{
+		int x, y, deviceStart = 0;
+		if (sscanf(line.c_str(), "%d %d %n", &x, &y, &deviceStart) == 2 && deviceStart > 0 && line.substr(deviceStart) == device)
+		{
+			if (retuneWorkgroup) continue; // replaced below
+			compShader.setLocalSize(x, y);
+			printf("Workgroup %ix%i (cached for %s)\n", x, y, device.c_str());
+			return;
+		}
+		cacheLines.push_back(line);
+	}
+	cacheFile.close();
+
+	int maxInvocations, maxSize[2];
+	glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxInvocations);
+	glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &maxSize[0]);
+	glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 1, &maxSize[1]);
+
+	// the kernel writes somewhere while it is timed
+	unsigned int target;
+	glGenTextures(1, &target);
+	glBindTexture(GL_TEXTURE_2D, target);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); // no mipmaps, the texture is complete without them
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+	glBindImageTexture(0, target, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+	unsigned int query;
+	glGenQueries(1, &query);
+
+	compShader.select(kernelDefines(true, tileCulling, 0)); // what the render loop runs without reflections
+	int best = -1;
+	GLuint64 bestNanoseconds = 0;
+	for (int c = 0; c < candidateCount; c++)
+	{
+		int x = candidates[c][0], y = candidates[c][1];
+		if (x * y > maxInvocations || x > maxSize[0] || y > maxSize[1]) continue;
+
+		compShader.setLocalSize(x, y);
+		compShader.use();
+		updateCameraBuffer(cameraBuffer);
+		compShader.setInt(kernelUniforms.stage, 0);
+
+		GLuint64 totalNanoseconds = 0;
+		for (int frame = 0; frame <= frames; frame++)
+		{
+			glBeginQuery(GL_TIME_ELAPSED, query);
+			dispatchPixels(compShader);
+			glEndQuery(GL_TIME_ELAPSED);
+
+			GLuint64 nanoseconds;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanoseconds); // blocks until the dispatch is done
+			if (frame > 0) totalNanoseconds += nanoseconds;
+		}
+		printf("Workgroup %ix%i: %.2f ms per frame\n", x, y, totalNanoseconds * 1e-6 / frames);
+		if (best < 0 || totalNanoseconds < bestNanoseconds)
+		{
+			best = c;
+			bestNanoseconds = totalNanoseconds;
+		}
+	}
+
+	glDeleteQueries(1, &query);
+	glDeleteTextures(1, &target);
+
+	compShader.setLocalSize(candidates[best][0], candidates[best][1]);
+	char bestLine[32];
+	snprintf(bestLine, sizeof(bestLine), "%d %d ", candidates[best][0], candidates[best][1]);
+	cacheLines.push_back(bestLine + device);
+
+	std::ofstream cacheOut(workgroupCachePath);
+	for (size_t i = 0; i < cacheLines.size(); i++)
+		cacheOut << cacheLines[i] << "\n";
+	if (!cacheOut) std::cout << "ERROR::WORKGROUP_CACHE::FILE_NOT_SUCCESSFULLY_WRITTEN: " << workgroupCachePath << std::endl;
+	printf("Workgroup %ix%i picked for %s\n", candidates[best][0], candidates[best][1], device.c_str());
+}
+
+// Allocates both ray queues, the hit buffer and the queue length counters for capacity rays each
+void createWavefrontBuffers(WavefrontBuffers &buffers, size_t capacity)
+{
+	const size_t rayBytes = 48; // std430 QueuedRay
+	const size_t hitBytes = 16; // std430 QueuedHit
+	for (int i = 0; i < 2; i++)
+	{
+		buffers.queues[i] = createStorageBuffer(NULL, capacity * rayBytes);
+		unsigned int zero = 0;
+		glGenBuffers(1, &buffers.counters[i]);
+		glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, buffers.counters[i]);
+		glBufferData(GL_ATOMIC_COUNTER_BUFFER, sizeof(zero), &zero, GL_DYNAMIC_DRAW);
+	}
+	glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+	buffers.hits = createStorageBuffer(NULL, capacity * hitBytes);
+	buffers.dispatch = createStorageBuffer(NULL, 3 * sizeof(unsigned int));
+	buffers.capacity = capacity;
+}
+
+void deleteWavefrontBuffers(WavefrontBuffers &buffers)
+{
+	if (buffers.capacity == 0) return;
+	glDeleteBuffers(2, buffers.queues);
+	glDeleteBuffers(1, &buffers.hits);
+	glDeleteBuffers(2, buffers.counters);
+	glDeleteBuffers(1, &buffers.dispatch);
+	buffers.capacity = 0;
+}
+
+// Renders the frame as wavefront stages: queue the primary rays, then per bounce trace the queue and shade its hits, which
+// fills the other queue with the reflected rays. The queue lengths never come back to the CPU: a one-invocation pass
+// (stage 4) writes the workgroup counts for the queue into buffers.dispatch and the trace and shade stages are launched
+// from there with glDispatchComputeIndirect, so bounces whose rays mostly left the scene launch few workgroups. The buffers
+// are (re)made when the window grew past them. compShader has to be the variant compiled for bounces (see kernelDefines)
+void dispatchWavefront(CompShader &compShader, WavefrontBuffers &buffers, int bounces)
+{
+	int groupWidth = compShader.localSizeX(), groupHeight = compShader.localSizeY();
+	unsigned int groupsX = (width + groupWidth - 1) / groupWidth, groupsY = (height + groupHeight - 1) / groupHeight;
+	size_t capacity = (size_t)groupsX * groupsY * groupWidth * groupHeight;
+	if (buffers.capacity < capacity)
+	{
+		deleteWavefrontBuffers(buffers);
+		createWavefrontBuffers(buffers, capacity);
+	}
+
+	compShader.setFloat(kernelUniforms.reflectivity, reflectivity);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, buffers.hits);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, buffers.dispatch);
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, buffers.dispatch);
+
+	int current = 0; // queue traced in this bounce, the primary rays go to the other one
+	for (int bounce = -1; bounce <= bounces; bounce++)
+	{
+		// the queue being filled starts out empty
+		unsigned int zero = 0;
+		glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, buffers.counters[1 - current]);
+		glBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(zero), &zero);
+
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, buffers.queues[current]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, buffers.queues[1 - current]);
+		glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, 0, buffers.counters[current]);
+		glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, 1, buffers.counters[1 - current]);
+
+		if (bounce < 0)
+		{
+			compShader.setInt(kernelUniforms.stage, 1);
+			glDispatchCompute(groupsX, groupsY, 1);
+		}
+		else
+		{
+			compShader.setInt(kernelUniforms.stage, 4);
+			glDispatchCompute(1, 1, 1);
+			glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+
+			compShader.setInt(kernelUniforms.bounce, bounce);
+			compShader.setInt(kernelUniforms.stage, 2);
+			glDispatchComputeIndirect(0);
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+			compShader.setInt(kernelUniforms.stage, 3);
+			glDispatchComputeIndirect(0);
+		}
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_ATOMIC_COUNTER_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+						GL_BUFFER_UPDATE_BARRIER_BIT);
+		current = 1 - current;
+	}
+	glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+}
+
+// Start-up view
+void initCamera()
+{
+	cam.moveSpeed = 1.5;
+	cam.rotSpeed = 1;
+	cam.scaleSpeed = 0.1;
+	cam.zoomSpeed = 0.01;
+	cam.scale = 1;
+	cam.zoom = 1;
+	cam.lightPos = glm::vec3(0, 0, -2 - 1.402232f);
+	cam.pos = glm::vec3(0, 0, 3);
+	cam.frontDir = glm::vec3(0, 0, -1);
+	cam.rightDir = glm::vec3(1, 0, 0);
+	cam.upDir = glm::vec3(0, 1, 0);
+}
+
+// move the light-ray source behind the camera position such that the rays at either side of the width of the
+// lens span the field of view
+glm::vec3 cameraLightPos()
+{
+	return cam.pos - 0.5f/(float)asin(glm::radians(fov/2)) * cam.frontDir;
+}
+
+// The current camera as the kernel sees it through the camPos, camRight, camUp and camLight uniforms
+RenderCamera renderCamera()
+{
+	RenderCamera camera;
+	camera.pos = cam.pos;
+	camera.right = cam.rightDir;
+	camera.up = cam.upDir;
+	camera.light = cameraLightPos();
+	return camera;
+}
+
+// Renders the start-up view a few times with every triangle tested per ray, then with the BVH and then with the BVH and tile
+// culling, and prints primary rays per second for each. Each frame is timed on the GPU with a GL_TIME_ELAPSED query, the
+// first frame of each mode is a warm-up and isn't counted. Runs before the render loop has made its output texture, so it
+// binds one of its own (without an image the kernel returns before tracing anything)
+void runBenchmark(CompShader &compShader)
+{
+	const int frames = 8;
+	double raysPerSecond[3];
+
+	unsigned int target;
+	glGenTextures(1, &target);
+	glBindTexture(GL_TEXTURE_2D, target);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); // no mipmaps, the texture is complete without them
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+	glBindImageTexture(0, target, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+	unsigned int query;
+	glGenQueries(1, &query);
+
+	for (int mode = 0; mode < 3; mode++)
+	{
+		compShader.select(kernelDefines(mode >= 1, mode == 2, 0));
+		compShader.use();
+		updateCameraBuffer(cameraBuffer);
+		compShader.setInt(kernelUniforms.stage, 0); // primary rays only
+
+		GLuint64 totalNanoseconds = 0;
+		for (int frame = 0; frame <= frames; frame++)
+		{
+			glBeginQuery(GL_TIME_ELAPSED, query);
+			dispatchPixels(compShader);
+			glEndQuery(GL_TIME_ELAPSED);
+
+			GLuint64 nanoseconds;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanoseconds); // blocks until the dispatch is done
+			if (frame > 0) totalNanoseconds += nanoseconds;
+		}
+		raysPerSecond[mode] = (double)width * height * frames / (totalNanoseconds * 1e-9);
+	}
+
+	glDeleteQueries(1, &query);
+	glDeleteTextures(1, &target);
+
+	printf("Bench %ix%i: all triangles %.2f Mrays/s, %s BVH %.2f Mrays/s (%.1fx), with tile culling %.2f Mrays/s (%.1fx)\n", width,
+		   height, raysPerSecond[0] * 1e-6, wideBVH ? "8-wide" : "binary", raysPerSecond[1] * 1e-6, raysPerSecond[1] / raysPerSecond[0],
+		   raysPerSecond[2] * 1e-6, raysPerSecond[2] / raysPerSecond[0]);
+}
+
+// Traces the start-up view's primary rays on the CPU through binned SAH BVHs and through split BVHs of the same scene and
+// prints how many nodes and triangles each ray touches on average. Node visits are what spatial splits are meant to save,
+// unlike the GPU timings of runBenchmark they don't depend on the driver or on what else the GPU is doing
+bool runVisitBenchmark()
+{
+	ThreadPool pool;
+	Scene scene;
+	if (!loadScene(scenePath, scene, pool))
+	{
+		printf("ERROR::BENCH::NO_TRIANGLES %s\n", scenePath);
+		return false;
+	}
+
+	const char *names[2] = {"binned SAH", "split SAH"};
+	for (int mode = 0; mode < 2; mode++)
+	{
+		std::vector<BVH> meshBVHs(scene.meshes.size());
+		BVH tlas;
+		size_t triangles = 0, references = 0;
+		std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < scene.meshes.size(); i++)
+		{
+			meshBVHs[i].binCount = bvhBins;
+			if (mode == 0) meshBVHs[i].buildParallel(scene.meshes[i], pool);
+			else meshBVHs[i].buildSBVH(scene.meshes[i], splitBudget);
+			triangles += scene.meshes[i].triangleCount();
+			references += meshBVHs[i].triIndices.size();
+		}
+		double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+		buildTLAS(scene, meshBVHs, tlas);
+
+		// one row of pixels per task, every task counts into its own stats
+		RenderCamera camera = renderCamera();
+		std::vector<TraversalStats> rowStats(height);
+		pool.parallelFor(height, [&](size_t begin, size_t end) {
+			for (size_t y = begin; y < end; y++)
+			{
+				for (int x = 0; x < width; x++)
+				{
+					glm::vec3 orig, dir;
+					primaryRay(camera, x, (int)y, width, height, orig, dir);
+					SceneHit hit;
+					intersectScene(scene, meshBVHs, tlas, orig, dir, hit, &rowStats[y]);
+				}
+			}
+		});
+		TraversalStats stats;
+		for (int y = 0; y < height; y++)
+		{
+			stats.nodeVisits += rowStats[y].nodeVisits;
+			stats.triangleTests += rowStats[y].triangleTests;
+		}
+
+		double rays = (double)width * height;
+		printf("Visits %ix%i, %s: %.1f nodes, %.1f triangles per ray, %zu references (+%.1f%%), built in %.1f ms\n", width, height,
+			   names[mode], stats.nodeVisits / rays, stats.triangleTests / rays, references,
+			   100.0 * (references - triangles) / (triangles > 0 ? triangles : 1), buildSeconds * 1000.0);
+	}
+	return true;
+}
+
+// Loads the scene (or the tetrahedron) and builds its BVHs and triangle blocks for CpuRenderer, with the selected builder
+// (gpu-lbvh needs a GL context, the CPU LBVH is used instead)
+void loadCpuScene(ThreadPool &pool, Scene &scene, std::vector<BVH> &meshBVHs, BVH &tlas)
+{
+	if (!loadScene(scenePath, scene, pool))
+	{
+		std::cout << "No triangles loaded, using the built-in tetrahedron" << std::endl;
+		scene.meshes.resize(1);
+		scene.instances.resize(1);
+		makeTetrahedron(scene.meshes[0]);
+	}
+
+	if (bvhBuilder == "gpu-lbvh") bvhBuilder = "lbvh";
+	meshBVHs.assign(scene.meshes.size(), BVH());
+	for (size_t i = 0; i < scene.meshes.size(); i++)
+	{
+		buildBVH(meshBVHs[i], scene.meshes[i], pool);
+		meshBVHs[i].buildBlocks(scene.meshes[i]);
+	}
+	buildTLAS(scene, meshBVHs, tlas);
+}
+
+// Renders the start-up view on the CPU and writes it to outPath, for machines without an OpenGL 4.3 GPU and as the reference
+// image for the kernel
+bool runCpuRender()
+{
+	ThreadPool pool;
+	Scene scene;
+	std::vector<BVH> meshBVHs;
+	BVH tlas;
+	loadCpuScene(pool, scene, meshBVHs, tlas);
+
+	CpuRenderer renderer(scene, meshBVHs, tlas);
+	renderer.bgColor = bgColor;
+	renderer.packetSize = packetSize;
+	renderer.cullTiles = tileCulling;
+	renderer.bounces = reflections ? reflectionBounces : 0;
+	renderer.reflectivity = reflectivity;
+	std::unique_ptr<NumaRenderer> numaRenderer;
+	if (numaMode)
+	{
+		if (renderer.bounces > 0) printf("--numa renders primary rays only, ignoring --bounces\n");
+		numaRenderer.reset(new NumaRenderer(scene, meshBVHs, tlas, numaTopology()));
+		numaRenderer->bgColor = bgColor;
+		numaRenderer->packetSize = packetSize;
+		numaRenderer->cullTiles = tileCulling;
+	}
+
+	std::vector<float> pixels;
+	pool.resetWorkerStats();
+	std::chrono::steady_clock::time_point renderStart = std::chrono::steady_clock::now();
+	if (numaRenderer) numaRenderer->render(renderCamera(), width, height, pixels);
+	else renderer.render(renderCamera(), width, height, pixels, pool);
+	double renderSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - renderStart).count();
+
+	const TriangleBlocks &blocks = meshBVHs[0].triangleBlocks();
+	char packets[32] = "single rays";
+	if (packetSize > 0) snprintf(packets, sizeof(packets), "%ix%i packets", packetSize, packetSize);
+	char threads[48];
+	if (numaRenderer) snprintf(threads, sizeof(threads), "%u pinned threads on %u NUMA nodes", numaRenderer->threadCount(), numaRenderer->nodeCount());
+	else snprintf(threads, sizeof(threads), "%u threads", pool.size());
+	printf("CPU render %ix%i (%s, %ix%i tiles%s, %s, %s kernel on %i-wide triangle blocks): %.1f ms, %.2f Mrays/s\n",
+		   width, height, threads, CpuRenderer::tileSize, CpuRenderer::tileSize, tileCulling ? " culled" : "", packets,
+		   blocks.kernelName(), blocks.width, renderSeconds * 1000.0, (double)width * height / renderSeconds * 1e-6);
+	if (!numaRenderer) printWorkerStats(pool);
+	for (unsigned int node = 0; numaRenderer && node < numaRenderer->nodeCount(); node++)
+	{
+		printf("  node %u:\n", node);
+		printWorkerStats(numaRenderer->nodePool(node));
+	}
+
+	if (!writePPM(outPath, pixels, width, height)) return false;
+	printf("Wrote %s\n", outPath);
+	return true;
+}
+
+// Renders the start-up view on the CPU a few times with single rays and with 4x4 and 8x8 ray packets and prints primary rays
+// per second for each, the first frame of each mode is a warm-up and isn't counted. Also checks that the packet images
+// match the single ray one pixel for pixel
+bool runPacketBenchmark()
+{
+	const int frames = 4;
+	const int packetSizes[3] = {0, 4, 8};
+
+	ThreadPool pool;
+	Scene scene;
+	std::vector<BVH> meshBVHs;
+	BVH tlas;
+	loadCpuScene(pool, scene, meshBVHs, tlas);
+
+	CpuRenderer renderer(scene, meshBVHs, tlas);
+	renderer.bgColor = bgColor;
+	renderer.cullTiles = tileCulling;
+	RenderCamera camera = renderCamera();
+	std::vector<float> singleRayPixels;
+	double singleRaysPerSecond = 0.0;
+	for (int mode = 0; mode < 3; mode++)
+	{
+		renderer.packetSize = packetSizes[mode];
+		std::vector<float> pixels;
+		double seconds = 0.0;
+		for (int frame = 0; frame <= frames; frame++)
+		{
+			if (frame == 1) pool.resetWorkerStats();
+			std::chrono::steady_clock::time_point renderStart = std::chrono::steady_clock::now();
+			renderer.render(camera, width, height, pixels, pool);
+			if (frame > 0) seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - renderStart).count();
+		}
+		double raysPerSecond = (double)width * height * frames / seconds;
+
+		if (mode == 0)
+		{
+			singleRayPixels = pixels;
+			singleRaysPerSecond = raysPerSecond;
+			printf("Packets %ix%i (%u threads): single rays %.2f Mrays/s\n", width, height, pool.size(), raysPerSecond * 1e-6);
+			printWorkerStats(pool);
+			continue;
+		}
+
+		size_t differing = 0;
+		for (size_t i = 0; i < pixels.size(); i += 4)
+			if (pixels[i] != singleRayPixels[i] || pixels[i + 1] != singleRayPixels[i + 1] || pixels[i + 2] != singleRayPixels[i + 2])
+				differing++;
+		printf("Packets %ix%i (%u threads): %ix%i packets %.2f Mrays/s (%.2fx), %zu pixels differ from single rays\n", width,
+			   height, pool.size(), packetSizes[mode], packetSizes[mode], raysPerSecond * 1e-6, raysPerSecond / singleRaysPerSecond,
+			   differing);
+		printWorkerStats(pool);
+	}
+	return true;
+}
+
+// Renders the start-up view on the CPU with NumaRenderer on the first 1, 2, .. N NUMA nodes of the machine and prints primary
+// rays per second for each, with the speedup over one node and how well it scales per thread (100% = every added thread is as
+// fast as the one-node threads). The first frame of each run is a warm-up and isn't counted. Also checks that the images match
+// CpuRenderer's pixel for pixel
+bool runNumaBenchmark()
+{
+	const int frames = 4;
+
+	ThreadPool pool;
+	Scene scene;
+	std::vector<BVH> meshBVHs;
+	BVH tlas;
+	loadCpuScene(pool, scene, meshBVHs, tlas);
+
+	RenderCamera camera = renderCamera();
+	CpuRenderer reference(scene, meshBVHs, tlas);
+	reference.bgColor = bgColor;
+	reference.packetSize = packetSize;
+	reference.cullTiles = tileCulling;
+	std::vector<float> referencePixels;
+	reference.render(camera, width, height, referencePixels, pool);
+
+	NumaTopology topology = numaTopology();
+	printf("NUMA %ix%i: %u nodes, %u CPUs\n", width, height, topology.nodeCount(), topology.cpuCount());
+	double oneNodeRaysPerSecond = 0.0;
+	unsigned int oneNodeThreads = 1;
+	for (unsigned int nodeCount = 1; nodeCount <= topology.nodeCount(); nodeCount++)
+	{
+		NumaRenderer renderer(scene, meshBVHs, tlas, topology, nodeCount);
+		renderer.bgColor = bgColor;
+		renderer.packetSize = packetSize;
+		renderer.cullTiles = tileCulling;
+
+		std::vector<float> pixels;
+		double seconds = 0.0;
+		for (int frame = 0; frame <= frames; frame++)
+		{
+			for (unsigned int node = 0; frame == 1 && node < nodeCount; node++)
+				renderer.nodePool(node).resetWorkerStats();
+			std::chrono::steady_clock::time_point renderStart = std::chrono::steady_clock::now();
+			renderer.render(camera, width, height, pixels);
+			if (frame > 0) seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - renderStart).count();
+		}
+		double raysPerSecond = (double)width * height * frames / seconds;
+		if (nodeCount == 1)
+		{
+			oneNodeRaysPerSecond = raysPerSecond;
+			oneNodeThreads = renderer.threadCount();
+		}
+
+		size_t differing = 0;
+		for (size_t i = 0; i < pixels.size(); i += 4)
+			if (pixels[i] != referencePixels[i] || pixels[i + 1] != referencePixels[i + 1] || pixels[i + 2] != referencePixels[i + 2])
+				differing++;
+		double speedup = raysPerSecond / oneNodeRaysPerSecond;
+		printf("NUMA %u node%s (%u threads): %.2f Mrays/s, %.2fx one node, %.0f%% scaling per thread, %zu pixels differ\n", nodeCount,
+			   nodeCount > 1 ? "s" : "", renderer.threadCount(), raysPerSecond * 1e-6, speedup,
+			   100.0 * speedup * oneNodeThreads / renderer.threadCount(), differing);
+		for (unsigned int node = 0; node < nodeCount; node++)
+		{
+			printf("  node %u:\n", node);
+			printWorkerStats(renderer.nodePool(node));
+		}
+	}
+	return true;
+}
+
+// Renders the start-up view on the CPU with reflections (--bounces, 3 by default) through the wavefront pipeline, once tracing
+// the reflected rays in the order they were shaded and once sorting them between bounces, and prints reflected rays per second
+// for both. The sorted run's time includes the sorting. The first frame of each run is a warm-up and isn't counted. Also
+// checks that sorting leaves the image as it is
+bool runBounceBenchmark()
+{
+	const int frames = 4;
+
+	ThreadPool pool;
+	Scene scene;
+	std::vector<BVH> meshBVHs;
+	BVH tlas;
+	loadCpuScene(pool, scene, meshBVHs, tlas);
+
+	CpuRenderer renderer(scene, meshBVHs, tlas);
+	renderer.bgColor = bgColor;
+	renderer.bounces = reflectionBounces > 0 ? reflectionBounces : 3;
+	renderer.reflectivity = reflectivity;
+	RenderCamera camera = renderCamera();
+	std::vector<float> unsortedPixels;
+	double unsortedRaysPerSecond = 0.0;
+	for (int mode = 0; mode < 2; mode++)
+	{
+		renderer.sortRays = mode == 1;
+		std::vector<float> pixels;
+		size_t rays = 0;
+		double traceSeconds = 0.0, sortSeconds = 0.0;
+		for (int frame = 0; frame <= frames; frame++)
+		{
+			CpuRenderer::WavefrontStats stats;
+			renderer.renderWavefront(camera, width, height, pixels, pool, &stats);
+			for (size_t queue = 1; frame > 0 && queue < stats.rays.size(); queue++) // queue 0 holds the primary rays
+			{
+				rays += stats.rays[queue];
+				traceSeconds += stats.traceSeconds[queue];
+				sortSeconds += stats.sortSeconds[queue];
+			}
+		}
+		double raysPerSecond = rays / (traceSeconds + sortSeconds);
+
+		if (mode == 0)
+		{
+			unsortedPixels = pixels;
+			unsortedRaysPerSecond = raysPerSecond;
+			printf("Bounces %ix%i (%u threads, %i bounces, %zu reflected rays per frame): unsorted %.2f Mrays/s\n", width, height,
+				   pool.size(), renderer.bounces, rays / frames, raysPerSecond * 1e-6);
+			continue;
+		}
+
+		size_t differing = 0;
+		for (size_t i = 0; i < pixels.size(); i += 4)
+			if (pixels[i] != unsortedPixels[i] || pixels[i + 1] != unsortedPixels[i + 1] || pixels[i + 2] != unsortedPixels[i + 2])
+				differing++;
+		printf("Bounces %ix%i (%u threads, %i bounces): sorted %.2f Mrays/s (%.2fx, %.1f ms of %.1f ms per frame sorting), "
+			   "%zu pixels differ from unsorted\n", width, height, pool.size(), renderer.bounces, raysPerSecond * 1e-6,
+			   raysPerSecond / unsortedRaysPerSecond, sortSeconds * 1000.0 / frames, (traceSeconds + sortSeconds) * 1000.0 / frames,
+			   differing);
+	}
+	return true;
+}
+
+// Prints how the shader programs built so far were made: loaded from the binary cache (a warm start when all of them were)
+// or compiled from source, and the time each took
+void printProgramCacheStats()
+{
+	ProgramCacheStats stats = programCacheStats();
+	printf("Shader programs (%s start): %i from the binary cache in %.1f ms, %i compiled in %.1f ms\n",
+		   stats.compiled == 0 ? "warm" : (stats.loaded == 0 ? "cold" : "partly warm"), stats.loaded, stats.loadSeconds * 1000.0,
+		   stats.compiled, stats.compileSeconds * 1000.0);
+}
+
+// Prints how evenly the last CPU render(s) kept the pool's workers busy: the least and most busy worker, the share of
+// thread time spent idle and how many tiles were stolen. With --thread-stats every worker gets its own line as well
+void printWorkerStats(const ThreadPool &pool)
+{
+	std::vector<ThreadPool::WorkerStats> stats = pool.workerStats();
+	double minBusy = 1e30, maxBusy = 0.0, busy = 0.0, idle = 0.0;
+	size_t tasks = 0, stolen = 0;
+	for (size_t i = 0; i < stats.size(); i++)
+	{
+		minBusy = std::min(minBusy, stats[i].busySeconds);
+		maxBusy = std::max(maxBusy, stats[i].busySeconds);
+		busy += stats[i].busySeconds;
+		idle += stats[i].idleSeconds;
+		tasks += stats[i].tasks;
+		stolen += stats[i].stolen;
+		if (threadStats)
+			printf("  thread %2zu: busy %8.1f ms, idle %8.1f ms, %zu tiles (%zu stolen)\n", i, stats[i].busySeconds * 1000.0,
+				   stats[i].idleSeconds * 1000.0, stats[i].tasks, stats[i].stolen);
+	}
+	printf("  threads busy %.1f - %.1f ms, %.1f%% idle, %zu of %zu tiles stolen\n", minBusy * 1000.0, maxBusy * 1000.0,
+		   busy + idle > 0.0 ? 100.0 * idle / (busy + idle) : 0.0, stolen, tasks);
+}
+
 int nextPowerOfTwo(int x) {
 	x--;
 	x |= x >> 1; // handle 2 bit numbers
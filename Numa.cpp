@@ -0,0 +1,107 @@
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0601 // GetNumaNodeProcessorMaskEx and SetThreadGroupAffinity need Windows 7
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+#include "Numa.h"
+
+unsigned int NumaTopology::cpuCount() const
+{
+	unsigned int count = 0;
+	for (size_t i = 0; i < nodeCpus.size(); i++)
+		count += (unsigned int)nodeCpus[i].size();
+	return count;
+}
+
+#if !defined(_WIN32) && defined(__linux__)
+// Reads a sysfs list like "0-3,8-11" from path, empty if the file isn't there
+static std::vector<unsigned int> readCpuList(const char *path)
+{
+	std::vector<unsigned int> list;
+	FILE *file = fopen(path, "r");
+	if (file == NULL) return list;
+
+	char text[4096];
+	if (fgets(text, sizeof(text), file) != NULL)
+	{
+		char *cursor = text;
+		while (*cursor >= '0' && *cursor <= '9')
+		{
+			unsigned int first = (unsigned int)strtoul(cursor, &cursor, 10);
+			unsigned int last = first;
+			if (*cursor == '-') last = (unsigned int)strtoul(cursor + 1, &cursor, 10);
+			for (unsigned int i = first; i <= last; i++)
+				list.push_back(i);
+			if (*cursor == ',') cursor++;
+		}
+	}
+	fclose(file);
+	return list;
+}
+#endif
+
+NumaTopology numaTopology()
+{
+	NumaTopology topology;
+#ifdef _WIN32
+	ULONG highestNode = 0;
+	if (GetNumaHighestNodeNumber(&highestNode))
+	{
+		for (ULONG node = 0; node <= highestNode; node++)
+		{
+			GROUP_AFFINITY affinity;
+			if (!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity)) continue;
+			std::vector<unsigned int> cpus;
+			for (unsigned int bit = 0; bit < 64; bit++)
+				if ((unsigned long long)affinity.Mask >> bit & 1) cpus.push_back(affinity.Group * 64u + bit);
+			if (!cpus.empty()) topology.nodeCpus.push_back(cpus);
+		}
+	}
+#elif defined(__linux__)
+	std::vector<unsigned int> nodes = readCpuList("/sys/devices/system/node/online");
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", nodes[i]);
+		std::vector<unsigned int> cpus = readCpuList(path);
+		if (!cpus.empty()) topology.nodeCpus.push_back(cpus); // memory-only nodes have no CPUs
+	}
+#endif
+
+	if (topology.nodeCpus.empty())
+	{
+		unsigned int threads = std::thread::hardware_concurrency();
+		topology.nodeCpus.resize(1);
+		for (unsigned int i = 0; i < (threads > 0 ? threads : 1); i++)
+			topology.nodeCpus[0].push_back(i);
+	}
+	return topology;
+}
+
+bool pinThread(unsigned int cpu)
+{
+#ifdef _WIN32
+	GROUP_AFFINITY affinity;
+	ZeroMemory(&affinity, sizeof(affinity));
+	affinity.Group = (WORD)(cpu / 64);
+	affinity.Mask = (KAFFINITY)1 << (cpu % 64);
+	return SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL) != 0;
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set) == 0; // 0 is the calling thread
+#else
+	(void)cpu;
+	return false;
+#endif
+}
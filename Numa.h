@@ -0,0 +1,20 @@
+#pragma once
+
+#include <vector>
+
+// NumaTopology lists the CPUs of every NUMA node (socket, or part of one) of the machine
+// CPUs are numbered the way pinThread() takes them: on Windows processor group * 64 + number within the group, elsewhere
+// the OS's CPU number. Machines whose OS can't tell are one node holding every hardware thread
+struct NumaTopology
+{
+	std::vector<std::vector<unsigned int> > nodeCpus; // per node, none empty
+
+	unsigned int nodeCount() const { return (unsigned int)nodeCpus.size(); }
+	unsigned int cpuCount() const;
+};
+
+// Reads the machine's NUMA layout from the OS
+NumaTopology numaTopology();
+
+// Pins the calling thread to one CPU so it stays on that CPU's node, returns false if that isn't possible here
+bool pinThread(unsigned int cpu);
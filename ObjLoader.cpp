@@ -0,0 +1,357 @@
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <charconv>
+#include <chrono>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "ObjLoader.h"
+
+// Memory Mapping
+// --------------
+MappedFile::MappedFile(const char *path) : data(NULL), size(0)
+{
+#ifdef _WIN32
+	mappingHandle = NULL;
+	fileHandle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE)
+	{
+		fileHandle = NULL;
+		return;
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0) return; // empty files can't be mapped
+
+	mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mappingHandle == NULL) return;
+
+	data = (const char *)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	if (data != NULL) size = (size_t)fileSize.QuadPart;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return;
+
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0) // empty files can't be mapped
+	{
+		void *addr = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr != MAP_FAILED)
+		{
+			madvise(addr, fileStat.st_size, MADV_SEQUENTIAL); // we read front to back exactly once, let the kernel read ahead and drop behind
+			data = (const char *)addr;
+			size = fileStat.st_size;
+		}
+	}
+	close(fd); // the mapping holds its own reference to the file
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	if (data != NULL) UnmapViewOfFile(data);
+	if (mappingHandle != NULL) CloseHandle(mappingHandle);
+	if (fileHandle != NULL) CloseHandle(fileHandle);
+#else
+	if (data != NULL) munmap((void *)data, size);
+#endif
+}
+
+// Tokenizing
+// ----------
+// All helpers work directly on the mapped bytes, [p, end) is never copied and nothing is allocated per line
+
+static inline bool isBlank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char *skipBlanks(const char *p, const char *end)
+{
+	while (p < end && isBlank(*p)) p++;
+	return p;
+}
+
+static inline const char *skipToken(const char *p, const char *end)
+{
+	while (p < end && !isBlank(*p)) p++;
+	return p;
+}
+
+// Returns a pointer to the '\n' ending the line that starts at p (or end for the last line)
+static inline const char *findLineEnd(const char *p, const char *end)
+{
+	const char *newline = (const char *)memchr(p, '\n', end - p);
+	return newline ? newline : end;
+}
+
+static inline bool isRecord(const char *p, const char *lineEnd, char type)
+{
+	return lineEnd - p >= 2 && p[0] == type && isBlank(p[1]);
+}
+
+static inline const char *parseFloat(const char *p, const char *end, float &value)
+{
+	p = skipBlanks(p, end);
+	if (p < end && *p == '+') p++; // from_chars doesn't accept an explicit plus sign
+
+	std::from_chars_result result = std::from_chars(p, end, value);
+	if (result.ec != std::errc())
+	{
+		value = 0.0f;
+		return skipToken(p, end);
+	}
+	return result.ptr;
+}
+
+// Parses "v x y z [w]", the optional w (and any vertex colors) are ignored
+static inline void parseVertex(const char *p, const char *lineEnd, std::vector<float> &positions)
+{
+	float x, y, z;
+	p = parseFloat(p + 1, lineEnd, x);
+	p = parseFloat(p, lineEnd, y);
+	p = parseFloat(p, lineEnd, z);
+	positions.push_back(x);
+	positions.push_back(y);
+	positions.push_back(z);
+}
+
+// Geometry parsed from one line-aligned slice of the file, merged into the Mesh once every chunk is done
+struct ObjChunk
+{
+	const char *begin;
+	const char *end;
+
+	std::vector<float> positions;
+	std::vector<unsigned int> indices;
+
+	// Entries of indices that came from negative (relative) OBJ indices. These are stored relative to the
+	// first vertex of this chunk and only become absolute once the vertex counts of earlier chunks are known
+	std::vector<size_t> relativeIndices;
+};
+
+// Parses "f a b c ..." where every corner is "v", "v/vt", "v//vn" or "v/vt/vn", only the position index is kept
+// Polygons are split into a triangle fan around their first corner
+// Positive indices are resolved to absolute zero-based indices, negative ones are resolved against the chunk's
+// own vertex count and recorded in relativeIndices. Neither is range checked here, see mergeChunks
+static inline void parseFace(const char *p, const char *lineEnd, ObjChunk &chunk)
+{
+	long long chunkVertexCount = chunk.positions.size() / 3;
+	unsigned int first = 0, prev = 0;
+	bool firstRelative = false, prevRelative = false;
+	int corners = 0;
+
+	p++; // skip the 'f'
+	for (;;)
+	{
+		p = skipBlanks(p, lineEnd);
+		if (p >= lineEnd) break;
+
+		long long index;
+		std::from_chars_result result = std::from_chars(p, lineEnd, index);
+		if (result.ec != std::errc() || index == 0) break; // not an index (e.g. a trailing comment)
+		p = skipToken(result.ptr, lineEnd); // skip "/vt/vn"
+
+		// OBJ indices are 1-based, negative indices count back from the most recent vertex
+		bool relative = index < 0;
+		unsigned int resolved = (unsigned int)(relative ? chunkVertexCount + index : index - 1); // may wrap, fixed up in mergeChunks
+
+		if (corners == 0)
+		{
+			first = resolved;
+			firstRelative = relative;
+		}
+		else if (corners >= 2)
+		{
+			if (firstRelative) chunk.relativeIndices.push_back(chunk.indices.size());
+			chunk.indices.push_back(first);
+			if (prevRelative) chunk.relativeIndices.push_back(chunk.indices.size());
+			chunk.indices.push_back(prev);
+			if (relative) chunk.relativeIndices.push_back(chunk.indices.size());
+			chunk.indices.push_back(resolved);
+		}
+		prev = resolved;
+		prevRelative = relative;
+		corners++;
+	}
+}
+
+static void parseChunk(ObjChunk &chunk)
+{
+	// Count records first so the arenas are allocated exactly once, growing them by doubling would
+	// briefly hold both the old and the new copy, which is what sets the peak on large meshes
+	size_t vertexRecords = 0, faceRecords = 0;
+	for (const char *p = chunk.begin; p < chunk.end;)
+	{
+		const char *lineEnd = findLineEnd(p, chunk.end);
+		p = skipBlanks(p, lineEnd);
+		if (isRecord(p, lineEnd, 'v')) vertexRecords++;
+		else if (isRecord(p, lineEnd, 'f')) faceRecords++;
+		p = lineEnd < chunk.end ? lineEnd + 1 : chunk.end;
+	}
+
+	chunk.positions.reserve(vertexRecords * 3);
+	chunk.indices.reserve(faceRecords * 3); // exact for triangulated files, polygons grow the array
+
+	for (const char *p = chunk.begin; p < chunk.end;)
+	{
+		const char *lineEnd = findLineEnd(p, chunk.end);
+		p = skipBlanks(p, lineEnd);
+		if (isRecord(p, lineEnd, 'v')) parseVertex(p, lineEnd, chunk.positions);
+		else if (isRecord(p, lineEnd, 'f')) parseFace(p, lineEnd, chunk);
+		p = lineEnd < chunk.end ? lineEnd + 1 : chunk.end;
+	}
+}
+
+// Splits [begin, end) into count slices of roughly equal size, every slice boundary is moved forward to the start of a line
+static std::vector<ObjChunk> splitLines(const char *begin, const char *end, size_t count)
+{
+	std::vector<ObjChunk> chunks(count);
+	const char *chunkBegin = begin;
+	for (size_t i = 0; i < count; i++)
+	{
+		const char *chunkEnd = end;
+		if (i + 1 < count)
+		{
+			chunkEnd = begin + (end - begin) * (i + 1) / count;
+			if (chunkEnd < chunkBegin) chunkEnd = chunkBegin;
+			chunkEnd = findLineEnd(chunkEnd, end);
+			if (chunkEnd < end) chunkEnd++;
+		}
+		chunks[i].begin = chunkBegin;
+		chunks[i].end = chunkEnd;
+		chunkBegin = chunkEnd;
+	}
+	return chunks;
+}
+
+// Concatenates the chunks into mesh. Relative indices are fixed up by one task per chunk, then the chunks are appended in
+// order and each arena is released right after it is copied. The mesh's arrays are only reserved up front, not resized, so
+// their pages are touched as the chunks come in and the peak stays near one copy of the mesh plus one chunk instead of two
+// copies. Returns the number of out of range indices
+static size_t mergeChunks(std::vector<ObjChunk> &chunks, Mesh &mesh, ThreadPool &pool)
+{
+	std::vector<size_t> vertexBase(chunks.size() + 1, 0), indexBase(chunks.size() + 1, 0);
+	for (size_t i = 0; i < chunks.size(); i++)
+	{
+		vertexBase[i + 1] = vertexBase[i] + chunks[i].positions.size() / 3;
+		indexBase[i + 1] = indexBase[i] + chunks[i].indices.size();
+	}
+
+	size_t vertexCount = vertexBase[chunks.size()];
+	std::vector<size_t> invalid(chunks.size(), 0);
+	pool.parallelFor(chunks.size(), [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			ObjChunk &chunk = chunks[i];
+
+			// relative indices become absolute by adding the number of vertices in all earlier chunks
+			unsigned int base = (unsigned int)vertexBase[i];
+			for (size_t j = 0; j < chunk.relativeIndices.size(); j++)
+				chunk.indices[chunk.relativeIndices[j]] += base;
+
+			for (size_t j = 0; j < chunk.indices.size(); j++)
+				if (chunk.indices[j] >= vertexCount) invalid[i]++;
+			std::vector<size_t>().swap(chunk.relativeIndices);
+		}
+	});
+
+	mesh.positions.clear();
+	mesh.indices.clear();
+	mesh.positions.reserve(vertexCount * 3);
+	mesh.indices.reserve(indexBase[chunks.size()]);
+	for (size_t i = 0; i < chunks.size(); i++)
+	{
+		ObjChunk &chunk = chunks[i];
+		mesh.positions.insert(mesh.positions.end(), chunk.positions.begin(), chunk.positions.end());
+		std::vector<float>().swap(chunk.positions);
+		mesh.indices.insert(mesh.indices.end(), chunk.indices.begin(), chunk.indices.end());
+		std::vector<unsigned int>().swap(chunk.indices);
+	}
+
+	size_t invalidCount = 0;
+	for (size_t i = 0; i < invalid.size(); i++)
+		invalidCount += invalid[i];
+	return invalidCount;
+}
+
+// Loading
+// -------
+bool loadObj(const char *path, Mesh &mesh, ThreadPool &pool)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	MappedFile file(path);
+	if (!file.isOpen())
+	{
+		printf("ERROR::OBJ_LOADER::FILE_NOT_SUCCESSFULLY_READ: %s\n", path);
+		return false;
+	}
+
+	// Small files aren't worth waking the pool for
+	const size_t minChunkSize = 1 << 20;
+	size_t chunkCount = file.size / minChunkSize;
+	if (chunkCount > pool.size()) chunkCount = pool.size();
+	if (chunkCount < 1) chunkCount = 1;
+
+	std::vector<ObjChunk> chunks = splitLines(file.data, file.data + file.size, chunkCount);
+	pool.parallelFor(chunks.size(), [&chunks](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			parseChunk(chunks[i]);
+	});
+
+	mesh.positions.clear();
+	mesh.indices.clear();
+	size_t invalidCount = mergeChunks(chunks, mesh, pool);
+
+	// Drop triangles that reference vertices the file never defined
+	if (invalidCount > 0)
+	{
+		unsigned int vertexCount = mesh.vertexCount();
+		size_t kept = 0;
+		for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+		{
+			if (mesh.indices[i] < vertexCount && mesh.indices[i + 1] < vertexCount && mesh.indices[i + 2] < vertexCount)
+			{
+				mesh.indices[kept++] = mesh.indices[i];
+				mesh.indices[kept++] = mesh.indices[i + 1];
+				mesh.indices[kept++] = mesh.indices[i + 2];
+			}
+		}
+		printf("WARNING::OBJ_LOADER::DROPPED %zu TRIANGLES WITH OUT OF RANGE INDICES\n", (mesh.indices.size() - kept) / 3);
+		mesh.indices.resize(kept);
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double megabytes = file.size / (1024.0 * 1024.0);
+	printf("Loaded %s: %u vertices, %u triangles, %.1f MB in %.1f ms on %zu threads (%.1f MB/s, peak RSS %.1f MB)\n",
+		   path, mesh.vertexCount(), mesh.triangleCount(), megabytes, seconds * 1000.0, chunkCount,
+		   seconds > 0.0 ? megabytes / seconds : 0.0, peakMemoryUsage() / (1024.0 * 1024.0));
+
+	return true;
+}
+
+size_t peakMemoryUsage()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return counters.PeakWorkingSetSize;
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) return (size_t)usage.ru_maxrss * 1024; // reported in kilobytes
+	return 0;
+#endif
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "ThreadPool.h"
+
+// Mesh holds the geometry loaded from a .obj file
+// positions are tightly packed (x, y, z) floats, indices are zero-based and grouped in threes (one triangle per group)
+struct Mesh
+{
+	std::vector<float> positions;
+	std::vector<unsigned int> indices;
+
+	unsigned int vertexCount() const { return (unsigned int)(positions.size() / 3); }
+	unsigned int triangleCount() const { return (unsigned int)(indices.size() / 3); }
+};
+
+// MappedFile maps a whole file read-only into memory so it can be parsed in place, without copying it into a buffer first
+// The OS pages the file in on demand and can drop those pages again under pressure, so they don't count against our heap
+class MappedFile
+{
+public:
+	MappedFile(const char *path); // Constructor: Open and map the file, check isOpen() for success
+	~MappedFile();				  // Destructor: Unmap the file and close its handles
+
+	bool isOpen() const { return data != NULL; }
+
+	const char *data; // First byte of the file (NULL if mapping failed)
+	size_t size;	  // Size of the file in bytes
+
+private:
+	MappedFile(const MappedFile &);			   // non-copyable, owns OS handles
+	MappedFile &operator=(const MappedFile &);
+
+#ifdef _WIN32
+	void *fileHandle;
+	void *mappingHandle;
+#endif
+};
+
+// Loads the "v" and "f" records of a .obj file into mesh, polygons are triangulated as fans
+// Large files are split on line boundaries and parsed in parallel on pool
+// Returns false if the file could not be read
+bool loadObj(const char *path, Mesh &mesh, ThreadPool &pool);
+
+// Peak resident set size of this process so far, in bytes (0 if unavailable)
+size_t peakMemoryUsage();
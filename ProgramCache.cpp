@@ -0,0 +1,150 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include <glad\glad.h>
+
+#include "ProgramCache.h"
+
+const char *programCacheDirectory = "shader_cache";
+
+static ProgramCacheStats stats = {0, 0, 0.0, 0.0};
+static bool readsEnabled = true;
+
+// File layout: magic, binary format, binary length, binary
+static const unsigned int programFileMagic = 0x42505452; // "RTPB"
+
+static std::string programPath(const std::string &key)
+{
+	return std::string(programCacheDirectory) + "/" + key + ".bin";
+}
+
+std::string programCacheKey(const std::string &sources)
+{
+	std::string text = sources;
+	const GLenum strings[3] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+	for (int i = 0; i < 3; i++)
+	{
+		const char *value = (const char *)glGetString(strings[i]);
+		text += '\0';
+		text += value ? value : "";
+	}
+
+	// 64-bit FNV-1a
+	unsigned long long hash = 14695981039346656037ull;
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		hash ^= (unsigned char)text[i];
+		hash *= 1099511628211ull;
+	}
+	char key[17];
+	snprintf(key, sizeof(key), "%016llx", hash);
+	return key;
+}
+
+bool loadProgramBinary(unsigned int program, const std::string &key)
+{
+	if (!readsEnabled) return false;
+	FILE *file = fopen(programPath(key).c_str(), "rb");
+	if (file == NULL) return false;
+
+	unsigned int header[3]; // magic, format, length
+	std::vector<char> binary;
+	bool read = fread(header, sizeof(header), 1, file) == 1 && header[0] == programFileMagic;
+	if (read)
+	{
+		binary.resize(header[2]);
+		read = !binary.empty() && fread(binary.data(), binary.size(), 1, file) == 1;
+	}
+	fclose(file);
+	if (!read) return false;
+
+	glProgramBinary(program, (GLenum)header[1], binary.data(), (GLsizei)binary.size());
+	int success;
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	return success != 0;
+}
+
+void programBinaryHint(unsigned int program)
+{
+	glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+}
+
+void saveProgramBinary(unsigned int program, const std::string &key)
+{
+	int length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) return; // the driver doesn't hand out binaries
+
+	std::vector<char> binary(length);
+	GLenum format;
+	glGetProgramBinary(program, length, NULL, &format, binary.data());
+
+#ifdef _WIN32
+	_mkdir(programCacheDirectory);
+#else
+	mkdir(programCacheDirectory, 0755);
+#endif
+	FILE *file = fopen(programPath(key).c_str(), "wb");
+	unsigned int header[3] = {programFileMagic, (unsigned int)format, (unsigned int)length};
+	bool written = file != NULL && fwrite(header, sizeof(header), 1, file) == 1 && fwrite(binary.data(), binary.size(), 1, file) == 1;
+	if (file != NULL && fclose(file) != 0) written = false;
+	if (!written) std::cout << "ERROR::PROGRAM_CACHE::FILE_NOT_SUCCESSFULLY_WRITTEN: " << programPath(key) << std::endl;
+}
+
+ProgramCacheStats programCacheStats()
+{
+	return stats;
+}
+
+void recordProgramBuild(bool loaded, double seconds)
+{
+	if (loaded)
+	{
+		stats.loaded++;
+		stats.loadSeconds += seconds;
+	}
+	else
+	{
+		stats.compiled++;
+		stats.compileSeconds += seconds;
+	}
+}
+
+void readUniformLocations(unsigned int program, UniformLocations &locations)
+{
+	locations.clear();
+	int count = 0, maxLength = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+	std::vector<char> name(maxLength > 0 ? maxLength : 1);
+	for (int i = 0; i < count; i++)
+	{
+		int size;
+		GLenum type;
+		glGetActiveUniform(program, (GLuint)i, (GLsizei)name.size(), NULL, &size, &type, name.data());
+		int location = glGetUniformLocation(program, name.data());
+		if (location < 0) continue; // in a uniform block or an atomic counter, not set through a location
+		std::string uniform = name.data();
+		locations[uniform] = location;
+		if (uniform.size() > 3 && uniform.compare(uniform.size() - 3, 3, "[0]") == 0) locations[uniform.substr(0, uniform.size() - 3)] = location;
+	}
+}
+
+int findLocation(const UniformLocations &locations, const std::string &name)
+{
+	UniformLocations::const_iterator location = locations.find(name);
+	return location != locations.end() ? location->second : -1;
+}
+
+void setProgramCacheReads(bool enabled)
+{
+	readsEnabled = enabled;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+// Program binary cache
+// Linked shader programs are saved with glGetProgramBinary into programCacheDirectory, one file per program, and loaded back
+// with glProgramBinary on the next start instead of compiling their sources again. A program's key hashes its sources (with
+// any injected defines) and the driver's GL_VENDOR, GL_RENDERER and GL_VERSION strings, so editing a shader or updating the
+// driver misses the cache. Drivers may still reject a stored binary, the program is compiled from source then and stored again
+
+extern const char *programCacheDirectory;
+
+// Key of a program made from sources, needs a current GL context
+std::string programCacheKey(const std::string &sources);
+
+// Loads the stored binary of key into program (which must not have shaders attached), false if there is none or the driver
+// rejected it. Programs that are going to be saved need programBinaryHint() before they are linked
+bool loadProgramBinary(unsigned int program, const std::string &key);
+void programBinaryHint(unsigned int program);
+void saveProgramBinary(unsigned int program, const std::string &key);
+
+// Start-up report: how many programs came from the cache, how many were compiled and how long both took
+struct ProgramCacheStats
+{
+	int loaded;
+	int compiled;
+	double loadSeconds;
+	double compileSeconds;
+};
+
+ProgramCacheStats programCacheStats();
+void recordProgramBuild(bool loaded, double seconds);
+
+// Location of every active uniform of a linked program by name (arrays under their name with and without "[0]"), read once
+// so setting a uniform doesn't have to ask the driver
+typedef std::unordered_map<std::string, int> UniformLocations;
+void readUniformLocations(unsigned int program, UniformLocations &locations);
+int findLocation(const UniformLocations &locations, const std::string &name); // -1 if there is no such uniform
+
+// false makes loadProgramBinary miss every time (programs are still saved), to measure a cold start
+void setProgramCacheReads(bool enabled);
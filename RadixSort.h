@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vector>
+
+#include "ThreadPool.h"
+
+// Sorts keys ascending and applies the same permutation to values, only the low keyBits bits of the keys are looked at
+// LSD radix sort with 8-bit digits: every pass each worker counts the digits of its slice, a prefix sum over all counts
+// (digit-major, worker-minor) gives every worker its own write offsets, then the workers scatter their slices in parallel
+// The sort is stable. Passes where every key has the same digit are skipped
+template <typename Key>
+void radixSort(std::vector<Key> &keys, std::vector<unsigned int> &values, int keyBits, ThreadPool &pool)
+{
+	const int radix = 256;
+	size_t count = keys.size();
+	size_t workers = pool.size();
+
+	std::vector<Key> keyScratch(count);
+	std::vector<unsigned int> valueScratch(count);
+	std::vector<size_t> offsets(workers * radix);
+
+	for (int shift = 0; shift < keyBits; shift += 8)
+	{
+		pool.parallelFor(workers, [&](size_t begin, size_t end) {
+			for (size_t w = begin; w < end; w++)
+			{
+				size_t *histogram = &offsets[w * radix];
+				for (int d = 0; d < radix; d++)
+					histogram[d] = 0;
+				for (size_t i = count * w / workers; i < count * (w + 1) / workers; i++)
+					histogram[(keys[i] >> shift) & (radix - 1)]++;
+			}
+		});
+
+		// histograms to exclusive offsets
+		size_t sum = 0;
+		bool singleDigit = false;
+		for (int d = 0; d < radix; d++)
+		{
+			size_t digitStart = sum;
+			for (size_t w = 0; w < workers; w++)
+			{
+				size_t digitCount = offsets[w * radix + d];
+				offsets[w * radix + d] = sum;
+				sum += digitCount;
+			}
+			if (sum - digitStart == count) singleDigit = true;
+		}
+		if (singleDigit) continue; // this pass wouldn't move anything
+
+		pool.parallelFor(workers, [&](size_t begin, size_t end) {
+			for (size_t w = begin; w < end; w++)
+			{
+				size_t *offset = &offsets[w * radix];
+				for (size_t i = count * w / workers; i < count * (w + 1) / workers; i++)
+				{
+					size_t dst = offset[(keys[i] >> shift) & (radix - 1)]++;
+					keyScratch[dst] = keys[i];
+					valueScratch[dst] = values[i];
+				}
+			}
+		});
+
+		keys.swap(keyScratch);
+		values.swap(valueScratch);
+	}
+}
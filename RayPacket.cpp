@@ -0,0 +1,104 @@
+#include "RayPacket.h"
+#include "TriangleBlocks.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PACKET_X86_KERNELS
+#endif
+
+void RayPacket::setRay(int lane, const glm::vec3 &orig, const glm::vec3 &dir)
+{
+	origX[lane] = orig.x;
+	origY[lane] = orig.y;
+	origZ[lane] = orig.z;
+	dirX[lane] = dir.x;
+	dirY[lane] = dir.y;
+	dirZ[lane] = dir.z;
+	invDirX[lane] = 1.0f / dir.x;
+	invDirY[lane] = 1.0f / dir.y;
+	invDirZ[lane] = 1.0f / dir.z;
+}
+
+// Kernels
+// -------
+// Groups of lanes without an active ray are skipped, inactive lanes of the other groups are tested and masked out afterwards
+static uint64_t boxMaskScalar(const RayPacket &packet, uint64_t active, const glm::vec3 &boxMin, const glm::vec3 &boxMax, float *tNear)
+{
+	uint64_t hits = 0;
+	for (int lane = 0; lane < packet.size; lane++)
+	{
+		if (!(active >> lane & 1)) continue;
+		float t0x = (boxMin.x - packet.origX[lane]) * packet.invDirX[lane], t1x = (boxMax.x - packet.origX[lane]) * packet.invDirX[lane];
+		float t0y = (boxMin.y - packet.origY[lane]) * packet.invDirY[lane], t1y = (boxMax.y - packet.origY[lane]) * packet.invDirY[lane];
+		float t0z = (boxMin.z - packet.origZ[lane]) * packet.invDirZ[lane], t1z = (boxMax.z - packet.origZ[lane]) * packet.invDirZ[lane];
+		float tEntry = glm::max(glm::max(glm::min(t0x, t1x), glm::min(t0y, t1y)), glm::max(glm::min(t0z, t1z), 0.0f));
+		float tExit = glm::min(glm::min(glm::max(t0x, t1x), glm::max(t0y, t1y)), glm::min(glm::max(t0z, t1z), packet.t[lane]));
+		tNear[lane] = tEntry;
+		if (tEntry <= tExit) hits |= (uint64_t)1 << lane;
+	}
+	return hits;
+}
+
+#ifdef PACKET_X86_KERNELS
+__attribute__((target("avx2"))) static uint64_t boxMaskAVX2(const RayPacket &packet, uint64_t active, const glm::vec3 &boxMin,
+															 const glm::vec3 &boxMax, float *tNear)
+{
+	const __m256 minX = _mm256_set1_ps(boxMin.x), minY = _mm256_set1_ps(boxMin.y), minZ = _mm256_set1_ps(boxMin.z);
+	const __m256 maxX = _mm256_set1_ps(boxMax.x), maxY = _mm256_set1_ps(boxMax.y), maxZ = _mm256_set1_ps(boxMax.z);
+
+	uint64_t hits = 0;
+	for (int first = 0; first < packet.size; first += 8)
+	{
+		if ((active >> first & 0xff) == 0) continue;
+		__m256 ox = _mm256_loadu_ps(packet.origX + first), oy = _mm256_loadu_ps(packet.origY + first), oz = _mm256_loadu_ps(packet.origZ + first);
+		__m256 ix = _mm256_loadu_ps(packet.invDirX + first), iy = _mm256_loadu_ps(packet.invDirY + first), iz = _mm256_loadu_ps(packet.invDirZ + first);
+		__m256 t0x = _mm256_mul_ps(_mm256_sub_ps(minX, ox), ix), t1x = _mm256_mul_ps(_mm256_sub_ps(maxX, ox), ix);
+		__m256 t0y = _mm256_mul_ps(_mm256_sub_ps(minY, oy), iy), t1y = _mm256_mul_ps(_mm256_sub_ps(maxY, oy), iy);
+		__m256 t0z = _mm256_mul_ps(_mm256_sub_ps(minZ, oz), iz), t1z = _mm256_mul_ps(_mm256_sub_ps(maxZ, oz), iz);
+		__m256 tEntry = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)),
+									   _mm256_max_ps(_mm256_min_ps(t0z, t1z), _mm256_setzero_ps()));
+		__m256 tExit = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)),
+									  _mm256_min_ps(_mm256_max_ps(t0z, t1z), _mm256_loadu_ps(packet.t + first)));
+		_mm256_storeu_ps(tNear + first, tEntry);
+		hits |= (uint64_t)_mm256_movemask_ps(_mm256_cmp_ps(tEntry, tExit, _CMP_LE_OQ)) << first;
+	}
+	return hits;
+}
+
+__attribute__((target("avx512f"))) static uint64_t boxMaskAVX512(const RayPacket &packet, uint64_t active, const glm::vec3 &boxMin,
+																  const glm::vec3 &boxMax, float *tNear)
+{
+	const __m512 minX = _mm512_set1_ps(boxMin.x), minY = _mm512_set1_ps(boxMin.y), minZ = _mm512_set1_ps(boxMin.z);
+	const __m512 maxX = _mm512_set1_ps(boxMax.x), maxY = _mm512_set1_ps(boxMax.y), maxZ = _mm512_set1_ps(boxMax.z);
+
+	uint64_t hits = 0;
+	for (int first = 0; first < packet.size; first += 16)
+	{
+		__mmask16 lanes = (__mmask16)(active >> first);
+		if (lanes == 0) continue;
+		__m512 ox = _mm512_loadu_ps(packet.origX + first), oy = _mm512_loadu_ps(packet.origY + first), oz = _mm512_loadu_ps(packet.origZ + first);
+		__m512 ix = _mm512_loadu_ps(packet.invDirX + first), iy = _mm512_loadu_ps(packet.invDirY + first), iz = _mm512_loadu_ps(packet.invDirZ + first);
+		__m512 t0x = _mm512_mul_ps(_mm512_sub_ps(minX, ox), ix), t1x = _mm512_mul_ps(_mm512_sub_ps(maxX, ox), ix);
+		__m512 t0y = _mm512_mul_ps(_mm512_sub_ps(minY, oy), iy), t1y = _mm512_mul_ps(_mm512_sub_ps(maxY, oy), iy);
+		__m512 t0z = _mm512_mul_ps(_mm512_sub_ps(minZ, oz), iz), t1z = _mm512_mul_ps(_mm512_sub_ps(maxZ, oz), iz);
+		__m512 tEntry = _mm512_max_ps(_mm512_max_ps(_mm512_min_ps(t0x, t1x), _mm512_min_ps(t0y, t1y)),
+									   _mm512_max_ps(_mm512_min_ps(t0z, t1z), _mm512_setzero_ps()));
+		__m512 tExit = _mm512_min_ps(_mm512_min_ps(_mm512_max_ps(t0x, t1x), _mm512_max_ps(t0y, t1y)),
+									  _mm512_min_ps(_mm512_max_ps(t0z, t1z), _mm512_loadu_ps(packet.t + first)));
+		_mm512_storeu_ps(tNear + first, tEntry);
+		hits |= (uint64_t)_mm512_mask_cmp_ps_mask(lanes, tEntry, tExit, _CMP_LE_OQ) << first;
+	}
+	return hits;
+}
+#endif
+
+// Dispatch
+// --------
+uint64_t RayPacket::boxMask(uint64_t active, const glm::vec3 &boxMin, const glm::vec3 &boxMax, float *tNear) const
+{
+#ifdef PACKET_X86_KERNELS
+	if (size % 16 == 0 && cpuHasAVX512()) return boxMaskAVX512(*this, active, boxMin, boxMax, tNear) & active;
+	if (size % 8 == 0 && cpuHasAVX2()) return boxMaskAVX2(*this, active, boxMin, boxMax, tNear) & active;
+#endif
+	return boxMaskScalar(*this, active, boxMin, boxMax, tNear);
+}
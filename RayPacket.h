@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+
+#include <glm\glm.hpp>
+
+// RayPacket holds up to 64 rays as structure of arrays, for tracing a square of coherent primary rays through a BVH together
+// Lanes are selected with 64-bit masks (bit i = ray i), every lane carries its own closest hit so far
+// See relevant source file for function descriptions
+struct RayPacket
+{
+	static const int maxRays = 64;
+
+	int size; // rays in use, lanes [0, size)
+
+	float origX[maxRays], origY[maxRays], origZ[maxRays];
+	float dirX[maxRays], dirY[maxRays], dirZ[maxRays];
+	float invDirX[maxRays], invDirY[maxRays], invDirZ[maxRays];
+
+	float t[maxRays];			   // closest hit so far, rays end there
+	int instance[maxRays];		   // scene instance hit, -1 if none (set by intersectScenePacket)
+	unsigned int triangle[maxRays]; // mesh triangle hit
+
+	void setRay(int lane, const glm::vec3 &orig, const glm::vec3 &dir);
+	glm::vec3 origin(int lane) const { return glm::vec3(origX[lane], origY[lane], origZ[lane]); }
+	glm::vec3 direction(int lane) const { return glm::vec3(dirX[lane], dirY[lane], dirZ[lane]); }
+
+	// Slab test of the rays in active against a box, same as rayBoxDist per ray: returns the rays that enter it before
+	// their t and writes their entry distances to tNear[lane]. Runs 16 (AVX-512) or 8 (AVX2) rays per instruction
+	uint64_t boxMask(uint64_t active, const glm::vec3 &boxMin, const glm::vec3 &boxMax, float *tNear) const;
+};
+
+// Number of rays in mask
+inline int rayCount(uint64_t mask)
+{
+	int count = 0;
+	for (; mask != 0; mask &= mask - 1)
+		count++;
+	return count;
+}
+
+// Lowest lane in a non-empty mask
+inline int firstRay(uint64_t mask)
+{
+	int lane = 0;
+	while (!(mask >> lane & 1))
+		lane++;
+	return lane;
+}
@@ -0,0 +1,503 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "Scene.h"
+
+// Instances
+// ---------
+void Instance::setTransform(const glm::vec4 &row0, const glm::vec4 &row1, const glm::vec4 &row2)
+{
+	objectToWorld[0] = row0;
+	objectToWorld[1] = row1;
+	objectToWorld[2] = row2;
+
+	// inverse of the linear part from the cofactors (rows of the inverse are cross products of the columns)
+	glm::vec3 c0(row0.x, row1.x, row2.x);
+	glm::vec3 c1(row0.y, row1.y, row2.y);
+	glm::vec3 c2(row0.z, row1.z, row2.z);
+	glm::vec3 t(row0.w, row1.w, row2.w);
+
+	glm::vec3 r0 = glm::cross(c1, c2);
+	glm::vec3 r1 = glm::cross(c2, c0);
+	glm::vec3 r2 = glm::cross(c0, c1);
+	float det = glm::dot(c0, r0);
+	if (det == 0.0f)
+	{
+		printf("ERROR::SCENE::SINGULAR_TRANSFORM\n");
+		det = 1.0f;
+	}
+	r0 = r0 / det;
+	r1 = r1 / det;
+	r2 = r2 / det;
+
+	worldToObject[0] = glm::vec4(r0, -glm::dot(r0, t));
+	worldToObject[1] = glm::vec4(r1, -glm::dot(r1, t));
+	worldToObject[2] = glm::vec4(r2, -glm::dot(r2, t));
+}
+
+glm::vec3 Instance::toObjectPoint(const glm::vec3 &p) const
+{
+	glm::vec4 h(p, 1.0f);
+	return glm::vec3(glm::dot(worldToObject[0], h), glm::dot(worldToObject[1], h), glm::dot(worldToObject[2], h));
+}
+
+glm::vec3 Instance::toObjectDirection(const glm::vec3 &d) const
+{
+	glm::vec4 h(d, 0.0f);
+	return glm::vec3(glm::dot(worldToObject[0], h), glm::dot(worldToObject[1], h), glm::dot(worldToObject[2], h));
+}
+
+glm::vec3 Instance::toWorldPoint(const glm::vec3 &p) const
+{
+	glm::vec4 h(p, 1.0f);
+	return glm::vec3(glm::dot(objectToWorld[0], h), glm::dot(objectToWorld[1], h), glm::dot(objectToWorld[2], h));
+}
+
+bool Instance::mirrors() const
+{
+	glm::vec3 r0(objectToWorld[0]), r1(objectToWorld[1]), r2(objectToWorld[2]);
+	return glm::dot(r0, glm::cross(r1, r2)) < 0.0f;
+}
+
+AABB Instance::worldBounds(const AABB &objectBounds) const
+{
+	AABB bounds;
+	if (objectBounds.empty()) return bounds;
+	for (int corner = 0; corner < 8; corner++)
+	{
+		glm::vec3 p((corner & 1) ? objectBounds.max.x : objectBounds.min.x,
+					(corner & 2) ? objectBounds.max.y : objectBounds.min.y,
+					(corner & 4) ? objectBounds.max.z : objectBounds.min.z);
+		bounds.grow(toWorldPoint(p));
+	}
+	return bounds;
+}
+
+size_t Scene::triangleCount() const
+{
+	size_t count = 0;
+	for (size_t i = 0; i < meshes.size(); i++)
+		count += meshes[i].triangleCount();
+	return count;
+}
+
+// Loading
+// -------
+static bool endsWith(const std::string &s, const char *suffix)
+{
+	size_t n = strlen(suffix);
+	return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+bool loadScene(const char *path, Scene &scene, ThreadPool &pool)
+{
+	scene.meshes.clear();
+	scene.instances.clear();
+
+	std::string scenePath = path;
+	if (!endsWith(scenePath, ".scene"))
+	{
+		scene.meshes.resize(1);
+		if (!loadObj(path, scene.meshes[0], pool) || scene.meshes[0].triangleCount() == 0)
+		{
+			scene.meshes.clear();
+			return false;
+		}
+		scene.instances.resize(1);
+		return true;
+	}
+
+	std::ifstream file(path);
+	if (!file.is_open())
+	{
+		printf("ERROR::SCENE::FILE_NOT_SUCCESSFULLY_READ: %s\n", path);
+		return false;
+	}
+
+	size_t slash = scenePath.find_last_of("/\\");
+	std::string directory = slash == std::string::npos ? "" : scenePath.substr(0, slash + 1);
+
+	std::vector<std::string> meshNames;
+	std::string line;
+	for (int lineNumber = 1; std::getline(file, line); lineNumber++)
+	{
+		char keyword[16], name[256], objPath[1024];
+		float v[12];
+		if (sscanf(line.c_str(), "%15s", keyword) != 1 || keyword[0] == '#') continue;
+
+		if (strcmp(keyword, "mesh") == 0 && sscanf(line.c_str(), "%*s %255s %1023s", name, objPath) == 2)
+		{
+			Mesh mesh;
+			if (!loadObj((directory + objPath).c_str(), mesh, pool) || mesh.triangleCount() == 0)
+			{
+				printf("ERROR::SCENE::EMPTY_MESH: %s (line %i)\n", name, lineNumber);
+				continue;
+			}
+			meshNames.push_back(name);
+			scene.meshes.push_back(mesh);
+		}
+		else if (strcmp(keyword, "instance") == 0 && sscanf(line.c_str(), "%*s %255s", name) == 1)
+		{
+			size_t mesh = 0;
+			while (mesh < meshNames.size() && meshNames[mesh] != name)
+				mesh++;
+			if (mesh == meshNames.size())
+			{
+				printf("ERROR::SCENE::UNKNOWN_MESH: %s (line %i)\n", name, lineNumber);
+				continue;
+			}
+
+			Instance instance;
+			instance.mesh = (unsigned int)mesh;
+			int count = sscanf(line.c_str(), "%*s %*s %f %f %f %f %f %f %f %f %f %f %f %f", &v[0], &v[1], &v[2], &v[3], &v[4],
+							   &v[5], &v[6], &v[7], &v[8], &v[9], &v[10], &v[11]);
+			if (count == 3)
+				instance.setTransform(glm::vec4(1, 0, 0, v[0]), glm::vec4(0, 1, 0, v[1]), glm::vec4(0, 0, 1, v[2]));
+			else if (count == 12)
+				instance.setTransform(glm::vec4(v[0], v[1], v[2], v[3]), glm::vec4(v[4], v[5], v[6], v[7]),
+									  glm::vec4(v[8], v[9], v[10], v[11]));
+			else if (count > 0)
+			{
+				printf("ERROR::SCENE::BAD_TRANSFORM: expected 0, 3 or 12 numbers (line %i)\n", lineNumber);
+				continue;
+			}
+			scene.instances.push_back(instance);
+		}
+		else printf("ERROR::SCENE::UNKNOWN_LINE: %s (line %i)\n", line.c_str(), lineNumber);
+	}
+
+	printf("Loaded %s: %zu meshes (%zu triangles), %zu instances\n", path, scene.meshes.size(), scene.triangleCount(),
+		   scene.instances.size());
+	return !scene.instances.empty();
+}
+
+// Top-level BVH
+// -------------
+void buildTLAS(const Scene &scene, const std::vector<BVH> &meshBVHs, BVH &tlas)
+{
+	std::vector<AABB> bounds(scene.instances.size());
+	for (size_t i = 0; i < scene.instances.size(); i++)
+	{
+		const Instance &instance = scene.instances[i];
+		const BVH &blas = meshBVHs[instance.mesh];
+
+		AABB objectBounds;
+		if (!blas.nodes.empty())
+		{
+			objectBounds.min = blas.nodes[0].boundsMin;
+			objectBounds.max = blas.nodes[0].boundsMax;
+		}
+		bounds[i] = instance.worldBounds(objectBounds);
+	}
+	tlas.build(bounds);
+}
+
+// Tracing
+// -------
+
+// Closest hit below the TLAS node root, closer than hit.t
+static void intersectTLASSubtree(const Scene &scene, const std::vector<BVH> &meshBVHs, const BVH &tlas, int root,
+								 const glm::vec3 &orig, const glm::vec3 &dir, const glm::vec3 &invDir, SceneHit &hit,
+								 TraversalStats &work)
+{
+	std::pair<int, float> stack[BVH::traversalStackSize]; // (TLAS node, entry distance)
+	int sp = 0;
+	if (rayBoxDist(orig, invDir, tlas.nodes[root].boundsMin, tlas.nodes[root].boundsMax, hit.t) < 1e30f)
+		stack[sp++] = std::make_pair(root, 0.0f);
+	while (sp > 0)
+	{
+		std::pair<int, float> top = stack[--sp];
+		if (top.second > hit.t) continue;
+
+		const BVHNode &node = tlas.nodes[top.first];
+		if (!node.isLeaf() && sp > BVH::traversalStackSize - 2)
+		{
+			// no room for both children, finish this subtree with a stack of its own
+			intersectTLASSubtree(scene, meshBVHs, tlas, top.first, orig, dir, invDir, hit, work);
+			continue;
+		}
+		work.nodeVisits++;
+		if (node.isLeaf())
+		{
+			for (int i = node.leftFirst; i < node.leftFirst + node.count; i++)
+			{
+				int instanceIndex = (int)tlas.triIndices[i];
+				const Instance &instance = scene.instances[instanceIndex];
+				const Mesh &mesh = scene.meshes[instance.mesh];
+
+				// the direction isn't normalized in object space, so t means the same in both spaces
+				int tri = meshBVHs[instance.mesh].intersect(mesh, instance.toObjectPoint(orig), instance.toObjectDirection(dir), hit.t, &work);
+				if (tri >= 0)
+				{
+					hit.instance = instanceIndex;
+					hit.triangle = (unsigned int)tri;
+				}
+			}
+			continue;
+		}
+
+		int nearChild = node.leftFirst, farChild = node.leftFirst + 1;
+		float nearDist = rayBoxDist(orig, invDir, tlas.nodes[nearChild].boundsMin, tlas.nodes[nearChild].boundsMax, hit.t);
+		float farDist = rayBoxDist(orig, invDir, tlas.nodes[farChild].boundsMin, tlas.nodes[farChild].boundsMax, hit.t);
+		if (farDist < nearDist)
+		{
+			std::swap(nearChild, farChild);
+			std::swap(nearDist, farDist);
+		}
+		if (farDist < 1e30f) stack[sp++] = std::make_pair(farChild, farDist);
+		if (nearDist < 1e30f) stack[sp++] = std::make_pair(nearChild, nearDist);
+	}
+}
+
+bool intersectScene(const Scene &scene, const std::vector<BVH> &meshBVHs, const BVH &tlas, const glm::vec3 &orig,
+					const glm::vec3 &dir, SceneHit &hit, TraversalStats *stats)
+{
+	hit.t = 1e30f;
+	hit.instance = -1;
+	hit.triangle = 0;
+	if (tlas.nodes.empty()) return false;
+
+	TraversalStats work;
+	intersectTLASSubtree(scene, meshBVHs, tlas, 0, orig, dir, 1.0f / dir, hit, work);
+
+	if (stats != NULL)
+	{
+		stats->nodeVisits += work.nodeVisits;
+		stats->triangleTests += work.triangleTests;
+	}
+	return hit.instance >= 0;
+}
+
+// Traces the rays through an instance's mesh BVH, in object space (objectPacket is scratch space)
+// The rays that hit something closer than before get the instance and triangle, those are returned
+static uint64_t intersectInstancePacket(const Scene &scene, const std::vector<BVH> &meshBVHs, int instanceIndex,
+										RayPacket &packet, uint64_t rays, RayPacket &objectPacket, TraversalStats &work)
+{
+	const Instance &instance = scene.instances[instanceIndex];
+	for (int lane = 0; lane < packet.size; lane++)
+	{
+		if (!(rays >> lane & 1)) continue;
+		objectPacket.setRay(lane, instance.toObjectPoint(packet.origin(lane)), instance.toObjectDirection(packet.direction(lane)));
+		objectPacket.t[lane] = packet.t[lane];
+	}
+
+	uint64_t hits = meshBVHs[instance.mesh].intersectPacket(scene.meshes[instance.mesh], objectPacket, rays, &work);
+	for (int lane = 0; lane < packet.size; lane++)
+	{
+		if (!(hits >> lane & 1)) continue;
+		packet.t[lane] = objectPacket.t[lane];
+		packet.instance[lane] = instanceIndex;
+		packet.triangle[lane] = objectPacket.triangle[lane];
+	}
+	return hits;
+}
+
+static void clearPacketHits(RayPacket &packet)
+{
+	for (int lane = 0; lane < packet.size; lane++)
+	{
+		packet.t[lane] = 1e30f;
+		packet.instance[lane] = -1;
+		packet.triangle[lane] = 0;
+	}
+}
+
+// Packet traversal below the TLAS node root for the rays that enter its box
+static uint64_t intersectTLASPacketSubtree(const Scene &scene, const std::vector<BVH> &meshBVHs, const BVH &tlas, int root,
+										   RayPacket &packet, uint64_t rays, RayPacket &objectPacket, TraversalStats &work)
+{
+	uint64_t hits = 0;
+	float nearEntry[RayPacket::maxRays], farEntry[RayPacket::maxRays];
+
+	std::pair<int, uint64_t> stack[BVH::traversalStackSize]; // (TLAS node, rays that enter its box)
+	int sp = 0;
+	stack[sp++] = std::make_pair(root, rays);
+	while (sp > 0)
+	{
+		std::pair<int, uint64_t> top = stack[--sp];
+
+		const BVHNode &node = tlas.nodes[top.first];
+		if (!node.isLeaf() && sp > BVH::traversalStackSize - 2)
+		{
+			// no room for both children, finish this subtree with a stack of its own
+			hits |= intersectTLASPacketSubtree(scene, meshBVHs, tlas, top.first, packet, top.second, objectPacket, work);
+			continue;
+		}
+		work.nodeVisits++;
+		if (node.isLeaf())
+		{
+			for (int i = node.leftFirst; i < node.leftFirst + node.count; i++)
+			{
+				hits |= intersectInstancePacket(scene, meshBVHs, (int)tlas.triIndices[i], packet, top.second, objectPacket, work);
+			}
+			continue;
+		}
+
+		int nearChild = node.leftFirst, farChild = node.leftFirst + 1;
+		uint64_t nearRays = packet.boxMask(top.second, tlas.nodes[nearChild].boundsMin, tlas.nodes[nearChild].boundsMax, nearEntry);
+		uint64_t farRays = packet.boxMask(top.second, tlas.nodes[farChild].boundsMin, tlas.nodes[farChild].boundsMax, farEntry);
+		uint64_t both = nearRays & farRays;
+		if (both != 0 && farEntry[firstRay(both)] < nearEntry[firstRay(both)])
+		{
+			std::swap(nearChild, farChild);
+			std::swap(nearRays, farRays);
+		}
+		if (farRays != 0) stack[sp++] = std::make_pair(farChild, farRays);
+		if (nearRays != 0) stack[sp++] = std::make_pair(nearChild, nearRays);
+	}
+	return hits;
+}
+
+uint64_t intersectScenePacket(const Scene &scene, const std::vector<BVH> &meshBVHs, const BVH &tlas, RayPacket &packet,
+							  uint64_t active, TraversalStats *stats)
+{
+	clearPacketHits(packet);
+	if (tlas.nodes.empty()) return 0;
+
+	TraversalStats work;
+	float rootEntry[RayPacket::maxRays];
+	RayPacket objectPacket; // the rays in the current instance's object space
+	objectPacket.size = packet.size;
+
+	active = packet.boxMask(active, tlas.nodes[0].boundsMin, tlas.nodes[0].boundsMax, rootEntry);
+	uint64_t hits = active != 0 ? intersectTLASPacketSubtree(scene, meshBVHs, tlas, 0, packet, active, objectPacket, work) : 0;
+
+	if (stats != NULL)
+	{
+		stats->nodeVisits += work.nodeVisits;
+		stats->triangleTests += work.triangleTests;
+	}
+	return hits;
+}
+
+// Culling
+// -------
+void Frustum::computePlanes()
+{
+	// a point on the ray through the middle of the tile, in front of the lens, decides which side of each plane is inside
+	glm::vec3 center = 0.25f * (corners[0] + corners[1] + corners[2] + corners[3]);
+	glm::vec3 inside = 2.0f * center - apex;
+
+	for (int i = 0; i < 4; i++)
+	{
+		glm::vec3 normal = glm::cross(corners[i] - apex, corners[(i + 1) % 4] - apex);
+		planes[i] = glm::vec4(normal, -glm::dot(normal, apex));
+	}
+	glm::vec3 lensNormal = glm::cross(lens[1] - lens[0], lens[2] - lens[0]);
+	planes[4] = glm::vec4(lensNormal, -glm::dot(lensNormal, lens[0]));
+
+	for (int i = 0; i < 5; i++)
+		if (glm::dot(glm::vec3(planes[i]), inside) + planes[i].w < 0.0f) planes[i] = glm::vec4(-glm::vec3(planes[i]), -planes[i].w);
+}
+
+Frustum Frustum::toObjectSpace(const Instance &instance) const
+{
+	Frustum objectFrustum;
+	objectFrustum.apex = instance.toObjectPoint(apex);
+	for (int i = 0; i < 4; i++)
+		objectFrustum.corners[i] = instance.toObjectPoint(corners[i]);
+	for (int i = 0; i < 3; i++)
+		objectFrustum.lens[i] = instance.toObjectPoint(lens[i]);
+	objectFrustum.computePlanes();
+	return objectFrustum;
+}
+
+bool Frustum::overlaps(const glm::vec3 &boxMin, const glm::vec3 &boxMax) const
+{
+	for (int i = 0; i < 5; i++)
+	{
+		// the corner of the box farthest inside the plane
+		glm::vec3 farthest(planes[i].x >= 0.0f ? boxMax.x : boxMin.x, planes[i].y >= 0.0f ? boxMax.y : boxMin.y,
+						   planes[i].z >= 0.0f ? boxMax.z : boxMin.z);
+		if (glm::dot(glm::vec3(planes[i]), farthest) + planes[i].w < 0.0f) return false;
+	}
+	return true;
+}
+
+// Adds the visible instances below the TLAS node root, false once there are more than maxInstances
+static bool cullSubtree(const Scene &scene, const std::vector<BVH> &meshBVHs, const BVH &tlas, int root, const Frustum &frustum,
+						size_t maxInstances, std::vector<int> &visible)
+{
+	int stack[BVH::traversalStackSize];
+	int sp = 0;
+	stack[sp++] = root;
+	while (sp > 0)
+	{
+		int nodeIndex = stack[--sp];
+		const BVHNode &node = tlas.nodes[nodeIndex];
+		if (!frustum.overlaps(node.boundsMin, node.boundsMax)) continue;
+		if (!node.isLeaf())
+		{
+			if (sp > BVH::traversalStackSize - 2)
+			{
+				// no room for both children, finish this subtree with a stack of its own
+				if (!cullSubtree(scene, meshBVHs, tlas, nodeIndex, frustum, maxInstances, visible)) return false;
+				continue;
+			}
+			stack[sp++] = node.leftFirst;
+			stack[sp++] = node.leftFirst + 1;
+			continue;
+		}
+
+		for (int i = node.leftFirst; i < node.leftFirst + node.count; i++)
+		{
+			// the instance's box in the top-level BVH is its mesh's box transformed, much looser than the box itself when rotated
+			const Instance &instance = scene.instances[tlas.triIndices[i]];
+			const BVH &bvh = meshBVHs[instance.mesh];
+			if (bvh.nodes.empty() || !frustum.toObjectSpace(instance).overlaps(bvh.nodes[0].boundsMin, bvh.nodes[0].boundsMax)) continue;
+			if (visible.size() == maxInstances) return false;
+			visible.push_back((int)tlas.triIndices[i]);
+		}
+	}
+	return true;
+}
+
+bool cullScene(const Scene &scene, const std::vector<BVH> &meshBVHs, const BVH &tlas, const Frustum &frustum, size_t maxInstances,
+			   std::vector<int> &visible)
+{
+	visible.clear();
+	if (tlas.nodes.empty()) return true;
+	return cullSubtree(scene, meshBVHs, tlas, 0, frustum, maxInstances, visible);
+}
+
+bool intersectScene(const Scene &scene, const std::vector<BVH> &meshBVHs, const std::vector<int> &visible, const glm::vec3 &orig,
+					const glm::vec3 &dir, SceneHit &hit, TraversalStats *stats)
+{
+	hit.t = 1e30f;
+	hit.instance = -1;
+	hit.triangle = 0;
+	for (size_t i = 0; i < visible.size(); i++)
+	{
+		const Instance &instance = scene.instances[visible[i]];
+		int tri = meshBVHs[instance.mesh].intersect(scene.meshes[instance.mesh], instance.toObjectPoint(orig),
+													instance.toObjectDirection(dir), hit.t, stats);
+		if (tri >= 0)
+		{
+			hit.instance = visible[i];
+			hit.triangle = (unsigned int)tri;
+		}
+	}
+	return hit.instance >= 0;
+}
+
+uint64_t intersectScenePacket(const Scene &scene, const std::vector<BVH> &meshBVHs, const std::vector<int> &visible,
+							  RayPacket &packet, uint64_t active, TraversalStats *stats)
+{
+	clearPacketHits(packet);
+
+	TraversalStats work;
+	uint64_t hits = 0;
+	RayPacket objectPacket;
+	objectPacket.size = packet.size;
+	for (size_t i = 0; i < visible.size(); i++)
+		hits |= intersectInstancePacket(scene, meshBVHs, visible[i], packet, active, objectPacket, work);
+
+	if (stats != NULL)
+	{
+		stats->nodeVisits += work.nodeVisits;
+		stats->triangleTests += work.triangleTests;
+	}
+	return hits;
+}
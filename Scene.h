@@ -0,0 +1,102 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <glm\glm.hpp>
+
+#include "ObjLoader.h"
+#include "ThreadPool.h"
+#include "BVH.h"
+
+// Instance places one of the scene's meshes in the world with an affine 3x4 transform
+// Rays are moved into the mesh's object space instead of moving the mesh, so any number of instances share one copy of
+// the mesh and of its BVH
+struct Instance
+{
+	unsigned int mesh;			// index into Scene::meshes
+	glm::vec4 objectToWorld[3]; // rows of the 3x4 transform, world = row . (object, 1)
+	glm::vec4 worldToObject[3]; // rows of the inverse, kept in sync by setTransform()
+
+	Instance() : mesh(0) { setTransform(glm::vec4(1, 0, 0, 0), glm::vec4(0, 1, 0, 0), glm::vec4(0, 0, 1, 0)); }
+
+	void setTransform(const glm::vec4 &row0, const glm::vec4 &row1, const glm::vec4 &row2);
+
+	glm::vec3 toObjectPoint(const glm::vec3 &p) const;
+	glm::vec3 toObjectDirection(const glm::vec3 &d) const; // not normalized, so hit distances stay the same in both spaces
+	glm::vec3 toWorldPoint(const glm::vec3 &p) const;
+	bool mirrors() const; // true if the transform flips handedness (front and back faces swap)
+
+	AABB worldBounds(const AABB &objectBounds) const; // box around the transformed corners of objectBounds
+};
+
+// Scene holds every unique mesh once plus the instances placing them
+struct Scene
+{
+	std::vector<Mesh> meshes;
+	std::vector<Instance> instances;
+
+	size_t triangleCount() const; // unique triangles, instancing doesn't add any
+};
+
+// Loads path into scene. A .scene file lists meshes and instances of them:
+//     mesh <name> <file.obj>         the .obj path is relative to the .scene file
+//     instance <name>                identity transform
+//     instance <name> tx ty tz       translation
+//     instance <name> <12 floats>    3x4 transform, row by row
+// Anything else is loaded as a single .obj placed once with the identity transform
+// Returns false if nothing could be loaded
+bool loadScene(const char *path, Scene &scene, ThreadPool &pool);
+
+// Builds the top-level BVH over the instances' world bounds, meshBVHs holds one bottom-level BVH per scene mesh
+// tlas.triIndices holds instance indices in leaf order
+void buildTLAS(const Scene &scene, const std::vector<BVH> &meshBVHs, BVH &tlas);
+
+// Closest hit of a CPU traced ray
+struct SceneHit
+{
+	float t;
+	int instance;			// index into Scene::instances, -1 if nothing was hit
+	unsigned int triangle; // triangle of the instance's mesh
+};
+
+// Traces orig + t * dir through the top-level BVH and the hit instances' mesh BVHs like closestTriScene in comp.glsl
+// Node visits and triangle tests of both levels are added to stats if given. Returns false if nothing was hit
+bool intersectScene(const Scene &scene, const std::vector<BVH> &meshBVHs, const BVH &tlas, const glm::vec3 &orig,
+					const glm::vec3 &dir, SceneHit &hit, TraversalStats *stats = NULL);
+
+// Traces the rays in active together through the top-level BVH and the hit instances' mesh BVHs (see BVH::intersectPacket)
+// Sets t, instance and triangle of every ray in active like intersectScene does, returns the rays that hit something
+uint64_t intersectScenePacket(const Scene &scene, const std::vector<BVH> &meshBVHs, const BVH &tlas, RayPacket &packet,
+							  uint64_t active, TraversalStats *stats = NULL);
+
+// Frustum is the pyramid around a screen tile's primary rays: they all start on the lens and point away from the light
+// position behind it (the apex). It is kept as points rather than planes so it can be moved into an instance's object space
+// like any other geometry, computePlanes() derives the planes from them
+struct Frustum
+{
+	glm::vec3 apex;
+	glm::vec3 corners[4]; // on the lens, around the tile in order
+	glm::vec3 lens[3];	  // three points spanning the lens plane, nothing in front of the camera is behind it
+
+	glm::vec4 planes[5]; // inside where dot(plane.xyz, p) + plane.w >= 0
+
+	void computePlanes();
+	Frustum toObjectSpace(const Instance &instance) const;
+
+	// False if the box is certainly outside (entirely behind one of the planes), boxes near the edges may give false positives
+	bool overlaps(const glm::vec3 &boxMin, const glm::vec3 &boxMax) const;
+};
+
+// Collects the instances the frustum may see: the top-level BVH is walked with the frustum instead of a ray, and every
+// instance in an overlapped leaf is kept if the frustum (moved into its object space) overlaps its mesh BVH's root box
+// Rays inside the frustum then only need to visit those. Returns false if more than maxInstances are visible (visible is
+// unusable, trace the whole scene instead)
+bool cullScene(const Scene &scene, const std::vector<BVH> &meshBVHs, const BVH &tlas, const Frustum &frustum, size_t maxInstances,
+			   std::vector<int> &visible);
+
+// intersectScene and intersectScenePacket through the instances collected by cullScene instead of the top-level BVH
+bool intersectScene(const Scene &scene, const std::vector<BVH> &meshBVHs, const std::vector<int> &visible, const glm::vec3 &orig,
+					const glm::vec3 &dir, SceneHit &hit, TraversalStats *stats = NULL);
+uint64_t intersectScenePacket(const Scene &scene, const std::vector<BVH> &meshBVHs, const std::vector<int> &visible,
+							  RayPacket &packet, uint64_t active, TraversalStats *stats = NULL);
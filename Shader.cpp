@@ -1,4 +1,5 @@
 #include <string>
+#include <chrono>
 #include <fstream>
 #include <sstream>
 #include <iostream>
@@ -9,6 +10,7 @@
 #include <glm\gtc\type_ptr.hpp>
 
 #include "Shader.h"
+#include "ProgramCache.h"
 
 // Constructor
 Shader::Shader(const GLchar* vertexPath, const GLchar* fragmentPath)
@@ -40,6 +42,18 @@ Shader::Shader(const GLchar* vertexPath, const GLchar* fragmentPath)
 		std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ" << std::endl;
 	}
 
+	// Binary cache
+	std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
+	std::string cacheKey = programCacheKey(vertexSourceCodeBuffer + '\0' + fragmentSourceCodeBuffer);
+	ID = glCreateProgram();
+	if (loadProgramBinary(ID, cacheKey))
+	{
+		readUniformLocations(ID, uniforms);
+		recordProgramBuild(true, std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count());
+		return;
+	}
+	glDeleteProgram(ID); // may hold a binary the driver rejected
+
 	// Send string buffers' content to char*'s as c_strings
 	vertexSourceCode = vertexSourceCodeBuffer.c_str();
 	fragmentSourceCode = fragmentSourceCodeBuffer.c_str();
@@ -76,6 +90,7 @@ Shader::Shader(const GLchar* vertexPath, const GLchar* fragmentPath)
 	ID = glCreateProgram();
 	glAttachShader(ID, vertexShader);
 	glAttachShader(ID, fragmentShader);
+	programBinaryHint(ID);
 	glLinkProgram(ID);
 
 	// Error checking
@@ -85,10 +100,18 @@ Shader::Shader(const GLchar* vertexPath, const GLchar* fragmentPath)
 		glGetProgramInfoLog(ID, 512, NULL, infoLog);
 		std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
 	}
+	else saveProgramBinary(ID, cacheKey);
 	// ---------- End ---------- //
 
 	glDeleteShader(vertexShader);
 	glDeleteShader(fragmentShader);
+	readUniformLocations(ID, uniforms);
+	recordProgramBuild(false, std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count());
+}
+
+int Shader::uniformLocation(const std::string &name) const
+{
+	return findLocation(uniforms, name);
 }
 
 // Set shader to current
@@ -101,44 +124,64 @@ void Shader::use()
 // -------------------
 void Shader::setBool(const std::string &name, bool value) const
 {
-	glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+	glUniform1i(uniformLocation(name), (int)value);
 }
 
 void Shader::setInt(const std::string &name, int value) const
 {
-	glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+	glUniform1i(uniformLocation(name), value);
 }
 
 void Shader::setFloat(const std::string &name, float value) const
 {
-	glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+	glUniform1f(uniformLocation(name), value);
 }
 
 void Shader::setFloat3(const std::string &name, float value1, float value2, float value3) const
 {
-	glUniform3f(glGetUniformLocation(ID, name.c_str()), value1, value2, value3);
+	glUniform3f(uniformLocation(name), value1, value2, value3);
 }
 void Shader::setFloat3(const std::string &name, glm::vec3 val) const
 {
-	glUniform3f(glGetUniformLocation(ID, name.c_str()), val.x, val.y, val.z);
+	glUniform3f(uniformLocation(name), val.x, val.y, val.z);
 }
 
 void Shader::setFloat4(const std::string &name, float value1, float value2, float value3, float value4) const
 {
-	glUniform4f(glGetUniformLocation(ID, name.c_str()), value1, value2, value3, value4);
+	glUniform4f(uniformLocation(name), value1, value2, value3, value4);
 }
 
 void Shader::setMatrix3f(const std::string &name, glm::mat3 matrix) const
 {
-	glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, glm::value_ptr(matrix));
+	glUniformMatrix3fv(uniformLocation(name), 1, GL_FALSE, glm::value_ptr(matrix));
 }
 
 void Shader::setMatrix4f(const std::string &name, glm::mat4 matrix) const
 {
-	glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, glm::value_ptr(matrix));
+	glUniformMatrix4fv(uniformLocation(name), 1, GL_FALSE, glm::value_ptr(matrix));
 }
 
 void Shader::setDouble(const std::string &name, double value) const
 {
-	glUniform1d(glGetUniformLocation(ID, name.c_str()), value);
+	glUniform1d(uniformLocation(name), value);
+}
+
+void Shader::setBool(int location, bool value) const
+{
+	glUniform1i(location, (int)value);
+}
+
+void Shader::setInt(int location, int value) const
+{
+	glUniform1i(location, value);
+}
+
+void Shader::setFloat(int location, float value) const
+{
+	glUniform1f(location, value);
+}
+
+void Shader::setFloat3(int location, glm::vec3 val) const
+{
+	glUniform3f(location, val.x, val.y, val.z);
 }
\ No newline at end of file
@@ -6,6 +6,8 @@
 #include<glad\glad.h>
 #include<glm\glm.hpp>
 
+#include "ProgramCache.h"
+
 // Shader handles the loading-in and compilation of shader source code (written in GLSL). This is essentially a wrapper class around the shader object stored in GPU memory
 // See relevant source file for function descriptions
 class Shader
@@ -27,8 +29,19 @@ public:
 
 	void setDouble(const std::string &name, double value) const;
 
+	// Location of a uniform, -1 if the program has no such uniform (setting it then does nothing)
+	// Looked up in a table read once the program was built, not asked from the driver. Uniforms set every frame should keep
+	// it and use the setters below, which skip the lookup
+	int uniformLocation(const std::string &name) const;
+
+	void setBool(int location, bool value) const;
+	void setInt(int location, int value) const;
+	void setFloat(int location, float value) const;
+	void setFloat3(int location, glm::vec3 val) const;
+
 private:
 	unsigned int ID; // Shader program ID for referencing object stored on video card
+	UniformLocations uniforms;
 
 	unsigned int vertexShader; // Fragment shader ID
 	unsigned int fragmentShader; // Fragment shader ID
@@ -0,0 +1,212 @@
+#include <cstdio>
+
+#include "ThreadPool.h"
+#include "Numa.h"
+
+// The pool and worker index of the calling thread, so submit() can push to the caller's own deque
+static thread_local const ThreadPool *currentPool = NULL;
+static thread_local int currentWorker = -1;
+
+// Constructor
+ThreadPool::ThreadPool(unsigned int threadCount)
+	: queued(0), pending(0), nextQueue(0), stopping(false), statsStart(std::chrono::steady_clock::now())
+{
+	if (threadCount == 0) threadCount = std::thread::hardware_concurrency();
+	if (threadCount == 0) threadCount = 1; // hardware_concurrency may not know
+	start(threadCount);
+}
+
+ThreadPool::ThreadPool(const std::vector<unsigned int> &cpus)
+	: pinnedCpus(cpus), queued(0), pending(0), nextQueue(0), stopping(false), statsStart(std::chrono::steady_clock::now())
+{
+	if (pinnedCpus.empty()) pinnedCpus.push_back(0);
+	start((unsigned int)pinnedCpus.size());
+}
+
+void ThreadPool::start(unsigned int threadCount)
+{
+	for (unsigned int i = 0; i < threadCount; i++)
+	{
+		queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+		queues.back()->busySeconds = 0.0;
+		queues.back()->tasksRun = 0;
+		queues.back()->tasksStolen = 0;
+	}
+	for (unsigned int i = 0; i < threadCount; i++)
+		workers.push_back(std::thread(&ThreadPool::workerLoop, this, (int)i));
+}
+
+// Destructor
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	taskAvailable.notify_all();
+
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+}
+
+void ThreadPool::submit(const std::function<void()> &task)
+{
+	int self = workerIndex();
+	size_t target;
+	if (self >= 0) target = (size_t)self;
+	else
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		target = nextQueue++ % queues.size();
+	}
+	push(target, task);
+}
+
+void ThreadPool::submitTo(unsigned int worker, const std::function<void()> &task)
+{
+	push(worker % queues.size(), task);
+}
+
+void ThreadPool::push(size_t target, const std::function<void()> &task)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending++;
+		queued++; // counted before the push so a popping worker never sees it drop below zero
+	}
+	{
+		std::lock_guard<std::mutex> lock(queues[target]->mutex);
+		queues[target]->tasks.push_back(task);
+	}
+	taskAvailable.notify_one();
+}
+
+void ThreadPool::wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	allDone.wait(lock, [this] { return pending == 0; });
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t begin, size_t end)> &body)
+{
+	size_t chunks = size() < count ? size() : count;
+	for (size_t i = 0; i < chunks; i++)
+	{
+		size_t begin = count * i / chunks;
+		size_t end = count * (i + 1) / chunks;
+		submit([&body, begin, end] { body(begin, end); });
+	}
+	wait();
+}
+
+int ThreadPool::workerIndex() const
+{
+	return currentPool == this ? currentWorker : -1;
+}
+
+void ThreadPool::resetWorkerStats()
+{
+	for (size_t i = 0; i < queues.size(); i++)
+	{
+		std::lock_guard<std::mutex> lock(queues[i]->mutex);
+		queues[i]->busySeconds = 0.0;
+		queues[i]->tasksRun = 0;
+		queues[i]->tasksStolen = 0;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	statsStart = std::chrono::steady_clock::now();
+}
+
+// A task still running is only counted once it finishes, read the stats after wait()
+std::vector<ThreadPool::WorkerStats> ThreadPool::workerStats() const
+{
+	double wallSeconds;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - statsStart).count();
+	}
+
+	std::vector<WorkerStats> stats(queues.size());
+	for (size_t i = 0; i < queues.size(); i++)
+	{
+		std::lock_guard<std::mutex> lock(queues[i]->mutex);
+		stats[i].busySeconds = queues[i]->busySeconds;
+		stats[i].idleSeconds = wallSeconds > queues[i]->busySeconds ? wallSeconds - queues[i]->busySeconds : 0.0;
+		stats[i].tasks = queues[i]->tasksRun;
+		stats[i].stolen = queues[i]->tasksStolen;
+	}
+	return stats;
+}
+
+bool ThreadPool::popTask(int index, std::function<void()> &task, bool &stolen)
+{
+	stolen = false;
+
+	// newest task of our own deque
+	{
+		WorkQueue &own = *queues[index];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty())
+		{
+			task = own.tasks.back();
+			own.tasks.pop_back();
+			return true;
+		}
+	}
+
+	// oldest task of the next worker that has one
+	for (size_t i = 1; i < queues.size(); i++)
+	{
+		WorkQueue &victim = *queues[(index + i) % queues.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty())
+		{
+			task = victim.tasks.front();
+			victim.tasks.pop_front();
+			stolen = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Each worker runs tasks until the pool is stopped and every deque is drained
+void ThreadPool::workerLoop(int index)
+{
+	currentPool = this;
+	currentWorker = index;
+	if (!pinnedCpus.empty() && !pinThread(pinnedCpus[index])) printf("ERROR::THREAD_POOL::PIN_FAILED cpu %u\n", pinnedCpus[index]);
+
+	for (;;)
+	{
+		std::function<void()> task;
+		bool stolen;
+		if (popTask(index, task, stolen))
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				queued--;
+			}
+
+			std::chrono::steady_clock::time_point taskStart = std::chrono::steady_clock::now();
+			task();
+			double taskSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - taskStart).count();
+			{
+				WorkQueue &own = *queues[index];
+				std::lock_guard<std::mutex> lock(own.mutex);
+				own.busySeconds += taskSeconds;
+				own.tasksRun++;
+				if (stolen) own.tasksStolen++;
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--pending == 0) allDone.notify_all();
+			continue;
+		}
+
+		// Nothing to pop or steal, sleep until something is queued
+		std::unique_lock<std::mutex> lock(mutex);
+		taskAvailable.wait(lock, [this] { return stopping || queued > 0; });
+		if (stopping && queued == 0) return;
+	}
+}
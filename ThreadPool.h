@@ -0,0 +1,84 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// ThreadPool owns a fixed set of worker threads, each with its own task deque
+// A worker runs its own newest task first (depth-first, cache-warm) and steals the oldest task of another worker when it
+// runs dry (the oldest tasks are the biggest ones in recursive workloads), tasks submitted from outside are dealt round-robin
+// See relevant source file for function descriptions
+class ThreadPool
+{
+public:
+	ThreadPool(unsigned int threadCount = 0); // Constructor: Start threadCount workers (0 = one per hardware thread)
+	ThreadPool(const std::vector<unsigned int> &cpus); // Constructor: Start one worker per CPU, pinned to it (see Numa.h)
+	~ThreadPool();							  // Destructor: Finish queued tasks and join the workers
+
+	unsigned int size() const { return (unsigned int)workers.size(); }
+
+	void submit(const std::function<void()> &task); // Queue a task, tasks may submit further tasks
+
+	// Queue a task on worker's own deque, for seeding each worker with a run of neighbouring work items: the owner works
+	// through them newest first while idle workers steal from the other end
+	void submitTo(unsigned int worker, const std::function<void()> &task);
+	void wait();									  // Block until every submitted task (and everything they submitted) has finished
+
+	// Split [0, count) into one contiguous range per worker and run body(begin, end) on each, returns when all are done
+	// Must not be called from inside a task (the caller blocks in wait())
+	void parallelFor(size_t count, const std::function<void(size_t begin, size_t end)> &body);
+
+	// Index of the calling worker thread in [0, size()), or -1 when called from a thread that isn't one of ours
+	int workerIndex() const;
+
+	// Time each worker spent running tasks since the last resetWorkerStats() (or construction), the rest of the wall time
+	// since then it was idle: looking for work to steal, sleeping, or not needed
+	struct WorkerStats
+	{
+		double busySeconds;
+		double idleSeconds;
+		size_t tasks;  // tasks run
+		size_t stolen; // of those, taken from another worker's deque
+	};
+	void resetWorkerStats();
+	std::vector<WorkerStats> workerStats() const;
+
+private:
+	ThreadPool(const ThreadPool &);			   // non-copyable, owns threads
+	ThreadPool &operator=(const ThreadPool &);
+
+	struct WorkQueue
+	{
+		std::mutex mutex; // also guards the counters below
+		std::deque<std::function<void()> > tasks;
+
+		double busySeconds;
+		size_t tasksRun;
+		size_t tasksStolen;
+	};
+
+	void start(unsigned int threadCount);
+	void push(size_t target, const std::function<void()> &task);
+	void workerLoop(int index);
+	bool popTask(int index, std::function<void()> &task, bool &stolen); // own newest task, else another worker's oldest
+
+	std::vector<std::thread> workers;
+	std::vector<unsigned int> pinnedCpus; // per worker, empty if the workers aren't pinned
+	std::vector<std::unique_ptr<WorkQueue> > queues; // one per worker
+
+	mutable std::mutex mutex;			   // guards the counters below
+	std::condition_variable taskAvailable; // signalled when a task is queued or the pool is stopping
+	std::condition_variable allDone;	   // signalled when pending drops to 0
+
+	size_t queued;	   // tasks sitting in a deque
+	size_t pending;	   // tasks queued or running
+	size_t nextQueue;  // round-robin target for tasks submitted from outside the pool
+	bool stopping;
+
+	std::chrono::steady_clock::time_point statsStart; // guarded by mutex
+};
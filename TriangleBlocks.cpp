@@ -0,0 +1,254 @@
+#include <cmath>
+
+#include "TriangleBlocks.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BLOCKS_X86_KERNELS
+#endif
+
+void TriangleBlocks::clear()
+{
+	rows.clear();
+	triangles.clear();
+}
+
+int TriangleBlocks::append(const Mesh &mesh, const unsigned int *tris, int count)
+{
+	int firstBlock = (int)(triangles.size() / width);
+	int blocks = blockCount(count);
+	rows.resize(rows.size() + (size_t)blocks * rowCount * width, 0.0f); // zero edges in the unused lanes, det = 0 never hits
+	triangles.resize(triangles.size() + (size_t)blocks * width, -1);
+
+	for (int i = 0; i < count; i++)
+	{
+		size_t block = firstBlock + i / width;
+		int lane = i % width;
+		float *row = &rows[block * rowCount * width + lane];
+		const unsigned int *tri = &mesh.indices[3 * (size_t)tris[i]];
+		const float *v0 = &mesh.positions[3 * (size_t)tri[0]];
+		const float *v1 = &mesh.positions[3 * (size_t)tri[1]];
+		const float *v2 = &mesh.positions[3 * (size_t)tri[2]];
+		for (int c = 0; c < 3; c++)
+		{
+			row[c * width] = v0[c];
+			row[(3 + c) * width] = v1[c] - v0[c];
+			row[(6 + c) * width] = v2[c] - v0[c];
+		}
+		triangles[block * width + lane] = (int)tris[i];
+	}
+	return firstBlock;
+}
+
+// Kernels
+// -------
+// All three run the Moller-Trumbore test of rayTriDist in comp.glsl lane by lane and keep the nearest hit closer than tMax,
+// lowest lane first on ties so the result matches testing the triangles one after another
+static bool intersectScalar(const float *rows, const int *triangles, int width, int blocks, const glm::vec3 &orig,
+							const glm::vec3 &dir, float tMax, BlockHit &hit)
+{
+	bool found = false;
+	for (int b = 0; b < blocks; b++, rows += TriangleBlocks::rowCount * width, triangles += width)
+	{
+		for (int lane = 0; lane < width; lane++)
+		{
+			glm::vec3 v0(rows[lane], rows[width + lane], rows[2 * width + lane]);
+			glm::vec3 e1(rows[3 * width + lane], rows[4 * width + lane], rows[5 * width + lane]);
+			glm::vec3 e2(rows[6 * width + lane], rows[7 * width + lane], rows[8 * width + lane]);
+
+			glm::vec3 pvec = glm::cross(dir, e2);
+			float det = glm::dot(e1, pvec);
+			if (std::abs(det) < 0.000001f) continue;
+
+			glm::vec3 tvec = orig - v0;
+			float u = glm::dot(tvec, pvec) / det;
+			if (u < 0.0f || u > 1.0f) continue;
+
+			glm::vec3 qvec = glm::cross(tvec, e1);
+			float v = glm::dot(dir, qvec) / det;
+			if (v < 0.0f || u + v > 1.0f) continue;
+
+			float t = glm::dot(e2, qvec) / det;
+			if (t < 0.0f || t >= tMax) continue;
+
+			tMax = t;
+			hit.t = t;
+			hit.u = u;
+			hit.v = v;
+			hit.triangle = triangles[lane];
+			found = true;
+		}
+	}
+	return found;
+}
+
+#ifdef BLOCKS_X86_KERNELS
+__attribute__((target("avx2"))) static bool intersectAVX2(const float *rows, const int *triangles, int blocks, const glm::vec3 &orig,
+														  const glm::vec3 &dir, float tMax, BlockHit &hit)
+{
+	const __m256 ox = _mm256_set1_ps(orig.x), oy = _mm256_set1_ps(orig.y), oz = _mm256_set1_ps(orig.z);
+	const __m256 dx = _mm256_set1_ps(dir.x), dy = _mm256_set1_ps(dir.y), dz = _mm256_set1_ps(dir.z);
+	const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f), epsilon = _mm256_set1_ps(0.000001f);
+	const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	const __m256 miss = _mm256_set1_ps(INFINITY);
+
+	bool found = false;
+	for (int b = 0; b < blocks; b++, rows += TriangleBlocks::rowCount * 8, triangles += 8)
+	{
+		__m256 e1x = _mm256_loadu_ps(rows + 24), e1y = _mm256_loadu_ps(rows + 32), e1z = _mm256_loadu_ps(rows + 40);
+		__m256 e2x = _mm256_loadu_ps(rows + 48), e2y = _mm256_loadu_ps(rows + 56), e2z = _mm256_loadu_ps(rows + 64);
+
+		// pvec = cross(dir, e2), det = dot(e1, pvec)
+		__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(e2y, dz));
+		__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(e2z, dx));
+		__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(e2x, dy));
+		__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+		__m256 mask = _mm256_cmp_ps(_mm256_and_ps(det, absMask), epsilon, _CMP_GE_OQ);
+
+		// tvec = orig - v0, u = dot(tvec, pvec) / det
+		__m256 tx = _mm256_sub_ps(ox, _mm256_loadu_ps(rows));
+		__m256 ty = _mm256_sub_ps(oy, _mm256_loadu_ps(rows + 8));
+		__m256 tz = _mm256_sub_ps(oz, _mm256_loadu_ps(rows + 16));
+		__m256 u = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), det);
+		mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+
+		// qvec = cross(tvec, e1), v = dot(dir, qvec) / det, t = dot(e2, qvec) / det
+		__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(e1y, tz));
+		__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(e1z, tx));
+		__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(e1x, ty));
+		__m256 v = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), det);
+		mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+		__m256 t = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), det);
+		mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GE_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(tMax), _CMP_LT_OQ)));
+		if (_mm256_movemask_ps(mask) == 0) continue;
+
+		// masked min reduction: misses become infinity, then the minimum is spread to every lane
+		__m256 candidates = _mm256_blendv_ps(miss, t, mask);
+		__m256 nearest = _mm256_min_ps(candidates, _mm256_permute2f128_ps(candidates, candidates, 1));
+		nearest = _mm256_min_ps(nearest, _mm256_shuffle_ps(nearest, nearest, _MM_SHUFFLE(1, 0, 3, 2)));
+		nearest = _mm256_min_ps(nearest, _mm256_shuffle_ps(nearest, nearest, _MM_SHUFFLE(2, 3, 0, 1)));
+		int lane = __builtin_ctz(_mm256_movemask_ps(_mm256_and_ps(mask, _mm256_cmp_ps(candidates, nearest, _CMP_EQ_OQ))));
+
+		float ts[8], us[8], vs[8];
+		_mm256_storeu_ps(ts, t);
+		_mm256_storeu_ps(us, u);
+		_mm256_storeu_ps(vs, v);
+		tMax = ts[lane];
+		hit.t = ts[lane];
+		hit.u = us[lane];
+		hit.v = vs[lane];
+		hit.triangle = triangles[lane];
+		found = true;
+	}
+	return found;
+}
+
+// AVX-512 implies FMA, contracting the products would round differently than the other kernels and the shader
+__attribute__((target("avx512f"), optimize("fp-contract=off"))) static bool intersectAVX512(const float *rows, const int *triangles, int blocks,
+																							const glm::vec3 &orig, const glm::vec3 &dir, float tMax,
+																							BlockHit &hit)
+{
+	const __m512 ox = _mm512_set1_ps(orig.x), oy = _mm512_set1_ps(orig.y), oz = _mm512_set1_ps(orig.z);
+	const __m512 dx = _mm512_set1_ps(dir.x), dy = _mm512_set1_ps(dir.y), dz = _mm512_set1_ps(dir.z);
+	const __m512 zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1.0f), epsilon = _mm512_set1_ps(0.000001f);
+	const __m512 miss = _mm512_set1_ps(INFINITY);
+
+	bool found = false;
+	for (int b = 0; b < blocks; b++, rows += TriangleBlocks::rowCount * 16, triangles += 16)
+	{
+		__m512 e1x = _mm512_loadu_ps(rows + 48), e1y = _mm512_loadu_ps(rows + 64), e1z = _mm512_loadu_ps(rows + 80);
+		__m512 e2x = _mm512_loadu_ps(rows + 96), e2y = _mm512_loadu_ps(rows + 112), e2z = _mm512_loadu_ps(rows + 128);
+
+		__m512 px = _mm512_sub_ps(_mm512_mul_ps(dy, e2z), _mm512_mul_ps(e2y, dz));
+		__m512 py = _mm512_sub_ps(_mm512_mul_ps(dz, e2x), _mm512_mul_ps(e2z, dx));
+		__m512 pz = _mm512_sub_ps(_mm512_mul_ps(dx, e2y), _mm512_mul_ps(e2x, dy));
+		__m512 det = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1x, px), _mm512_mul_ps(e1y, py)), _mm512_mul_ps(e1z, pz));
+		__mmask16 mask = _mm512_cmp_ps_mask(_mm512_abs_ps(det), epsilon, _CMP_GE_OQ);
+
+		__m512 tx = _mm512_sub_ps(ox, _mm512_loadu_ps(rows));
+		__m512 ty = _mm512_sub_ps(oy, _mm512_loadu_ps(rows + 16));
+		__m512 tz = _mm512_sub_ps(oz, _mm512_loadu_ps(rows + 32));
+		__m512 u = _mm512_div_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(tx, px), _mm512_mul_ps(ty, py)), _mm512_mul_ps(tz, pz)), det);
+		mask = _mm512_mask_cmp_ps_mask(mask, u, zero, _CMP_GE_OQ);
+		mask = _mm512_mask_cmp_ps_mask(mask, u, one, _CMP_LE_OQ);
+
+		__m512 qx = _mm512_sub_ps(_mm512_mul_ps(ty, e1z), _mm512_mul_ps(e1y, tz));
+		__m512 qy = _mm512_sub_ps(_mm512_mul_ps(tz, e1x), _mm512_mul_ps(e1z, tx));
+		__m512 qz = _mm512_sub_ps(_mm512_mul_ps(tx, e1y), _mm512_mul_ps(e1x, ty));
+		__m512 v = _mm512_div_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, qx), _mm512_mul_ps(dy, qy)), _mm512_mul_ps(dz, qz)), det);
+		mask = _mm512_mask_cmp_ps_mask(mask, v, zero, _CMP_GE_OQ);
+		mask = _mm512_mask_cmp_ps_mask(mask, _mm512_add_ps(u, v), one, _CMP_LE_OQ);
+		__m512 t = _mm512_div_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e2x, qx), _mm512_mul_ps(e2y, qy)), _mm512_mul_ps(e2z, qz)), det);
+		mask = _mm512_mask_cmp_ps_mask(mask, t, zero, _CMP_GE_OQ);
+		mask = _mm512_mask_cmp_ps_mask(mask, t, _mm512_set1_ps(tMax), _CMP_LT_OQ);
+		if (mask == 0) continue;
+
+		__m512 candidates = _mm512_mask_blend_ps(mask, miss, t);
+		__m512 nearest = _mm512_min_ps(candidates, _mm512_shuffle_f32x4(candidates, candidates, _MM_SHUFFLE(1, 0, 3, 2)));
+		nearest = _mm512_min_ps(nearest, _mm512_shuffle_f32x4(nearest, nearest, _MM_SHUFFLE(2, 3, 0, 1)));
+		nearest = _mm512_min_ps(nearest, _mm512_shuffle_ps(nearest, nearest, _MM_SHUFFLE(1, 0, 3, 2)));
+		nearest = _mm512_min_ps(nearest, _mm512_shuffle_ps(nearest, nearest, _MM_SHUFFLE(2, 3, 0, 1)));
+		int lane = __builtin_ctz(_mm512_mask_cmp_ps_mask(mask, candidates, nearest, _CMP_EQ_OQ));
+
+		float ts[16], us[16], vs[16];
+		_mm512_storeu_ps(ts, t);
+		_mm512_storeu_ps(us, u);
+		_mm512_storeu_ps(vs, v);
+		tMax = ts[lane];
+		hit.t = ts[lane];
+		hit.u = us[lane];
+		hit.v = vs[lane];
+		hit.triangle = triangles[lane];
+		found = true;
+	}
+	return found;
+}
+
+#endif
+
+// Dispatch
+// --------
+bool cpuHasAVX2()
+{
+#ifdef BLOCKS_X86_KERNELS
+	static const bool supported = __builtin_cpu_supports("avx2");
+	return supported;
+#else
+	return false;
+#endif
+}
+
+bool cpuHasAVX512()
+{
+#ifdef BLOCKS_X86_KERNELS
+	static const bool supported = __builtin_cpu_supports("avx512f");
+	return supported;
+#else
+	return false;
+#endif
+}
+
+int TriangleBlocks::hostWidth()
+{
+	return cpuHasAVX512() ? 16 : 8;
+}
+
+const char *TriangleBlocks::kernelName() const
+{
+#ifdef BLOCKS_X86_KERNELS
+	if (width == 16 && cpuHasAVX512()) return "AVX-512";
+	if (width == 8 && cpuHasAVX2()) return "AVX2";
+#endif
+	return "scalar";
+}
+
+bool TriangleBlocks::intersect(int firstBlock, int count, const glm::vec3 &orig, const glm::vec3 &dir, float tMax, BlockHit &hit) const
+{
+	const float *blockRows = &rows[(size_t)firstBlock * rowCount * width];
+	const int *blockTriangles = &triangles[(size_t)firstBlock * width];
+#ifdef BLOCKS_X86_KERNELS
+	if (width == 16 && cpuHasAVX512()) return intersectAVX512(blockRows, blockTriangles, count, orig, dir, tMax, hit);
+	if (width == 8 && cpuHasAVX2()) return intersectAVX2(blockRows, blockTriangles, count, orig, dir, tMax, hit);
+#endif
+	return intersectScalar(blockRows, blockTriangles, width, count, orig, dir, tMax, hit);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+
+#include <glm\glm.hpp>
+
+#include "ObjLoader.h"
+
+// Closest hit found in a run of blocks: distance, barycentrics of v1 and v2 and the mesh triangle
+struct BlockHit
+{
+	float t;
+	float u;
+	float v;
+	int triangle;
+};
+
+// TriangleBlocks packs triangles into blocks of width (8 or 16) for the CPU tracer, stored as structure of arrays:
+// per block 9 rows of width floats (v0 x, y, z, edge v1 - v0 x, y, z, edge v2 - v0 x, y, z) plus width triangle indices
+// One ray is tested against a whole block at once with AVX2 (8 lanes) or AVX-512 (16 lanes) and a masked min reduction
+// picks the nearest hit. The instruction set is picked at runtime, hosts without AVX2 use a scalar loop over the same layout
+// Unused lanes of a leaf's last block hold a degenerate triangle that never hits
+// See relevant source file for function descriptions
+class TriangleBlocks
+{
+public:
+	std::vector<float> rows;	   // 9 * width floats per block
+	std::vector<int> triangles; // width per block, -1 in unused lanes
+
+	int width;
+
+	TriangleBlocks() : width(hostWidth()) {}
+
+	void clear();
+	bool empty() const { return triangles.empty(); }
+	int blockCount(int triCount) const { return (triCount + width - 1) / width; }
+
+	// Appends count triangles (mesh triangle indices) as blockCount(count) new blocks, returns the first of them
+	int append(const Mesh &mesh, const unsigned int *tris, int count);
+
+	// Nearest hit of orig + t * dir with t < tMax among blocks [firstBlock, firstBlock + count), same test as rayTriDist
+	// in comp.glsl. Returns false (hit untouched) if there is none
+	bool intersect(int firstBlock, int count, const glm::vec3 &orig, const glm::vec3 &dir, float tMax, BlockHit &hit) const;
+
+	static int hostWidth();			 // 16 if the CPU (and OS) support AVX-512, 8 otherwise
+	const char *kernelName() const; // "AVX-512", "AVX2" or "scalar", whichever intersect() runs for this width on this CPU
+
+	static const int rowCount = 9;
+};
+
+// Whether the CPU and OS support the instruction sets the SIMD kernels are compiled for (always false off x86)
+bool cpuHasAVX2();
+bool cpuHasAVX512();
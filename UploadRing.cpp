@@ -0,0 +1,97 @@
+#include <cstring>
+
+#include <glad\glad.h>
+
+#include "UploadRing.h"
+
+// Constructor
+UploadRing::UploadRing(size_t regionSize) :
+	buffer(0), mapped(NULL), regionSize(regionSize), region(0), used(0), requested(0), lastFrame(0)
+{
+	for (int i = 0; i < regionCount; i++)
+		fences[i] = 0;
+	resetStats();
+	if (!GLAD_GL_VERSION_4_4) return; // no glBufferStorage, everything goes through glBufferSubData
+
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+	glBufferStorage(GL_COPY_READ_BUFFER, (GLsizeiptr)(regionSize * regionCount), NULL, flags);
+	mapped = (char *)glMapBufferRange(GL_COPY_READ_BUFFER, 0, (GLsizeiptr)(regionSize * regionCount), flags);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+}
+
+// Destructor
+UploadRing::~UploadRing()
+{
+	for (int i = 0; i < regionCount; i++)
+		if (fences[i]) glDeleteSync(fences[i]);
+	if (buffer == 0) return;
+	if (mapped)
+	{
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+		glUnmapBuffer(GL_COPY_READ_BUFFER);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	}
+	glDeleteBuffers(1, &buffer);
+}
+
+void UploadRing::beginFrame()
+{
+	used = 0;
+	requested = 0;
+	counters.frames++;
+	GLsync fence = fences[region];
+	if (!fence) return;
+
+	// the GPU may still be copying out of this region from regionCount frames ago
+	if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+	{
+		counters.fenceWaits++;
+		while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+	}
+	glDeleteSync(fence);
+	fences[region] = 0;
+}
+
+// Queues a copy of size bytes of data to offset in buffer, data can be reused as soon as this returns
+void UploadRing::upload(unsigned int buffer, size_t offset, const void *data, size_t size)
+{
+	requested = (requested + alignment - 1) / alignment * alignment + size;
+	size_t start = (used + alignment - 1) / alignment * alignment;
+	if (mapped == NULL || start + size > regionSize)
+	{
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)offset, (GLsizeiptr)size, data);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		counters.fallbackBytes += size;
+		return;
+	}
+
+	size_t ringOffset = region * regionSize + start;
+	memcpy(mapped + ringOffset, data, size); // coherent, the copy below sees it without a flush
+	glBindBuffer(GL_COPY_READ_BUFFER, this->buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (GLintptr)ringOffset, (GLintptr)offset, (GLsizeiptr)size);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	used = start + size;
+	counters.ringBytes += size;
+}
+
+void UploadRing::endFrame()
+{
+	if (mapped && used > 0) fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	region = (region + 1) % regionCount;
+	lastFrame = requested;
+	if (lastFrame > counters.peakFrameBytes) counters.peakFrameBytes = lastFrame;
+}
+
+void UploadRing::resetStats()
+{
+	counters.frames = 0;
+	counters.ringBytes = 0;
+	counters.fallbackBytes = 0;
+	counters.fenceWaits = 0;
+	counters.peakFrameBytes = 0;
+}
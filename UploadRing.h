@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+
+#include <glad\glad.h>
+
+// UploadRing streams per-frame data (moved vertices, refitted nodes, camera) into GPU buffers without stalling on them
+// One staging buffer is created with glBufferStorage and stays mapped (MAP_PERSISTENT | MAP_COHERENT), it is split into
+// regionCount regions used one frame after another. upload() copies the data into the frame's region and queues a
+// glCopyBufferSubData from there to the destination, endFrame() puts a fence after the frame's copies. The CPU only waits
+// on that fence when it comes back to the region regionCount frames later, so it can fill frame N + 2 while the GPU still
+// copies from frame N
+// Without OpenGL 4.4 (glBufferStorage) or when a frame's uploads don't fit its region, upload() falls back to glBufferSubData
+// The ring doesn't resize itself, Main.cpp sizes it from the bytes the frames actually ask for (see fitUploadRing)
+// See relevant source file for function descriptions
+class UploadRing
+{
+public:
+	UploadRing(size_t regionSize); // Constructor: Map regionCount regions of regionSize bytes
+	~UploadRing();				   // Destructor: Unmap and free the staging buffer, the GL context must still exist
+
+	void beginFrame(); // Waits until the GPU is done with the region the next frame writes to
+	void upload(unsigned int buffer, size_t offset, const void *data, size_t size);
+	void endFrame(); // Fences the frame's copies, the next beginFrame() moves on to the next region
+
+	bool persistent() const { return mapped != NULL; } // false if uploads go through glBufferSubData
+	size_t regionBytes() const { return regionSize; }
+	size_t lastFrameBytes() const { return lastFrame; } // bytes the last finished frame asked for (fallbacks and padding included)
+
+	// Uploads since the last resetStats()
+	struct Stats
+	{
+		size_t frames;
+		size_t ringBytes;	  // staged and copied
+		size_t fallbackBytes; // sent with glBufferSubData
+		size_t fenceWaits;	  // beginFrame() calls that had to wait for the GPU
+		size_t peakFrameBytes; // largest lastFrameBytes()
+	};
+
+	const Stats &stats() const { return counters; }
+	void resetStats();
+
+	static const int regionCount = 3;
+
+private:
+	UploadRing(const UploadRing &); // non-copyable, owns the mapping
+	UploadRing &operator=(const UploadRing &);
+
+	unsigned int buffer;
+	char *mapped;
+	size_t regionSize;
+	int region;	  // region of the current frame
+	size_t used;  // bytes of it written this frame
+	size_t requested; // bytes this frame asked for, whether they fit or not
+	size_t lastFrame;
+	GLsync fences[regionCount];
+
+	Stats counters;
+
+	static const size_t alignment = 16;
+};
@@ -0,0 +1,277 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <deque>
+
+#include "WideBVH.h"
+
+static inline glm::vec3 meshVertex(const Mesh &mesh, unsigned int i)
+{
+	return glm::vec3(mesh.positions[3 * (size_t)i], mesh.positions[3 * (size_t)i + 1], mesh.positions[3 * (size_t)i + 2]);
+}
+
+static inline void setByte(unsigned int *words, int index, unsigned int value)
+{
+	unsigned int shift = 8 * (index & 3);
+	words[index >> 2] = (words[index >> 2] & ~(0xffu << shift)) | (value << shift);
+}
+
+// Building
+// --------
+void WideBVH::build(const BVH &bvh, const Mesh &mesh)
+{
+	nodes.clear();
+	triIndices.clear();
+	childClusters.clear();
+	if (bvh.nodes.empty()) return;
+
+	// triangle range of every binary subtree (contiguous in triIndices), small subtrees are turned into leaves as a whole
+	subtreeFirst.assign(bvh.nodes.size(), 0);
+	subtreeCount.assign(bvh.nodes.size(), 0);
+	std::vector<std::pair<int, bool> > stack(1, std::make_pair(0, false)); // (node, children done)
+	while (!stack.empty())
+	{
+		std::pair<int, bool> item = stack.back();
+		stack.pop_back();
+
+		const BVHNode &node = bvh.nodes[item.first];
+		if (node.isLeaf())
+		{
+			subtreeFirst[item.first] = node.leftFirst;
+			subtreeCount[item.first] = node.count;
+		}
+		else if (item.second)
+		{
+			subtreeFirst[item.first] = std::min(subtreeFirst[node.leftFirst], subtreeFirst[node.leftFirst + 1]);
+			subtreeCount[item.first] = subtreeCount[node.leftFirst] + subtreeCount[node.leftFirst + 1];
+		}
+		else
+		{
+			stack.push_back(std::make_pair(item.first, true));
+			stack.push_back(std::make_pair(node.leftFirst, false));
+			stack.push_back(std::make_pair(node.leftFirst + 1, false));
+		}
+	}
+
+	Cluster root;
+	root.node = 0;
+	root.first = subtreeFirst[0];
+	root.count = subtreeCount[0];
+
+	// (wide node, cluster it covers), breadth-first so every node's interior children can be allocated next to each other
+	std::deque<std::pair<int, Cluster> > work;
+	nodes.push_back(WideNode());
+	childClusters.resize(width);
+	work.push_back(std::make_pair(0, root));
+
+	while (!work.empty())
+	{
+		int nodeIndex = work.front().first;
+		Cluster cluster = work.front().second;
+		work.pop_front();
+
+		// open the cluster, then keep opening the child with the largest box until there are width children
+		Cluster children[width];
+		AABB childBounds[width];
+		int childCount = 0;
+		if (cluster.isLeaf()) children[childCount++] = cluster; // a tiny mesh, the root is the only leaf
+		else
+		{
+			openCluster(cluster, bvh, children[0], children[1]);
+			childCount = 2;
+		}
+		for (int c = 0; c < childCount; c++)
+			childBounds[c] = clusterBounds(children[c], bvh, mesh);
+
+		while (childCount < width)
+		{
+			int largest = -1;
+			float largestArea = -1.0f;
+			for (int c = 0; c < childCount; c++)
+			{
+				if (children[c].isLeaf()) continue;
+				float area = childBounds[c].area();
+				if (area > largestArea)
+				{
+					largest = c;
+					largestArea = area;
+				}
+			}
+			if (largest < 0) break; // only leaves left
+
+			openCluster(children[largest], bvh, children[largest], children[childCount]);
+			childBounds[largest] = clusterBounds(children[largest], bvh, mesh);
+			childBounds[childCount] = clusterBounds(children[childCount], bvh, mesh);
+			childCount++;
+		}
+
+		WideNode node = WideNode();
+		node.childBase = (unsigned int)nodes.size();
+		node.triBase = (unsigned int)triIndices.size();
+
+		int interiorCount = 0;
+		for (int c = 0; c < childCount; c++)
+		{
+			if (children[c].isLeaf())
+			{
+				unsigned int offset = (unsigned int)triIndices.size() - node.triBase;
+				for (int t = children[c].first; t < children[c].first + children[c].count; t++)
+					triIndices.push_back(bvh.triIndices[t]);
+				setByte(node.meta, c, (unsigned int)children[c].count << 5 | offset);
+			}
+			else
+			{
+				setByte(node.meta, c, 0xe0u | (unsigned int)interiorCount);
+				work.push_back(std::make_pair((int)nodes.size(), children[c]));
+				nodes.push_back(WideNode());
+				childClusters.resize(childClusters.size() + width);
+				interiorCount++;
+			}
+		}
+
+		for (int c = childCount; c < width; c++)
+		{
+			children[c].node = -1;
+			children[c].first = 0;
+			children[c].count = 0;
+		}
+		std::copy(children, children + width, &childClusters[(size_t)nodeIndex * width]);
+
+		quantize(node, childBounds);
+		nodes[nodeIndex] = node;
+	}
+
+	std::vector<int>().swap(subtreeFirst);
+	std::vector<int>().swap(subtreeCount);
+}
+
+// Splits a cluster in two: an interior node into its children, an oversized leaf or range into halves
+void WideBVH::openCluster(const Cluster &cluster, const BVH &bvh, Cluster &a, Cluster &b) const
+{
+	if (cluster.node >= 0 && !bvh.nodes[cluster.node].isLeaf())
+	{
+		int left = bvh.nodes[cluster.node].leftFirst;
+		a.node = left;
+		a.first = subtreeFirst[left];
+		a.count = subtreeCount[left];
+		b.node = left + 1;
+		b.first = subtreeFirst[left + 1];
+		b.count = subtreeCount[left + 1];
+		return;
+	}
+
+	Cluster range = cluster; // a and b may alias cluster
+	int half = range.count / 2;
+	a.node = b.node = -1;
+	a.first = range.first;
+	a.count = half;
+	b.first = range.first + half;
+	b.count = range.count - half;
+}
+
+AABB WideBVH::clusterBounds(const Cluster &cluster, const BVH &bvh, const Mesh &mesh) const
+{
+	AABB bounds;
+	if (cluster.node >= 0)
+	{
+		bounds.min = bvh.nodes[cluster.node].boundsMin;
+		bounds.max = bvh.nodes[cluster.node].boundsMax;
+		return bounds;
+	}
+	for (int t = cluster.first; t < cluster.first + cluster.count; t++)
+	{
+		const unsigned int *tri = &mesh.indices[3 * (size_t)bvh.triIndices[t]];
+		bounds.grow(meshVertex(mesh, tri[0]));
+		bounds.grow(meshVertex(mesh, tri[1]));
+		bounds.grow(meshVertex(mesh, tri[2]));
+	}
+	return bounds;
+}
+
+// Picks the node's grid (origin at the children's min corner, the smallest power of two spacing that spans them in 255 steps)
+// and rounds every child box outwards onto it. Uses the same float operations as the dequantization in comp.glsl, so the
+// boxes the shader reconstructs are guaranteed to contain the real ones
+void WideBVH::quantize(WideNode &node, const AABB *childBounds) const
+{
+	AABB bounds;
+	for (int c = 0; c < width; c++)
+		if ((node.meta[c >> 2] >> (8 * (c & 3)) & 0xffu) != 0) bounds.grow(childBounds[c]);
+
+	node.origin = bounds.min;
+	node.exponents = 0;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float extent = bounds.max[axis] - bounds.min[axis];
+		int exponent = extent > 0.0f ? (int)std::ceil(std::log2(extent / 255.0f)) : -126;
+		exponent = std::max(-126, std::min(127, exponent));
+		while (exponent < 127 && bounds.min[axis] + 255.0f * std::ldexp(1.0f, exponent) < bounds.max[axis])
+			exponent++;
+		node.exponents |= (unsigned int)(exponent + 127) << (8 * axis);
+
+		float scale = std::ldexp(1.0f, exponent);
+		for (int c = 0; c < width; c++)
+		{
+			unsigned int qMin = 0, qMax = 0;
+			if ((node.meta[c >> 2] >> (8 * (c & 3)) & 0xffu) != 0)
+			{
+				float lo = std::floor((childBounds[c].min[axis] - node.origin[axis]) / scale);
+				float hi = std::ceil((childBounds[c].max[axis] - node.origin[axis]) / scale);
+				qMin = (unsigned int)std::max(0.0f, std::min(255.0f, lo));
+				qMax = (unsigned int)std::max(0.0f, std::min(255.0f, hi));
+				while (qMin > 0 && node.origin[axis] + (float)qMin * scale > childBounds[c].min[axis])
+					qMin--;
+				while (qMax < 255 && node.origin[axis] + (float)qMax * scale < childBounds[c].max[axis])
+					qMax++;
+			}
+			setByte(&node.quantMin[2 * axis], c, qMin);
+			setByte(&node.quantMax[2 * axis], c, qMax);
+		}
+	}
+}
+
+// Refitting
+// ---------
+void WideBVH::refit(const BVH &bvh, const Mesh &mesh, ThreadPool &pool, std::vector<unsigned char> &changedNodes)
+{
+	changedNodes.assign(nodes.size(), 0);
+	pool.parallelFor(nodes.size(), [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			AABB childBounds[width];
+			for (int c = 0; c < width; c++)
+			{
+				const Cluster &cluster = childClusters[i * width + c];
+				if (!cluster.isEmpty()) childBounds[c] = clusterBounds(cluster, bvh, mesh);
+			}
+
+			WideNode node = nodes[i];
+			quantize(node, childBounds);
+			if (memcmp(&node, &nodes[i], sizeof(WideNode)) != 0)
+			{
+				nodes[i] = node;
+				changedNodes[i] = 1;
+			}
+		}
+	});
+}
+
+// Statistics
+// ----------
+int WideBVH::depth() const
+{
+	if (nodes.empty()) return 0;
+
+	// nodes are allocated breadth-first, every parent comes before its children
+	std::vector<int> levels(nodes.size(), 1);
+	int maxDepth = 1;
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		maxDepth = std::max(maxDepth, levels[i]);
+		for (int c = 0; c < width; c++)
+		{
+			unsigned int meta = (nodes[i].meta[c >> 2] >> (8 * (c & 3))) & 0xffu;
+			if (meta >= 0xe0u) levels[nodes[i].childBase + (meta & 7u)] = levels[i] + 1;
+		}
+	}
+	return maxDepth;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+
+#include <glm\glm.hpp>
+
+#include "ObjLoader.h"
+#include "ThreadPool.h"
+#include "BVH.h"
+
+// One node of the 8-wide BVH, laid out to match the std430 WideNode struct in comp.glsl (80 bytes)
+// Child boxes are stored as 8-bit offsets on a per-axis grid starting at origin with a power of two spacing, rounded outwards
+// so the dequantized boxes always contain the real ones. Per child, meta holds one byte:
+//     0                    empty slot
+//     count << 5 | offset  leaf, count (1 to 3) triangles starting at triBase + offset
+//     0xe0 | rank          interior, the child node is childBase + rank
+struct WideNode
+{
+	glm::vec3 origin;
+	unsigned int exponents;	  // grid spacing per axis, a biased float exponent per byte (x, y, z)
+	unsigned int childBase;	  // first interior child, interior children are stored next to each other
+	unsigned int triBase;	  // first triangle of the leaf children, leaves' triangles are stored next to each other
+	unsigned int meta[2];	  // one byte per child, children 0-3 then 4-7
+	unsigned int quantMin[6]; // one byte per child: x (children 0-3, 4-7), then y, then z
+	unsigned int quantMax[6];
+};
+
+// WideBVH is an 8-wide version of a BVH with quantized child bounds, about a third of the size of the binary nodes it
+// replaces and fetched in far fewer round trips per ray (one node gives the boxes of up to 8 children)
+// It is made by collapsing a binary BVH: every wide node opens its binary subtree, largest box first, until it has 8
+// children. Binary leaves with more than maxLeafSize triangles are split into ranges on the way
+// See relevant source file for function descriptions
+class WideBVH
+{
+public:
+	std::vector<WideNode> nodes;		  // root at index 0
+	std::vector<unsigned int> triIndices; // mesh triangle indices in leaf order (differs from the binary BVH's)
+
+	static const int width = 8;
+	static const int maxLeafSize = 3;
+
+	void build(const BVH &bvh, const Mesh &mesh);
+
+	// Requantizes every node after bvh has been refitted to moved vertices, keeping the structure (and triIndices) as is
+	// changedNodes[i] is set to 1 for the nodes whose bytes changed, 0 for the rest
+	void refit(const BVH &bvh, const Mesh &mesh, ThreadPool &pool, std::vector<unsigned char> &changedNodes);
+
+	int depth() const; // Wide nodes on the longest root to leaf path (leaf children are part of their node)
+
+private:
+	// A piece of the binary BVH: a node's subtree (node >= 0) or a range of an oversized leaf's triangles (node == -1)
+	// Either way it covers the triangles [first, first + count) of the binary BVH's triIndices, empty child slots have count == 0
+	struct Cluster
+	{
+		int node;
+		int first;
+		int count;
+
+		bool isLeaf() const { return count > 0 && count <= maxLeafSize; } // becomes a leaf child as a whole
+		bool isEmpty() const { return count == 0; }
+	};
+
+	std::vector<Cluster> childClusters; // width per wide node, what each child slot was made from (kept for refit())
+	std::vector<int> subtreeFirst;		// per binary node, only alive during build()
+	std::vector<int> subtreeCount;
+
+	AABB clusterBounds(const Cluster &cluster, const BVH &bvh, const Mesh &mesh) const;
+	void openCluster(const Cluster &cluster, const BVH &bvh, Cluster &a, Cluster &b) const;
+	void quantize(WideNode &node, const AABB *childBounds) const;
+};
@@ -1,51 +1,256 @@
 #version 430 core
 
-layout (local_size_x = 1, local_size_y = 1) in;
+// CompShader injects the workgroup shape Main.cpp picked for this GPU (see autotuneWorkgroup)
+#ifndef LOCAL_SIZE_X
+#define LOCAL_SIZE_X 8
+#define LOCAL_SIZE_Y 8
+#endif
+layout (local_size_x = LOCAL_SIZE_X, local_size_y = LOCAL_SIZE_Y) in; // one workgroup per tile of pixels
+
+// Modes are compiled in rather than read from uniforms: CompShader builds one program per combination Main.cpp asks for
+// (see kernelDefines), so the traversal loops don't branch on them. These are the defaults for compiling the file as is
+#ifndef USE_BVH
+#define USE_BVH 1	   // 0 tests every triangle (for benchmarking)
+#endif
+#ifndef WIDE_BVH
+#define WIDE_BVH 0	   // 1 traces the 8-wide BVH
+#endif
+#ifndef TILE_CULLING
+#define TILE_CULLING 1 // 1 culls the scene per workgroup tile first
+#endif
+#ifndef BOUNCES
+#define BOUNCES 0	   // reflections per pixel in the wavefront stages
+#endif
+#ifndef BVH_STACK_SIZE
+#define BVH_STACK_SIZE 64 // traversal stack entries, Main.cpp sizes it to the deepest tree of the scene
+#endif
+#ifndef WIDE_STACK_SIZE
+#define WIDE_STACK_SIZE 96 // same for the 8-wide trees
+#endif
 layout (rgba32f, binding = 0) uniform image2D framebuffer;
 
 const float epsilon = 0.000001;
 
-uniform vec3 bgColor;
-
-uniform vec3 camPos;
-uniform vec3 camFront;
-uniform vec3 camRight;
-uniform vec3 camUp;
-uniform vec3 camLight;
+// Camera and background, one uniform buffer shared by every variant of the kernel (GPUCamera in Main.cpp), Main.cpp only
+// rewrites it when the camera moved
+layout (std140, binding = 0) uniform Camera
+{
+	vec3 bgColor;
+	vec3 camPos;
+	vec3 camFront;
+	vec3 camRight;
+	vec3 camUp;
+	vec3 camLight;
+};
 
 vec3 lightSource1 = vec3(1,1,1);
 
 // Shape
-const int numShapeVerts = 12; // vertex count
-const vec3 shape[numShapeVerts] = {
-	// 0xz
-	vec3(0,0,0),
-	vec3(1,0,0),
-	vec3(0,0,1),
-	// 0zy
-	vec3(0,0,0),
-	vec3(0,0,1),
-	vec3(0,1,0),
-	// 0yx
-	vec3(0,0,0),
-	vec3(0,1,0),
-	vec3(1,0,0),
-	// xyz
-	vec3(1,0,0),
-	vec3(0,1,0),
-	vec3(0,0,1),
+// one intersection record per triangle in object space, precomputed from the vertex and index buffers by tri_records.glsl
+// every unique mesh of the scene is stored once, one after another, each in its BVH's leaf order
+// structure of arrays of floats, 9 planes of one float per triangle: v0.x, v0.y, v0.z, then v1 - v0 and v2 - v0 the same way
+layout (std430, binding = 1) readonly buffer TriangleRecords
+{
+	float triRecords[];
+};
+
+// part 0 is triangle tri's v0, part 1 its v1 - v0 and part 2 its v2 - v0
+vec3 triRecord(int part, int tri)
+{
+	int stride = triRecords.length() / 9;
+	return vec3(triRecords[(3 * part) * stride + tri], triRecords[(3 * part + 1) * stride + tri], triRecords[(3 * part + 2) * stride + tri]);
+}
+
+// closest hit found so far along a ray
+struct Hit
+{
+	float t;
+	float u; // barycentrics of the hit point
+	float v;
+	bool backFacing;
+	int tri;	  // index into the records, -1 if nothing was hit
+	int instance; // the instance the triangle was hit through
+};
+
+// Bounding volume hierarchies (see BVH.h for the layout)
+// interior nodes: count == 0, children at leftFirst and leftFirst+1
+// leaves: count > 0, triangles (or instances in the top level) leftFirst .. leftFirst+count-1
+struct BVHNode
+{
+	vec3 boundsMin;
+	int leftFirst;
+	vec3 boundsMax;
+	int count;
+};
+
+// one BVH per unique mesh, one after another, indices are already global
+layout (std430, binding = 2) readonly buffer BVHBuffer
+{
+	BVHNode nodes[];
+};
+
+// 8-wide version of BVHBuffer with quantized child boxes (see WideBVH.h for the layout), used instead of it when useWideBVH is set
+struct WideNode
+{
+	vec3 origin;
+	uint exponents;	  // grid spacing per axis as biased float exponents, one byte each
+	uint childBase;	  // first interior child
+	uint triBase;	  // first triangle of the leaf children
+	uint meta[2];	  // per child byte: 0 empty, count << 5 | offset for leaves, 0xe0 | rank for interior children
+	uint quantMin[6]; // per child byte: x (children 0-3, 4-7), y, z
+	uint quantMax[6];
+};
+
+layout (std430, binding = 5) readonly buffer WideBVHBuffer
+{
+	WideNode wideNodes[];
+};
+
+const bool useWideBVH = WIDE_BVH != 0;
+
+// top-level BVH over the instances
+layout (std430, binding = 3) readonly buffer TLASBuffer
+{
+	BVHNode tlasNodes[];
+};
+
+// Instance: places one mesh in the world, rays are moved into the mesh's space instead (see Scene.h)
+struct Instance
+{
+	vec4 worldToObject[3]; // rows of the 3x4 world to object transform
+	int rootNode;		   // root of the mesh's BVH in nodes[]
+	int firstTriangle;	   // the mesh's triangles in indices
+	int triangleCount;
+	int mirrored;		   // transform flips handedness, front and back faces swap
+};
+
+// in the top-level BVH's leaf order
+layout (std430, binding = 4) readonly buffer InstanceBuffer
+{
+	Instance instances[];
 };
 
+const bool useBVH = USE_BVH != 0; // false tests every triangle (for benchmarking)
+
+// Tile culling
+// with useTileCulling the first invocation of every workgroup walks the top-level BVH with the frustum around the tile's rays
+// once for the whole tile (see cullScene in Scene.h), the tile's rays then only trace the instances it collected
+const bool useTileCulling = TILE_CULLING != 0;
+
+const int maxTileInstances = 32;
+shared int tileInstances[maxTileInstances];
+shared int tileInstanceCount; // -1 if the tile sees more than maxTileInstances, its rays trace the whole scene then
+
+// Wavefront bounces
+// with reflections Main.cpp renders a frame as a sequence of dispatches instead of one: stage 1 queues every pixel's primary
+// ray, then per bounce stage 2 traces the queue into the hit buffer and stage 3 shades the hits, adding their color to the
+// pixels and appending the reflected rays to the next queue. Queues are filled through atomic counters so they stay compact,
+// before every bounce stage 4 turns the queue's length into the workgroup counts stages 2 and 3 are dispatched with
+// (glDispatchComputeIndirect), so each bounce only launches the workgroups its rays need
+uniform int stage;	 // 0 traces and shades whole pixels (no bounces), 1 queues primary rays, 2 traces the queue, 3 shades it,
+					 // 4 sizes the dispatches of 2 and 3
+uniform int bounce;	 // what the queued rays are: 0 primary, 1 first reflection, ...
+const int bounces = BOUNCES; // reflections per pixel, the last bounce's hits don't reflect any more
+uniform float reflectivity; // share of a hit's color that comes from its reflection
+
+struct QueuedRay
+{
+	vec3 orig;
+	float pathLength; // distance travelled before orig, the shading falls off with the whole path like the primary rays'
+	vec3 dir;
+	int pixel;		  // y * width + x
+	vec3 weight;	  // share of the pixel's color the ray carries
+	float pad;
+};
+
+struct QueuedHit
+{
+	float t;
+	int tri;
+	int instance;
+	int backFacing;
+};
+
+layout (std430, binding = 8) buffer RayQueue
+{
+	QueuedRay queuedRays[];
+};
+
+layout (std430, binding = 9) buffer NextRayQueue
+{
+	QueuedRay nextRays[];
+};
+
+layout (std430, binding = 10) buffer HitBuffer
+{
+	QueuedHit queuedHits[]; // one per queued ray
+};
+
+// DispatchIndirectCommand of stages 2 and 3: workgroups in x, y and z
+layout (std430, binding = 11) writeonly buffer QueueDispatch
+{
+	uint queueDispatch[3];
+};
+
+layout (binding = 0, offset = 0) uniform atomic_uint queueLength;
+layout (binding = 1, offset = 0) uniform atomic_uint nextQueueLength;
+
+const uint maxDispatchWidth = 65535u; // GL_MAX_COMPUTE_WORK_GROUP_COUNT's guaranteed minimum per dimension
+
+const float bounceOffset = 0.0001; // reflected rays start this far off the surface so they don't hit it again
+
+const float noHit = 1e30;
+const int bvhStackSize = BVH_STACK_SIZE; // at least the depth of the top-level and every mesh BVH, no node is ever dropped
+const int wideStackSize = WIDE_STACK_SIZE; // up to 7 entries per level of the deepest wide tree
+
 vec3 castRay(vec3 orig, vec3 dir);
-bool rayTriDist(vec3 orig, vec3 dir, vec3 v0, vec3 v0, vec3 v2, out float t);
-bool rayTriInter(vec3 orig, vec3 dir, vec3 v0, vec3 v0, vec3 v2, out float t, out float u, out float v, out bool backFacing);
+void queuePrimaryRay();
+void traceQueued();
+void shadeQueued();
+void sizeQueueDispatch();
+uint queueIndex();
+vec3 lensPoint(vec2 pixel, ivec2 size);
+void cullTile(ivec2 tileMin, ivec2 tileMax, ivec2 size);
+void frustumPlanes(vec3 points[8], out vec4 planes[5]);
+bool frustumOverlaps(vec4 planes[5], vec3 boxMin, vec3 boxMax);
+void closestTriScene(vec3 orig, vec3 dir, inout Hit hit);
+void closestTriTile(vec3 orig, vec3 dir, inout Hit hit);
+bool closestTriBVH(vec3 orig, vec3 dir, int root, inout Hit hit);
+bool closestTriWide(vec3 orig, vec3 dir, int root, inout Hit hit);
+void toObjectSpace(int instance, vec3 orig, vec3 dir, out vec3 objOrig, out vec3 objDir);
+float rayBoxDist(vec3 orig, vec3 invDir, vec3 boxMin, vec3 boxMax, float tMax);
+bool rayTriHit(vec3 orig, vec3 dir, int tri, inout Hit hit);
 
 void main() {
+	// stage is the same for the whole dispatch, returning here can't leave anyone waiting at the barrier below
+	if (stage == 1) queuePrimaryRay();
+	if (stage == 2) traceQueued();
+	if (stage == 3) shadeQueued();
+	if (stage == 4) sizeQueueDispatch();
+	if (stage != 0) return;
+
 	ivec2 pixelCoord = ivec2(gl_GlobalInvocationID.xy);
 	ivec2 size = imageSize(framebuffer);
+
+	// the whole workgroup waits for the cull, so no invocation may return before the barrier
+	bool culling = useTileCulling && useBVH;
+	if (culling && gl_LocalInvocationIndex == 0)
+	{
+		ivec2 tileMin = ivec2(gl_WorkGroupID.xy * gl_WorkGroupSize.xy);
+		ivec2 tileMax = min(tileMin + ivec2(gl_WorkGroupSize.xy) - 1, size - 1);
+		cullTile(tileMin, tileMax, size);
+	}
+	memoryBarrierShared();
+	barrier();
+
 	if (pixelCoord.x >= size.x || pixelCoord.y >= size.y) return;
-	vec2 posOnLens = pixelCoord / vec2(size.x - 1, size.y - 1) - vec2(0.5); // scale to between -1 and +1
-	vec3 orig = camPos + posOnLens.x * camRight + posOnLens.y * camUp; // position of pixel in 3D space
+	if (culling && tileInstanceCount == 0)
+	{
+		// nothing in view, every ray would miss
+		imageStore(framebuffer, pixelCoord, vec4(bgColor, 1.0f));
+		return;
+	}
+	vec3 orig = lensPoint(pixelCoord, size); // position of pixel in 3D space
 	vec3 dir = normalize(orig - camLight); // light ray direction
 
 	// determing new color
@@ -56,83 +261,495 @@ void main() {
 
 vec3 castRay(vec3 orig, vec3 dir)
 {
-	bool inter;
-	int i, i_closest;
-	bool backFacing;
-	float t = 1000000, t_temp;
-	float u;
-	float v;
-	// ASSUME TRIANGLES ARE GROUPS OF 3 VERTICES
-	for (i = 0; i < numShapeVerts - 2; i += 3)
+	Hit hit;
+	hit.t = 1000000;
+	hit.tri = -1;
+	hit.instance = -1;
+	vec3 objOrig, objDir;
+	if (useBVH)
+	{
+		if (useTileCulling && tileInstanceCount >= 0) closestTriTile(orig, dir, hit);
+		else closestTriScene(orig, dir, hit);
+	}
+	else
 	{
-		inter = rayTriDist(orig, dir, shape[i], shape[i+1], shape[i+2], t_temp);
-		if (inter && t_temp < t)
+		// every triangle of every instance
+		for (int instance = 0; instance < instances.length(); instance++)
 		{
-			t = t_temp;
-			i_closest = i;
+			toObjectSpace(instance, orig, dir, objOrig, objDir);
+			int first = instances[instance].firstTriangle;
+			for (int tri = first; tri < first + instances[instance].triangleCount; tri++)
+				if (rayTriHit(objOrig, objDir, tri, hit)) hit.instance = instance;
 		}
 	}
-	// againt at index of closest intersection to orig
-	inter = rayTriInter(orig, dir, shape[i_closest], shape[i_closest+1], shape[i_closest+2], t, u, v, backFacing);
-	// inter stores if intersection occured
-	// intersection is stored at t,u,v
-	// index of first of 3 vertices of intersection with shape is i
-	if (inter)
+	if (hit.tri < 0) return bgColor;
+	// the hit already holds t, u, v and the facing in the space of the instance that was hit (t is the same in both)
+	bool backFacing = hit.backFacing;
+	if (instances[hit.instance].mirrored != 0) backFacing = !backFacing;
+	if (!backFacing) return vec3(1,1,1)/max((hit.t*hit.t),1);
+	else return vec3(0,0,0);
+}
+
+// Stage 1: clears the pixel and queues its primary ray
+void queuePrimaryRay()
+{
+	ivec2 pixelCoord = ivec2(gl_GlobalInvocationID.xy);
+	ivec2 size = imageSize(framebuffer);
+	if (pixelCoord.x >= size.x || pixelCoord.y >= size.y) return;
+	imageStore(framebuffer, pixelCoord, vec4(0, 0, 0, 1.0f));
+
+	QueuedRay ray;
+	ray.orig = lensPoint(pixelCoord, size);
+	ray.pathLength = 0;
+	ray.dir = normalize(ray.orig - camLight);
+	ray.pixel = pixelCoord.y * size.x + pixelCoord.x;
+	ray.weight = vec3(1, 1, 1);
+	ray.pad = 0;
+	nextRays[atomicCounterIncrement(nextQueueLength)] = ray;
+}
+
+// Queue entry of this invocation: the workgroups of the dispatch one after another, one entry per invocation, so the rays a
+// workgroup traces together were queued next to each other
+uint queueIndex()
+{
+	uint group = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+	return group * gl_WorkGroupSize.x * gl_WorkGroupSize.y + gl_LocalInvocationIndex;
+}
+
+// Stage 4, dispatched as a single workgroup: one invocation writes how many workgroups cover the queue, in rows of at most
+// maxDispatchWidth (queueIndex numbers them row by row). An empty queue gets no rows, stages 2 and 3 then launch nothing
+void sizeQueueDispatch()
+{
+	if (gl_LocalInvocationIndex != 0u) return;
+
+	uint groupInvocations = gl_WorkGroupSize.x * gl_WorkGroupSize.y;
+	uint groups = (atomicCounter(queueLength) + groupInvocations - 1u) / groupInvocations;
+	uint width = max(min(groups, maxDispatchWidth), 1u);
+	queueDispatch[0] = width;
+	queueDispatch[1] = (groups + width - 1u) / width;
+	queueDispatch[2] = 1u;
+}
+
+// Stage 2: closest hit of a queued ray into the hit buffer
+void traceQueued()
+{
+	uint index = queueIndex();
+	if (index >= atomicCounter(queueLength)) return;
+
+	QueuedRay ray = queuedRays[index];
+	Hit hit;
+	hit.t = 1000000;
+	hit.tri = -1;
+	hit.instance = -1;
+	hit.backFacing = false;
+	closestTriScene(ray.orig, ray.dir, hit);
+	queuedHits[index] = QueuedHit(hit.t, hit.tri, hit.instance, hit.backFacing ? 1 : 0);
+}
+
+// Stage 3: adds the color of a queued ray's hit to its pixel (castRay's shading, over the whole path) and queues the
+// reflected ray unless this is the last bounce. The pixel has no other ray in this queue, nothing else writes to it
+void shadeQueued()
+{
+	uint index = queueIndex();
+	if (index >= atomicCounter(queueLength)) return;
+
+	QueuedRay ray = queuedRays[index];
+	QueuedHit hit = queuedHits[index];
+	vec3 color = bgColor;
+	if (hit.tri >= 0)
 	{
-		if (!backFacing) return vec3(1,1,1)/max((t*t),1);
-		else return vec3(0,0,0);
+		bool backFacing = hit.backFacing != 0;
+		if (instances[hit.instance].mirrored != 0) backFacing = !backFacing;
+		float dist = ray.pathLength + hit.t;
+		color = backFacing ? vec3(0,0,0) : vec3(1,1,1)/max(dist*dist,1);
+
+		if (bounce < bounces && reflectivity > 0)
+		{
+			color *= 1 - reflectivity;
+
+			// normals go from object to world space with the transpose of worldToObject
+			vec3 objNormal = cross(triRecord(1, hit.tri), triRecord(2, hit.tri));
+			vec3 normal = normalize(instances[hit.instance].worldToObject[0].xyz * objNormal.x +
+									instances[hit.instance].worldToObject[1].xyz * objNormal.y +
+									instances[hit.instance].worldToObject[2].xyz * objNormal.z);
+			if (dot(normal, ray.dir) > 0) normal = -normal; // the side the ray came from
+
+			QueuedRay reflected;
+			reflected.orig = ray.orig + hit.t * ray.dir + bounceOffset * normal;
+			reflected.pathLength = dist;
+			reflected.dir = reflect(ray.dir, normal);
+			reflected.pixel = ray.pixel;
+			reflected.weight = ray.weight * reflectivity;
+			reflected.pad = 0;
+			nextRays[atomicCounterIncrement(nextQueueLength)] = reflected;
+		}
 	}
-	else return bgColor;
+
+	ivec2 size = imageSize(framebuffer);
+	ivec2 pixelCoord = ivec2(ray.pixel % size.x, ray.pixel / size.x);
+	imageStore(framebuffer, pixelCoord, imageLoad(framebuffer, pixelCoord) + vec4(ray.weight * color, 0));
 }
 
-bool rayTriDist(vec3 orig, vec3 dir, vec3 v0, vec3 v1, vec3 v2, out float t)
+// Position of pixel (x, y) on the lens, x and y don't need to be whole pixels
+vec3 lensPoint(vec2 pixel, ivec2 size)
 {
-	vec3 v0v1 = v1 - v0;
-	vec3 v0v2 = v2 - v0;
-	vec3 pvec = cross(dir,v0v2);
-	float det = dot(v0v1,pvec);
+	vec2 posOnLens = pixel / vec2(size.x - 1, size.y - 1) - vec2(0.5); // scale to between -1 and +1
+	return camPos + posOnLens.x * camRight + posOnLens.y * camUp;
+}
 
-	// assume ray and triangle parallel if triple-scalar-product (det) small enough FRONT CULLING
-	if (abs(det) < epsilon) return false;
+// Collects the instances the frustum around the rays of pixels tileMin .. tileMax may see into tileInstances, like cullScene
+// The frustum is widened by half a pixel on every side and kept as points (light, the four corners on the lens, three points
+// spanning the lens) so it can be moved into each instance's object space and tested against its mesh's root box there
+void cullTile(ivec2 tileMin, ivec2 tileMax, ivec2 size)
+{
+	vec3 points[8];
+	points[0] = camLight;
+	points[1] = lensPoint(vec2(tileMin.x - 0.5, tileMin.y - 0.5), size);
+	points[2] = lensPoint(vec2(tileMax.x + 0.5, tileMin.y - 0.5), size);
+	points[3] = lensPoint(vec2(tileMax.x + 0.5, tileMax.y + 0.5), size);
+	points[4] = lensPoint(vec2(tileMin.x - 0.5, tileMax.y + 0.5), size);
+	points[5] = camPos;
+	points[6] = camPos + camRight;
+	points[7] = camPos + camUp;
+	vec4 planes[5];
+	frustumPlanes(points, planes);
 
-	vec3 tvec = orig - v0;
-	float u = dot(tvec,pvec) / det;
-	if (u < 0 || u > 1) return false;
+	tileInstanceCount = 0;
+	int stack[bvhStackSize];
+	int sp = 0;
+	stack[sp++] = 0;
+	while (sp > 0)
+	{
+		BVHNode node = tlasNodes[stack[--sp]];
+		if (!frustumOverlaps(planes, node.boundsMin, node.boundsMax)) continue;
+		if (node.count == 0)
+		{
+			if (sp + 2 > bvhStackSize)
+			{
+				tileInstanceCount = -1;
+				return;
+			}
+			stack[sp++] = node.leftFirst;
+			stack[sp++] = node.leftFirst + 1;
+			continue;
+		}
 
-	vec3 qvec = cross(tvec,v0v1);
-	float v = dot(dir,qvec) / det;
-	if (v < 0 || u + v > 1) return false;
+		for (int inst = node.leftFirst; inst < node.leftFirst + node.count; inst++)
+		{
+			// wide nodes only keep quantized child boxes, there is no root box to test, the top-level box has to do
+			if (!useWideBVH)
+			{
+				vec4 row0 = instances[inst].worldToObject[0];
+				vec4 row1 = instances[inst].worldToObject[1];
+				vec4 row2 = instances[inst].worldToObject[2];
+				vec3 objPoints[8];
+				for (int i = 0; i < 8; i++)
+					objPoints[i] = vec3(dot(row0, vec4(points[i], 1)), dot(row1, vec4(points[i], 1)), dot(row2, vec4(points[i], 1)));
+				vec4 objPlanes[5];
+				frustumPlanes(objPoints, objPlanes);
+				BVHNode root = nodes[instances[inst].rootNode];
+				if (!frustumOverlaps(objPlanes, root.boundsMin, root.boundsMax)) continue;
+			}
+			if (tileInstanceCount == maxTileInstances)
+			{
+				tileInstanceCount = -1;
+				return;
+			}
+			tileInstances[tileInstanceCount++] = inst;
+		}
+	}
+}
+
+// The four side planes and the lens plane of the frustum given by cullTile's points, same as Frustum::computePlanes
+// inside where dot(plane.xyz, p) + plane.w >= 0, a point on the middle ray in front of the lens decides the orientation
+void frustumPlanes(vec3 points[8], out vec4 planes[5])
+{
+	vec3 apex = points[0];
+	vec3 inside = 0.5 * (points[1] + points[2] + points[3] + points[4]) - apex;
+	for (int i = 0; i < 4; i++)
+	{
+		vec3 normal = cross(points[1 + i] - apex, points[1 + (i + 1) % 4] - apex);
+		planes[i] = vec4(normal, -dot(normal, apex));
+	}
+	vec3 lensNormal = cross(points[6] - points[5], points[7] - points[5]);
+	planes[4] = vec4(lensNormal, -dot(lensNormal, points[5]));
 
-	t = dot(v0v2,qvec) / det;
-	if (t < 0) return false;
+	for (int i = 0; i < 5; i++)
+		if (dot(planes[i].xyz, inside) + planes[i].w < 0) planes[i] = -planes[i];
+}
 
+// False if the box is entirely behind one of the planes, boxes near the frustum's edges may give false positives
+bool frustumOverlaps(vec4 planes[5], vec3 boxMin, vec3 boxMax)
+{
+	for (int i = 0; i < 5; i++)
+	{
+		vec3 farthest = mix(boxMin, boxMax, greaterThanEqual(planes[i].xyz, vec3(0))); // the box corner farthest inside
+		if (dot(planes[i].xyz, farthest) + planes[i].w < 0) return false;
+	}
 	return true;
 }
 
-bool rayTriInter(vec3 orig, vec3 dir, vec3 v0, vec3 v1, vec3 v2, out float t, out float u, out float v, out bool backFacing)
+// Moves a world space ray into the instance's object space, objDir isn't normalized so distances along the ray stay the same
+void toObjectSpace(int instance, vec3 orig, vec3 dir, out vec3 objOrig, out vec3 objDir)
 {
-	vec3 v0v1 = v1 - v0;
-	vec3 v0v2 = v2 - v0;
+	vec4 row0 = instances[instance].worldToObject[0];
+	vec4 row1 = instances[instance].worldToObject[1];
+	vec4 row2 = instances[instance].worldToObject[2];
+	objOrig = vec3(dot(row0, vec4(orig, 1)), dot(row1, vec4(orig, 1)), dot(row2, vec4(orig, 1)));
+	objDir = vec3(dot(row0.xyz, dir), dot(row1.xyz, dir), dot(row2.xyz, dir));
+}
+
+// Walks the top-level BVH nearest child first and, for every instance box the ray enters, the instance's mesh BVH in object space
+// hit is updated to the closest triangle closer than hit.t, if any, and the instance it belongs to
+void closestTriScene(vec3 orig, vec3 dir, inout Hit hit)
+{
+	vec3 invDir = 1.0 / dir;
+
+	int stack[bvhStackSize];
+	float stackDist[bvhStackSize];
+	int sp = 0;
+
+	int nodeIndex = 0;
+	if (rayBoxDist(orig, invDir, tlasNodes[0].boundsMin, tlasNodes[0].boundsMax, hit.t) == noHit) return;
+	while (true)
+	{
+		BVHNode node = tlasNodes[nodeIndex];
+		if (node.count > 0)
+		{
+			// leaf: trace the instances' meshes
+			for (int inst = node.leftFirst; inst < node.leftFirst + node.count; inst++)
+			{
+				vec3 objOrig, objDir;
+				toObjectSpace(inst, orig, dir, objOrig, objDir);
+				int root = instances[inst].rootNode;
+				bool closer = useWideBVH ? closestTriWide(objOrig, objDir, root, hit) : closestTriBVH(objOrig, objDir, root, hit);
+				if (closer) hit.instance = inst;
+			}
+		}
+		else
+		{
+			int nearChild = node.leftFirst;
+			int farChild = node.leftFirst + 1;
+			float nearDist = rayBoxDist(orig, invDir, tlasNodes[nearChild].boundsMin, tlasNodes[nearChild].boundsMax, hit.t);
+			float farDist = rayBoxDist(orig, invDir, tlasNodes[farChild].boundsMin, tlasNodes[farChild].boundsMax, hit.t);
+			if (farDist < nearDist)
+			{
+				int tmpIndex = nearChild; nearChild = farChild; farChild = tmpIndex;
+				float tmpDist = nearDist; nearDist = farDist; farDist = tmpDist;
+			}
+			if (nearDist != noHit)
+			{
+				if (farDist != noHit)
+				{
+					stack[sp] = farChild;
+					stackDist[sp] = farDist;
+					sp++;
+				}
+				nodeIndex = nearChild;
+				continue;
+			}
+		}
+
+		do
+		{
+			if (sp == 0) return;
+			sp--;
+		} while (stackDist[sp] > hit.t);
+		nodeIndex = stack[sp];
+	}
+}
+
+// closestTriScene over the instances cullTile collected for this tile, without walking the top-level BVH
+void closestTriTile(vec3 orig, vec3 dir, inout Hit hit)
+{
+	for (int i = 0; i < tileInstanceCount; i++)
+	{
+		int inst = tileInstances[i];
+		vec3 objOrig, objDir;
+		toObjectSpace(inst, orig, dir, objOrig, objDir);
+		int root = instances[inst].rootNode;
+		bool closer = useWideBVH ? closestTriWide(objOrig, objDir, root, hit) : closestTriBVH(objOrig, objDir, root, hit);
+		if (closer) hit.instance = inst;
+	}
+}
+
+// Walks the mesh BVH starting at root nearest child first, hit is updated to the closest triangle closer than hit.t
+// Returns true if there was one
+bool closestTriBVH(vec3 orig, vec3 dir, int root, inout Hit hit)
+{
+	vec3 invDir = 1.0 / dir;
+	bool closer = false;
+
+	int stack[bvhStackSize];
+	float stackDist[bvhStackSize]; // entry distance of every stacked node, lets us skip nodes behind a closer hit
+	int sp = 0;
+
+	int nodeIndex = root;
+	if (rayBoxDist(orig, invDir, nodes[root].boundsMin, nodes[root].boundsMax, hit.t) == noHit) return false;
+	while (true)
+	{
+		BVHNode node = nodes[nodeIndex];
+		if (node.count > 0)
+		{
+			// leaf: test its triangles
+			for (int tri = node.leftFirst; tri < node.leftFirst + node.count; tri++)
+				if (rayTriHit(orig, dir, tri, hit)) closer = true;
+		}
+		else
+		{
+			// interior: descend into the nearer child, remember the farther one
+			int nearChild = node.leftFirst;
+			int farChild = node.leftFirst + 1;
+			float nearDist = rayBoxDist(orig, invDir, nodes[nearChild].boundsMin, nodes[nearChild].boundsMax, hit.t);
+			float farDist = rayBoxDist(orig, invDir, nodes[farChild].boundsMin, nodes[farChild].boundsMax, hit.t);
+			if (farDist < nearDist)
+			{
+				int tmpIndex = nearChild; nearChild = farChild; farChild = tmpIndex;
+				float tmpDist = nearDist; nearDist = farDist; farDist = tmpDist;
+			}
+			if (nearDist != noHit)
+			{
+				if (farDist != noHit)
+				{
+					stack[sp] = farChild;
+					stackDist[sp] = farDist;
+					sp++;
+				}
+				nodeIndex = nearChild;
+				continue;
+			}
+		}
+
+		// pop the next node that is still in front of the closest hit
+		do
+		{
+			if (sp == 0) return closer;
+			sp--;
+		} while (stackDist[sp] > hit.t);
+		nodeIndex = stack[sp];
+	}
+	return closer;
+}
+
+// Same as closestTriBVH for the 8-wide tree: every node gives the boxes of all its children at once, leaves are tested right
+// away and the interior children that were hit are stacked farthest first so the nearest one is visited next
+bool closestTriWide(vec3 orig, vec3 dir, int root, inout Hit hit)
+{
+	vec3 invDir = 1.0 / dir;
+	bool closer = false;
+
+	int stack[wideStackSize];
+	float stackDist[wideStackSize];
+	int sp = 0;
+
+	int nodeIndex = root;
+	while (true)
+	{
+		WideNode node = wideNodes[nodeIndex];
+		// 2^(exponent - 127), built directly from the float bits so it matches the CPU side's ldexp exactly
+		vec3 scale = vec3(uintBitsToFloat((node.exponents & 0xffu) << 23),
+						  uintBitsToFloat(((node.exponents >> 8) & 0xffu) << 23),
+						  uintBitsToFloat(((node.exponents >> 16) & 0xffu) << 23));
+
+		int hitNodes[8];
+		float hitDist[8]; // descending
+		int hitCount = 0;
+		for (int c = 0; c < 8; c++)
+		{
+			int word = c >> 2;
+			int shift = 8 * (c & 3);
+			uint meta = (node.meta[word] >> shift) & 0xffu;
+			if (meta == 0u) continue;
+
+			vec3 qMin = vec3((node.quantMin[word] >> shift) & 0xffu, (node.quantMin[2 + word] >> shift) & 0xffu, (node.quantMin[4 + word] >> shift) & 0xffu);
+			vec3 qMax = vec3((node.quantMax[word] >> shift) & 0xffu, (node.quantMax[2 + word] >> shift) & 0xffu, (node.quantMax[4 + word] >> shift) & 0xffu);
+			float dist = rayBoxDist(orig, invDir, node.origin + qMin * scale, node.origin + qMax * scale, hit.t);
+			if (dist == noHit) continue;
+
+			if (meta >= 0xe0u)
+			{
+				int k = hitCount++;
+				while (k > 0 && hitDist[k - 1] < dist)
+				{
+					hitDist[k] = hitDist[k - 1];
+					hitNodes[k] = hitNodes[k - 1];
+					k--;
+				}
+				hitDist[k] = dist;
+				hitNodes[k] = int(node.childBase + (meta & 7u));
+			}
+			else
+			{
+				int first = int(node.triBase + (meta & 31u));
+				for (int tri = first; tri < first + int(meta >> 5); tri++)
+					if (rayTriHit(orig, dir, tri, hit)) closer = true;
+			}
+		}
+
+		if (hitCount > 0)
+		{
+			for (int k = 0; k < hitCount - 1; k++)
+			{
+				stack[sp] = hitNodes[k];
+				stackDist[sp] = hitDist[k];
+				sp++;
+			}
+			nodeIndex = hitNodes[hitCount - 1];
+			continue;
+		}
+
+		do
+		{
+			if (sp == 0) return closer;
+			sp--;
+		} while (stackDist[sp] > hit.t);
+		nodeIndex = stack[sp];
+	}
+	return closer;
+}
+
+// Slab test, returns the distance at which the ray enters the box (0 if it starts inside) or noHit if it misses it or enters beyond tMax
+float rayBoxDist(vec3 orig, vec3 invDir, vec3 boxMin, vec3 boxMax, float tMax)
+{
+	vec3 t0 = (boxMin - orig) * invDir;
+	vec3 t1 = (boxMax - orig) * invDir;
+	vec3 tSmall = min(t0, t1);
+	vec3 tBig = max(t0, t1);
+	float tNear = max(max(tSmall.x, tSmall.y), max(tSmall.z, 0.0));
+	float tFar = min(min(tBig.x, tBig.y), min(tBig.z, tMax));
+	return tNear <= tFar ? tNear : noHit;
+}
+
+// Moller-Trumbore against triangle tri's record, the edges are precomputed so only the ray dependent part is left
+// If the triangle is hit closer than hit.t, hit is updated with its distance, barycentrics and facing and true is returned
+bool rayTriHit(vec3 orig, vec3 dir, int tri, inout Hit hit)
+{
+	vec3 v0 = triRecord(0, tri);
+	vec3 v0v1 = triRecord(1, tri);
+	vec3 v0v2 = triRecord(2, tri);
+
 	vec3 pvec = cross(dir,v0v2);
 	float det = dot(v0v1,pvec);
 
-	// assume ray and triangle parallel if triple-scalar-product (det) small enough FRONT CULLING
+	// assume ray and triangle parallel if triple-scalar-product (det) small enough
 	if (abs(det) < epsilon) return false;
-
-	// determine if triangle is back-facing
-	if (det < epsilon) backFacing = true;
-	else backFacing = false;
+	float invDet = 1.0 / det;
 
 	vec3 tvec = orig - v0;
-	u = dot(tvec,pvec) / det;
+	float u = dot(tvec,pvec) * invDet;
 	if (u < 0 || u > 1) return false;
 
 	vec3 qvec = cross(tvec,v0v1);
-	v = dot(dir,qvec) / det;
+	float v = dot(dir,qvec) * invDet;
 	if (v < 0 || u + v > 1) return false;
 
-	t = dot(v0v2,qvec) / det;
-	if (t < 0) return false;
+	float t = dot(v0v2,qvec) * invDet;
+	if (t < 0 || t >= hit.t) return false;
 
+	hit.t = t;
+	hit.u = u;
+	hit.v = v;
+	hit.backFacing = det < epsilon;
+	hit.tri = tri;
 	return true;
-}
\ No newline at end of file
+}
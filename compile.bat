@@ -1 +1 @@
-g++ Main.cpp Shader.cpp CompShader.cpp glad.c -L C:\Users\Seth\Desktop\OpenGL\lib -lglfw3 -lopengl32 -lgdi32 -I C:\Users\Seth\Desktop\OpenGL\include
\ No newline at end of file
+g++ -std=c++17 -O2 Main.cpp Shader.cpp CompShader.cpp ProgramCache.cpp UploadRing.cpp ObjLoader.cpp ThreadPool.cpp Numa.cpp BVH.cpp GpuLBVH.cpp Scene.cpp WideBVH.cpp CpuRenderer.cpp TriangleBlocks.cpp RayPacket.cpp glad.c -L C:\Users\Seth\Desktop\OpenGL\lib -lglfw3 -lopengl32 -lgdi32 -lpsapi -I C:\Users\Seth\Desktop\OpenGL\include
\ No newline at end of file
@@ -0,0 +1,70 @@
+#version 430 core
+
+// GPU LBVH pass 1: bounds of all triangle centroids (see GpuLBVH.cpp)
+
+layout (local_size_x = 256) in;
+
+// the mesh's vertices, 3 floats each
+layout (std430, binding = 0) readonly buffer Vertices
+{
+	float vertices[];
+};
+
+// triangles in mesh order, groups of 3 vertex indices
+layout (std430, binding = 4) readonly buffer SourceIndices
+{
+	uint srcIndices[];
+};
+
+// centroid bounds as order-preserving uints (min xyz, max xyz), cleared to (~0, 0) by the host
+layout (std430, binding = 1) buffer CentroidBounds
+{
+	uint boundsMin[3];
+	uint boundsMax[3];
+};
+
+uniform uint triCount;
+
+// maps floats onto uints so that comparing the uints compares the floats
+uint orderedBits(float f)
+{
+	uint u = floatBitsToUint(f);
+	return (u & 0x80000000u) != 0u ? ~u : u | 0x80000000u;
+}
+
+vec3 srcVert(uint i)
+{
+	uint v = 3u * srcIndices[i];
+	return vec3(vertices[v], vertices[v+1u], vertices[v+2u]);
+}
+
+shared uint localMin[3];
+shared uint localMax[3];
+
+void main() {
+	if (gl_LocalInvocationIndex < 3u)
+	{
+		localMin[gl_LocalInvocationIndex] = 0xffffffffu;
+		localMax[gl_LocalInvocationIndex] = 0u;
+	}
+	barrier();
+
+	// reduce into shared memory first so only one global atomic per axis and workgroup is needed
+	for (uint tri = gl_GlobalInvocationID.x; tri < triCount; tri += gl_NumWorkGroups.x * gl_WorkGroupSize.x)
+	{
+		vec3 v0 = srcVert(3u*tri), v1 = srcVert(3u*tri+1u), v2 = srcVert(3u*tri+2u);
+		vec3 centroid = (min(min(v0, v1), v2) + max(max(v0, v1), v2)) * 0.5;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			atomicMin(localMin[axis], orderedBits(centroid[axis]));
+			atomicMax(localMax[axis], orderedBits(centroid[axis]));
+		}
+	}
+	barrier();
+
+	if (gl_LocalInvocationIndex < 3u)
+	{
+		atomicMin(boundsMin[gl_LocalInvocationIndex], localMin[gl_LocalInvocationIndex]);
+		atomicMax(boundsMax[gl_LocalInvocationIndex], localMax[gl_LocalInvocationIndex]);
+	}
+}
@@ -0,0 +1,138 @@
+#version 430 core
+
+// GPU LBVH pass 3: one thread per sorted triangle copies its indices into leaf order, and (except the last) finds internal
+// node i's range and split the way Karras (2012) does (see GpuLBVH.cpp and BVH::emitLBVH for the CPU version of the same layout)
+// Internal node i's children go into node slots 1+2i and 2+2i, the root into slot 0
+
+layout (local_size_x = 256) in;
+
+// triangles in mesh order, groups of 3 vertex indices
+layout (std430, binding = 0) readonly buffer SourceIndices
+{
+	uint srcIndices[];
+};
+
+layout (std430, binding = 1) readonly buffer Keys
+{
+	uint keys[];
+};
+
+layout (std430, binding = 2) readonly buffer Values
+{
+	uint values[];
+};
+
+// the index buffer castRay reads, in leaf order
+layout (std430, binding = 3) writeonly buffer IndexBuffer
+{
+	uint indices[];
+};
+
+struct BVHNode
+{
+	vec3 boundsMin;
+	int leftFirst;
+	vec3 boundsMax;
+	int count;
+};
+
+layout (std430, binding = 4) buffer BVHBuffer
+{
+	BVHNode nodes[];
+};
+
+struct InternalInfo
+{
+	int slot;		// node slot holding this internal node
+	int rangeFirst; // sorted triangles covered by its subtree
+	int rangeCount;
+	uint arrivals;	// bumped by each child during the refit pass
+};
+
+layout (std430, binding = 5) buffer InternalBuffer
+{
+	InternalInfo internals[];
+};
+
+layout (std430, binding = 6) writeonly buffer LeafSlots
+{
+	int leafSlot[];
+};
+
+uniform uint triCount;
+
+// length of the common prefix of sorted keys i and j, -1 if j is out of range, equal keys are told apart by position
+int commonPrefix(int i, int j)
+{
+	if (j < 0 || j >= int(triCount)) return -1;
+	uint a = keys[i], b = keys[j];
+	if (a == b) return 32 + 31 - findMSB(uint(i ^ j));
+	return 31 - findMSB(a ^ b);
+}
+
+void main() {
+	for (uint index = gl_GlobalInvocationID.x; index < triCount; index += gl_NumWorkGroups.x * gl_WorkGroupSize.x)
+	{
+		// copy the triangle's indices into leaf order
+		uint src = values[index];
+		for (uint k = 0u; k < 3u; k++)
+			indices[3u*index + k] = srcIndices[3u*src + k];
+
+		if (index + 1u >= triCount) continue;
+		int i = int(index);
+
+		// direction of the range: towards the neighbour sharing the longer prefix
+		int d = commonPrefix(i, i + 1) - commonPrefix(i, i - 1) >= 0 ? 1 : -1;
+
+		// the other end j: every key in the range shares more than dMin bits with key i
+		int dMin = commonPrefix(i, i - d);
+		int lMax = 2;
+		while (commonPrefix(i, i + lMax * d) > dMin) lMax *= 2;
+		int l = 0;
+		for (int t = lMax / 2; t >= 1; t /= 2)
+			if (commonPrefix(i, i + (l + t) * d) > dMin) l += t;
+		int j = i + l * d;
+
+		// split: the last position still sharing more than the range's common prefix with key i
+		int dNode = commonPrefix(i, j);
+		int s = 0;
+		int t = l;
+		do
+		{
+			t = (t + 1) / 2;
+			if (commonPrefix(i, i + (s + t) * d) > dNode) s += t;
+		} while (t > 1);
+		int gamma = i + s * d + min(d, 0);
+
+		int first = min(i, j);
+		int last = max(i, j);
+		internals[i].rangeFirst = first;
+		internals[i].rangeCount = last - first + 1;
+
+		for (int side = 0; side < 2; side++)
+		{
+			int child = gamma + side;
+			int slot = 1 + 2 * i + side;
+			bool leaf = side == 0 ? first == gamma : last == gamma + 1;
+			if (leaf)
+			{
+				nodes[slot].leftFirst = child;
+				nodes[slot].count = 1;
+				leafSlot[child] = slot;
+			}
+			else
+			{
+				nodes[slot].leftFirst = 1 + 2 * child;
+				nodes[slot].count = 0;
+				internals[child].slot = slot;
+			}
+		}
+
+		if (i == 0)
+		{
+			nodes[0].leftFirst = 1;
+			nodes[0].count = 0;
+			internals[0].slot = 0;
+		}
+	}
+}
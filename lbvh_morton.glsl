@@ -0,0 +1,71 @@
+#version 430 core
+
+// GPU LBVH pass 2: 30-bit Morton code of every triangle centroid (see GpuLBVH.cpp)
+
+layout (local_size_x = 256) in;
+
+layout (std430, binding = 0) readonly buffer Vertices
+{
+	float vertices[];
+};
+
+layout (std430, binding = 1) readonly buffer CentroidBounds
+{
+	uint boundsMin[3];
+	uint boundsMax[3];
+};
+
+layout (std430, binding = 2) writeonly buffer Keys
+{
+	uint keys[];
+};
+
+layout (std430, binding = 3) writeonly buffer Values
+{
+	uint values[];
+};
+
+layout (std430, binding = 4) readonly buffer SourceIndices
+{
+	uint srcIndices[];
+};
+
+uniform uint triCount;
+
+float orderedFloat(uint u)
+{
+	return uintBitsToFloat((u & 0x80000000u) != 0u ? u & 0x7fffffffu : ~u);
+}
+
+vec3 srcVert(uint i)
+{
+	uint v = 3u * srcIndices[i];
+	return vec3(vertices[v], vertices[v+1u], vertices[v+2u]);
+}
+
+// spreads the low 10 bits of v so there are two zero bits between each of them
+uint expandBits10(uint v)
+{
+	v &= 0x3ffu;
+	v = (v | (v << 16)) & 0x030000ffu;
+	v = (v | (v << 8)) & 0x0300f00fu;
+	v = (v | (v << 4)) & 0x030c30c3u;
+	v = (v | (v << 2)) & 0x09249249u;
+	return v;
+}
+
+void main() {
+	vec3 sceneMin = vec3(orderedFloat(boundsMin[0]), orderedFloat(boundsMin[1]), orderedFloat(boundsMin[2]));
+	vec3 sceneMax = vec3(orderedFloat(boundsMax[0]), orderedFloat(boundsMax[1]), orderedFloat(boundsMax[2]));
+	vec3 extent = sceneMax - sceneMin;
+	vec3 scale = vec3(extent.x > 0.0 ? 1024.0 / extent.x : 0.0, extent.y > 0.0 ? 1024.0 / extent.y : 0.0, extent.z > 0.0 ? 1024.0 / extent.z : 0.0);
+
+	for (uint tri = gl_GlobalInvocationID.x; tri < triCount; tri += gl_NumWorkGroups.x * gl_WorkGroupSize.x)
+	{
+		vec3 v0 = srcVert(3u*tri), v1 = srcVert(3u*tri+1u), v2 = srcVert(3u*tri+2u);
+		vec3 centroid = (min(min(v0, v1), v2) + max(max(v0, v1), v2)) * 0.5;
+		uvec3 cell = uvec3(min((centroid - sceneMin) * scale, vec3(1023.0)));
+		keys[tri] = (expandBits10(cell.x) << 2) | (expandBits10(cell.y) << 1) | expandBits10(cell.z);
+		values[tri] = tri;
+	}
+}
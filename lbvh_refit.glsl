@@ -0,0 +1,113 @@
+#version 430 core
+
+// GPU LBVH pass 4: bounds bottom-up. Every leaf climbs towards the root, at each internal node the first child to arrive
+// stops and the second (which can see both children's bounds) continues. Subtrees are collapsed into one leaf where the
+// SAH says a leaf is cheaper, exactly like BVH::emitLBVH does on the CPU (see GpuLBVH.cpp)
+
+layout (local_size_x = 256) in;
+
+layout (std430, binding = 0) readonly buffer Vertices
+{
+	float vertices[];
+};
+
+// triangles in leaf order, groups of 3 vertex indices
+layout (std430, binding = 5) readonly buffer IndexBuffer
+{
+	uint indices[];
+};
+
+struct BVHNode
+{
+	vec3 boundsMin;
+	int leftFirst;
+	vec3 boundsMax;
+	int count;
+};
+
+// coherent: bounds written by one invocation are read by whichever sibling arrives second
+layout (std430, binding = 1) coherent buffer BVHBuffer
+{
+	BVHNode nodes[];
+};
+
+struct InternalInfo
+{
+	int slot;
+	int rangeFirst;
+	int rangeCount;
+	uint arrivals;
+};
+
+layout (std430, binding = 2) coherent buffer InternalBuffer
+{
+	InternalInfo internals[];
+};
+
+layout (std430, binding = 3) readonly buffer LeafSlots
+{
+	int leafSlot[];
+};
+
+// area weighted SAH cost of every node slot
+layout (std430, binding = 4) coherent buffer Costs
+{
+	float cost[];
+};
+
+uniform uint triCount;
+
+const float traversalCost = 1.0;	// same cost model as BVH::traversalCost
+const float intersectionCost = 1.0; // and BVH::intersectionCost
+
+vec3 triVert(uint i)
+{
+	uint v = 3u * indices[i];
+	return vec3(vertices[v], vertices[v+1u], vertices[v+2u]);
+}
+
+float halfArea(vec3 boxMin, vec3 boxMax)
+{
+	vec3 e = boxMax - boxMin;
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+void main() {
+	for (uint leaf = gl_GlobalInvocationID.x; leaf < triCount; leaf += gl_NumWorkGroups.x * gl_WorkGroupSize.x)
+	{
+		vec3 v0 = triVert(3u*leaf), v1 = triVert(3u*leaf+1u), v2 = triVert(3u*leaf+2u);
+		int slot = leafSlot[leaf];
+		nodes[slot].boundsMin = min(min(v0, v1), v2);
+		nodes[slot].boundsMax = max(max(v0, v1), v2);
+		cost[slot] = intersectionCost * halfArea(nodes[slot].boundsMin, nodes[slot].boundsMax);
+		memoryBarrierBuffer();
+
+		while (slot != 0)
+		{
+			int parent = (slot - 1) / 2;
+			if (atomicAdd(internals[parent].arrivals, 1u) == 0u) break; // sibling still on its way
+
+			int left = 1 + 2 * parent;
+			int right = left + 1;
+			vec3 boxMin = min(nodes[left].boundsMin, nodes[right].boundsMin);
+			vec3 boxMax = max(nodes[left].boundsMax, nodes[right].boundsMax);
+
+			slot = internals[parent].slot;
+			nodes[slot].boundsMin = boxMin;
+			nodes[slot].boundsMax = boxMax;
+
+			float area = halfArea(boxMin, boxMax);
+			float splitCost = traversalCost * area + cost[left] + cost[right];
+			float leafCost = intersectionCost * area * float(internals[parent].rangeCount);
+			if (leafCost <= splitCost)
+			{
+				// the subtree covers a contiguous run of sorted triangles, so it can become one leaf
+				nodes[slot].leftFirst = internals[parent].rangeFirst;
+				nodes[slot].count = internals[parent].rangeCount;
+				cost[slot] = leafCost;
+			}
+			else cost[slot] = splitCost;
+			memoryBarrierBuffer();
+		}
+	}
+}
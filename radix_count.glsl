@@ -0,0 +1,37 @@
+#version 430 core
+
+// GPU radix sort pass 1: count the 5-bit digits of every block of 256 keys (see GpuLBVH.cpp)
+
+layout (local_size_x = 256) in;
+
+layout (std430, binding = 0) readonly buffer Keys
+{
+	uint keys[];
+};
+
+// digit-major: blockCounts[digit * blockCount + block]
+layout (std430, binding = 1) writeonly buffer BlockCounts
+{
+	uint blockCounts[];
+};
+
+uniform uint keyCount;
+uniform uint shift;
+
+shared uint histogram[32];
+
+void main() {
+	uint blockCount = (keyCount + 255u) / 256u;
+	for (uint block = gl_WorkGroupID.x; block < blockCount; block += gl_NumWorkGroups.x)
+	{
+		if (gl_LocalInvocationIndex < 32u) histogram[gl_LocalInvocationIndex] = 0u;
+		barrier();
+
+		uint i = block * 256u + gl_LocalInvocationIndex;
+		if (i < keyCount) atomicAdd(histogram[(keys[i] >> shift) & 31u], 1u);
+		barrier();
+
+		if (gl_LocalInvocationIndex < 32u) blockCounts[gl_LocalInvocationIndex * blockCount + block] = histogram[gl_LocalInvocationIndex];
+		barrier(); // histogram is reused by the next block
+	}
+}
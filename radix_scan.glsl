@@ -0,0 +1,62 @@
+#version 430 core
+
+// GPU radix sort pass 2: exclusive prefix sum over the block counts, one tile of 1024 entries per workgroup. Every tile is
+// scanned in place and its total written to tileSums, GpuLBVH.cpp scans those the same way one level up and
+// radix_scan_add.glsl adds them back, so any number of blocks is spread over many workgroups (see GpuLBVH.cpp)
+
+layout (local_size_x = 256) in;
+
+layout (std430, binding = 1) buffer Counts
+{
+	uint counts[];
+};
+
+layout (std430, binding = 2) writeonly buffer TileSums
+{
+	uint tileSums[];
+};
+
+uniform uint countLength;
+
+const uint itemsPerThread = 4u;
+const uint tileSize = 256u * itemsPerThread;
+
+shared uint partial[256];
+
+void main() {
+	uint t = gl_LocalInvocationIndex;
+	uint tileCount = (countLength + tileSize - 1u) / tileSize;
+	for (uint tile = gl_WorkGroupID.x; tile < tileCount; tile += gl_NumWorkGroups.x)
+	{
+		// every thread sums its own contiguous items
+		uint begin = tile * tileSize + t * itemsPerThread;
+		uint items[itemsPerThread];
+		uint sum = 0u;
+		for (uint k = 0u; k < itemsPerThread; k++)
+		{
+			items[k] = begin + k < countLength ? counts[begin + k] : 0u;
+			sum += items[k];
+		}
+		partial[t] = sum;
+		barrier();
+
+		// inclusive Hillis-Steele scan of the thread sums
+		for (uint offset = 1u; offset < 256u; offset <<= 1)
+		{
+			uint add = t >= offset ? partial[t - offset] : 0u;
+			barrier();
+			partial[t] += add;
+			barrier();
+		}
+
+		// rewrite the items as an exclusive scan starting from the sum of all earlier threads' items
+		uint running = t > 0u ? partial[t - 1u] : 0u;
+		for (uint k = 0u; k < itemsPerThread; k++)
+		{
+			if (begin + k < countLength) counts[begin + k] = running;
+			running += items[k];
+		}
+		if (t == 255u) tileSums[tile] = partial[255];
+		barrier(); // partial is reused by the next tile
+	}
+}
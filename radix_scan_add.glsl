@@ -0,0 +1,30 @@
+#version 430 core
+
+// GPU radix sort pass 2b: adds every tile's offset, its entry of the scanned tile sums, to the tile radix_scan.glsl scanned
+// (see GpuLBVH.cpp)
+
+layout (local_size_x = 256) in;
+
+layout (std430, binding = 1) buffer Counts
+{
+	uint counts[];
+};
+
+layout (std430, binding = 2) readonly buffer TileSums
+{
+	uint tileSums[];
+};
+
+uniform uint countLength;
+
+const uint tileSize = 1024u; // same as radix_scan.glsl
+
+void main() {
+	uint tileCount = (countLength + tileSize - 1u) / tileSize;
+	for (uint tile = gl_WorkGroupID.x; tile < tileCount; tile += gl_NumWorkGroups.x)
+	{
+		uint offset = tileSums[tile];
+		for (uint i = tile * tileSize + gl_LocalInvocationIndex; i < min((tile + 1u) * tileSize, countLength); i += 256u)
+			counts[i] += offset;
+	}
+}
@@ -0,0 +1,99 @@
+#version 430 core
+
+// GPU radix sort pass 3: stable scatter of every block of 256 keys and values to their scanned offsets (see GpuLBVH.cpp)
+
+layout (local_size_x = 256) in;
+
+layout (std430, binding = 0) readonly buffer Keys
+{
+	uint keys[];
+};
+
+layout (std430, binding = 1) readonly buffer BlockOffsets
+{
+	uint blockOffsets[];
+};
+
+layout (std430, binding = 2) readonly buffer Values
+{
+	uint values[];
+};
+
+layout (std430, binding = 3) writeonly buffer KeysOut
+{
+	uint keysOut[];
+};
+
+layout (std430, binding = 4) writeonly buffer ValuesOut
+{
+	uint valuesOut[];
+};
+
+uniform uint keyCount;
+uniform uint shift;
+
+const uint radixBits = 5u;
+
+// the block's digits and the lanes they came from, in the order of the local sort
+shared uint localDigits[256];
+shared uint localLanes[256];
+shared uint scan[256];
+shared uint digitStart[32]; // first position of every digit after the local sort
+
+// Inclusive Hillis-Steele scan of value over the workgroup, the total ends up in scan[255]
+uint inclusiveScan(uint value)
+{
+	uint t = gl_LocalInvocationIndex;
+	scan[t] = value;
+	barrier();
+	for (uint offset = 1u; offset < 256u; offset <<= 1)
+	{
+		uint add = t >= offset ? scan[t - offset] : 0u;
+		barrier();
+		scan[t] += add;
+		barrier();
+	}
+	return scan[t];
+}
+
+void main() {
+	uint blockCount = (keyCount + 255u) / 256u;
+	uint t = gl_LocalInvocationIndex;
+	for (uint block = gl_WorkGroupID.x; block < blockCount; block += gl_NumWorkGroups.x)
+	{
+		// lanes past the last key take the largest digit, the stable sort keeps them behind every real key with it
+		uint i = block * 256u + t;
+		localDigits[t] = i < keyCount ? (keys[i] >> shift) & 31u : 31u;
+		localLanes[t] = t;
+		barrier();
+
+		// stable local sort by digit, one split per bit: keys with the bit clear move to the front, both halves keep their order
+		for (uint bit = 0u; bit < radixBits; bit++)
+		{
+			uint digit = localDigits[t];
+			uint lane = localLanes[t];
+			uint clear = ((digit >> bit) & 1u) ^ 1u;
+			uint clearBefore = inclusiveScan(clear) - clear;
+			uint clearCount = scan[255];
+			uint dst = clear != 0u ? clearBefore : clearCount + t - clearBefore;
+			barrier(); // every position has been read before any is overwritten
+			localDigits[dst] = digit;
+			localLanes[dst] = lane;
+			barrier();
+		}
+
+		uint digit = localDigits[t];
+		if (t == 0u || localDigits[t - 1u] != digit) digitStart[digit] = t;
+		barrier();
+
+		// a key's rank among the block's keys with its digit is how far behind the first of them the local sort put it
+		uint src = block * 256u + localLanes[t];
+		if (src < keyCount)
+		{
+			uint dst = blockOffsets[digit * blockCount + block] + t - digitStart[digit];
+			keysOut[dst] = keys[src];
+			valuesOut[dst] = values[src];
+		}
+		barrier(); // the shared arrays are reused by the next block
+	}
+}
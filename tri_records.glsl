@@ -0,0 +1,52 @@
+#version 430 core
+
+// Precomputes the intersection records comp.glsl tests rays against from the vertex and index buffers: per triangle its
+// first vertex and the two edges leaving it, stored as structure of arrays of floats without padding: 9 planes of
+// recordStride floats (v0.x, v0.y, v0.z, then the same for v1 - v0 and for v2 - v0), 36 bytes per triangle
+// Runs over the triangles [firstTriangle, firstTriangle + triCount) of a buffer holding recordStride triangles
+
+layout (local_size_x = 256) in;
+
+layout (std430, binding = 0) readonly buffer VertexBuffer
+{
+	float vertices[];
+};
+
+// triangles in leaf order, groups of 3 vertex indices
+layout (std430, binding = 1) readonly buffer IndexBuffer
+{
+	uint indices[];
+};
+
+layout (std430, binding = 2) writeonly buffer TriangleRecords
+{
+	float triRecords[];
+};
+
+uniform uint firstTriangle;
+uniform uint triCount;
+uniform uint recordStride;
+
+void writeRecord(uint part, uint tri, vec3 value)
+{
+	triRecords[(3u * part) * recordStride + tri] = value.x;
+	triRecords[(3u * part + 1u) * recordStride + tri] = value.y;
+	triRecords[(3u * part + 2u) * recordStride + tri] = value.z;
+}
+
+vec3 triVert(uint i)
+{
+	uint v = 3u * indices[i];
+	return vec3(vertices[v], vertices[v+1u], vertices[v+2u]);
+}
+
+void main() {
+	for (uint i = gl_GlobalInvocationID.x; i < triCount; i += gl_NumWorkGroups.x * gl_WorkGroupSize.x)
+	{
+		uint tri = firstTriangle + i;
+		vec3 v0 = triVert(3u*tri), v1 = triVert(3u*tri+1u), v2 = triVert(3u*tri+2u);
+		writeRecord(0u, tri, v0);
+		writeRecord(1u, tri, v1 - v0);
+		writeRecord(2u, tri, v2 - v0);
+	}
+}